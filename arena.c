@@ -0,0 +1,116 @@
+/*
+ * arena.c - bump-pointer arenas for memory that lives as long as a
+ *     request
+ *
+ * Each worker thread owns one arena, a single block allocated when the
+ * thread starts. Everything a request needs while it is being parsed
+ * and forwarded, such as the request line, the headers, the header sent
+ * to the origin and the body collected for the cache, is carved off
+ * the front of the block by bumping an offset, and the whole lot is
+ * freed at once by setting the offset back to zero when the request is
+ * done. Nothing is ever freed on its own, and there is no locking,
+ * since an arena is only used by its own thread.
+ *
+ * arena_top() and arena_extend() let a reader fill the free space in
+ * place and then keep what it read, so that successive lines end up
+ * side by side in one string. arena_save() and arena_restore() free
+ * everything allocated after a mark, for the parts of a request that
+ * repeat, such as each origin fetch of a run of segments.
+ *
+ * An allocation that does not fit fails instead of falling back to
+ * malloc; callers treat that like any other oversized input. The few
+ * that must hold a whole cached body, which a busy request may not
+ * have room left for, take it from the heap themselves.
+ */
+#include "arena.h"
+
+#define ALIGN 8
+
+static volatile long peak;      /* Most bytes any request has used */
+static volatile long exhausted; /* Allocations that did not fit */
+
+/* Note how much of a is in use, before some of it is given back */
+static void note_peak(arena_t *a) {
+  long p;
+
+  while ((long)a->used > (p = peak))
+    if (__sync_bool_compare_and_swap(&peak, p, (long)a->used))
+      break;
+}
+
+void arena_init(arena_t *a, size_t size) {
+  a->base = Malloc(size);
+  a->size = size;
+  a->used = 0;
+}
+
+/*
+ * arena_alloc - return n bytes aligned for any type, or NULL if they do
+ *     not fit in what is left of a
+ */
+void *arena_alloc(arena_t *a, size_t n) {
+  size_t start = (a->used + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+  if (start > a->size || n > a->size - start) {
+    __sync_fetch_and_add(&exhausted, 1);
+    return NULL;
+  }
+  a->used = start + n;
+  return a->base + start;
+}
+
+/* arena_strndup - copy the first n bytes of s into a, NUL-terminated */
+char *arena_strndup(arena_t *a, const char *s, size_t n) {
+  char *p = arena_top(a, n + 1);
+
+  if (p == NULL)
+    return NULL;
+  memcpy(p, s, n);
+  p[n] = '\0';
+  arena_extend(a, n + 1);
+  return p;
+}
+
+/*
+ * arena_top - return the start of a's free space if at least want bytes
+ *     of it are left, or NULL. Nothing is allocated until the caller
+ *     keeps some of it with arena_extend().
+ */
+char *arena_top(arena_t *a, size_t want) {
+  if (want > a->size - a->used) {
+    __sync_fetch_and_add(&exhausted, 1);
+    return NULL;
+  }
+  return a->base + a->used;
+}
+
+/* arena_extend - keep the first n bytes of the free space */
+void arena_extend(arena_t *a, size_t n) {
+  a->used += n;
+}
+
+/* arena_save - mark the current top of a for arena_restore() */
+size_t arena_save(arena_t *a) {
+  return a->used;
+}
+
+/* arena_restore - free everything allocated from a since mark */
+void arena_restore(arena_t *a, size_t mark) {
+  note_peak(a);
+  a->used = mark;
+}
+
+/* arena_reset - free everything allocated from a */
+void arena_reset(arena_t *a) {
+  note_peak(a);
+  a->used = 0;
+}
+
+/*
+ * arena_stats - store the most bytes any request has used, and the
+ *     number of allocations that did not fit
+ */
+void arena_stats(long *p, long *ex) {
+  *p = peak;
+  *ex = exhausted;
+}
@@ -0,0 +1,31 @@
+/*
+ * arena.h - bump-pointer arenas for memory that lives as long as a
+ *     request
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+/* Bytes in each worker's arena; enough for the largest legal request */
+#ifndef ARENA_SIZE
+#define ARENA_SIZE (256 * 1024)
+#endif
+
+typedef struct {
+  char *base;  /* ARENA_SIZE bytes, allocated once */
+  size_t size; /* Bytes at base */
+  size_t used; /* Bytes handed out since the last reset */
+} arena_t;
+
+void arena_init(arena_t *a, size_t size);
+void *arena_alloc(arena_t *a, size_t n);
+char *arena_strndup(arena_t *a, const char *s, size_t n);
+char *arena_top(arena_t *a, size_t want);
+void arena_extend(arena_t *a, size_t n);
+size_t arena_save(arena_t *a);
+void arena_restore(arena_t *a, size_t mark);
+void arena_reset(arena_t *a);
+void arena_stats(long *peak, long *exhausted);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,171 @@
+#!/bin/bash
+#
+# bench.sh - Measures the proxy's throughput and tail latency. Starts
+#     tiny, synth and the proxy on loopback, fills tiny/bench with a set
+#     of files, and runs loadgen against them, first closed loop and then
+#     open loop. The closed-loop run is repeated against a proxy with a
+#     disk tier (-d), to compare the hit ratio and latency of the
+#     in-memory cache alone with those of both tiers. A run then goes to
+#     synth, which delays every response, over URLs that are almost never
+#     repeated, to show the proxy's miss path against a slow origin. The
+#     next one overloads a synth that serves only a few requests at a
+#     time, alongside a run of cache hits, to show the proxy shedding the
+#     excess with 503s instead of letting every queue grow. The last two
+#     runs go to a second proxy with the default per-address connection
+#     limit, at a modest open-loop rate, first alone and then alongside
+#     slowloris and slow-reader clients connecting from 127.0.0.2, to show
+#     that they leave the regular traffic's latency alone. That proxy also
+#     audits its stack use (-a). Prints loadgen's summaries, the proxies'
+#     counters, and the deepest stack use on each code path against the
+#     workers' stack size.
+#
+#     usage: ./bench.sh
+#
+#     The environment variables BENCH_CONNS, BENCH_SECS, BENCH_RATE,
+#     BENCH_URLS, BENCH_ZIPF, BENCH_TTFB, BENCH_CAPACITY and
+#     BENCH_ATTACKERS override the defaults below.
+#
+
+CONNS=${BENCH_CONNS:-32}
+SECS=${BENCH_SECS:-10}
+RATE=${BENCH_RATE:-2000}
+URLS=${BENCH_URLS:-1000}
+ZIPF=${BENCH_ZIPF:-1.0}
+TTFB=${BENCH_TTFB:-20}
+CAPACITY=${BENCH_CAPACITY:-4}
+ATTACKERS=${BENCH_ATTACKERS:-32}
+HOME_DIR=`pwd`
+
+#
+# wait_for_port - Spins until something accepts connections on the TCP
+#     port passed as an argument. Gives up after 5 seconds.
+#
+function wait_for_port {
+    for i in `seq 50`
+    do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2> /dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing is listening on port $1"
+    exit 1
+}
+
+function cleanup {
+    kill ${tiny_pid} ${synth_pid} ${busy_pid} ${proxy_pid} ${guard_pid} \
+        ${disk_pid} ${attack_pid} ${hits_pid} 2> /dev/null
+    wait 2> /dev/null
+    rm -f bench.disk
+}
+trap cleanup EXIT
+
+if [ ! -x ./proxy -o ! -x ./loadgen -o ! -x ./synth ]
+then
+    echo "Error: build proxy, loadgen and synth first (make)"
+    exit 1
+fi
+if [ ! -x ./tiny/tiny ]
+then
+    (cd ./tiny; make) > /dev/null
+fi
+
+# Files of 1 KB to 64 KB, so that each fits in the cache on its own but
+# the whole set does not
+if [ ! -e ./tiny/bench/$((URLS - 1)) ]
+then
+    echo "Creating ${URLS} files in tiny/bench"
+    mkdir -p ./tiny/bench
+    for i in `seq 0 $((URLS - 1))`
+    do
+        head -c $((1024 << (i % 7))) /dev/urandom > ./tiny/bench/$i
+    done
+fi
+
+tiny_port=`./free-port.sh`
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port ${tiny_port}
+
+synth_port=`./free-port.sh`
+./synth -s 16384 -t ${TTFB} ${synth_port} &> /dev/null &
+synth_pid=$!
+wait_for_port ${synth_port}
+
+busy_port=`./free-port.sh`
+./synth -s 16384 -t ${TTFB} -C ${CAPACITY} ${busy_port} &> /dev/null &
+busy_pid=$!
+wait_for_port ${busy_port}
+
+# All of the load comes from 127.0.0.1, so no per-address limit here
+proxy_port=`./free-port.sh`
+./proxy -l 0 ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port ${proxy_port}
+
+disk_port=`./free-port.sh`
+./proxy -l 0 -d bench.disk ${disk_port} &> /dev/null &
+disk_pid=$!
+wait_for_port ${disk_port}
+
+guard_port=`./free-port.sh`
+./proxy -a ${guard_port} &> /dev/null &
+guard_pid=$!
+wait_for_port ${guard_port}
+
+echo "== closed loop"
+./loadgen -c ${CONNS} -d ${SECS} -n ${URLS} -s ${ZIPF} \
+    -x localhost:${proxy_port} localhost ${tiny_port}
+curl --silent http://localhost:${proxy_port}/__proxy/stats \
+    | grep -E '^proxy_cache_(hits|misses)_total'
+echo ""
+echo "== closed loop, with a disk tier"
+./loadgen -c ${CONNS} -d ${SECS} -n ${URLS} -s ${ZIPF} \
+    -x localhost:${disk_port} localhost ${tiny_port}
+curl --silent http://localhost:${disk_port}/__proxy/stats \
+    | grep -E '^proxy_(cache_(hits|misses)|disk_(hits|promotions))_total'
+echo ""
+echo "== open loop"
+./loadgen -c ${CONNS} -d ${SECS} -n ${URLS} -s ${ZIPF} -r ${RATE} \
+    -x localhost:${proxy_port} localhost ${tiny_port}
+echo ""
+echo "== slow origin, ${TTFB} ms to first byte"
+./loadgen -c ${CONNS} -d ${SECS} -n 1000000 -s 0 -r $((RATE / 4)) \
+    -p "/slow/%d" -x localhost:${proxy_port} localhost ${synth_port}
+echo ""
+echo "== overloaded origin, ${CAPACITY} at a time, ${TTFB} ms each"
+./loadgen -c ${CONNS} -d ${SECS} -n 100 -s ${ZIPF} -r $((RATE / 4)) \
+    -x localhost:${proxy_port} localhost ${tiny_port} > bench.hits &
+hits_pid=$!
+./loadgen -c ${CONNS} -d ${SECS} -n 1000000 -s 0 -r $((RATE / 4)) \
+    -p "/busy/%d" -x localhost:${proxy_port} localhost ${busy_port}
+wait ${hits_pid}
+echo "-- cache hits meanwhile"
+tail -n +3 bench.hits
+rm -f bench.hits
+echo ""
+echo "== slow clients: none"
+./loadgen -c 8 -d ${SECS} -n ${URLS} -s ${ZIPF} -r $((RATE / 2)) \
+    -x localhost:${guard_port} localhost ${tiny_port}
+echo ""
+echo "== slow clients: ${ATTACKERS} slowloris, ${ATTACKERS} slow readers"
+./loadgen -c 0 -d $((SECS + 4)) -L ${ATTACKERS} -R ${ATTACKERS} \
+    -B 127.0.0.2 -u "/big?size=100000000" -x localhost:${guard_port} \
+    localhost ${synth_port} &
+attack_pid=$!
+sleep 2
+./loadgen -c 8 -d ${SECS} -n ${URLS} -s ${ZIPF} -r $((RATE / 2)) \
+    -x localhost:${guard_port} localhost ${tiny_port}
+wait ${attack_pid}
+echo ""
+echo "== proxy"
+curl --silent http://localhost:${proxy_port}/__proxy/stats \
+    | grep -E '^proxy_(cache_(hits|misses|evictions)|origin_connects|shed)_total'
+echo ""
+echo "== proxy with slow clients"
+curl --silent http://localhost:${guard_port}/__proxy/stats \
+    | grep -E '^proxy_(ip_rejects_total|reaped_total)'
+echo ""
+echo "== stack high water, 64 KB worker stacks"
+curl --silent http://localhost:${guard_port}/__proxy/stats \
+    | grep -E '^proxy_stack_high_water_bytes'
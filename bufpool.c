@@ -0,0 +1,173 @@
+/*
+ * bufpool.c - shared pool of I/O buffers, and a Rio variant that only
+ *     holds one while it has unread data
+ *
+ * A rio_t carries its RIO_BUFSIZE buffer inline, so every reader holds
+ * one for its whole life, including the time it spends waiting for the
+ * peer to send anything. A brio_t borrows a buffer from the pool only
+ * when the descriptor has data, and gives it back as soon as the caller
+ * has taken every byte of it. Before a read that would block, it waits
+ * for data with a one-byte MSG_PEEK, holding no buffer, so a connection
+ * that waits on a slow origin or an idle client costs a few words.
+ * Reads of a whole buffer or more skip the buffer altogether.
+ *
+ * Free buffers are kept on a list threaded through the buffers
+ * themselves. Each thread also keeps up to THREAD_CACHE free buffers of
+ * its own, so a thread that gets and puts buffers in turn does not take
+ * the pool's mutex at all. Buffers are never given back to malloc.
+ */
+#include "bufpool.h"
+
+#define THREAD_CACHE 2
+
+static char *free_list;      /* Free buffers, linked through their start */
+static long allocated;       /* Buffers ever allocated */
+static volatile long in_use; /* Buffers borrowed and not yet returned */
+static sem_t mutex;          /* Protects free_list and allocated */
+
+static __thread char *cache[THREAD_CACHE]; /* This thread's free buffers */
+static __thread int ncached;
+
+void bufpool_init(void) {
+  Sem_init(&mutex, 0, 1);
+}
+
+/* bufpool_get - borrow a buffer of RIO_BUFSIZE bytes */
+char *bufpool_get(void) {
+  char *buf;
+
+  __sync_fetch_and_add(&in_use, 1);
+  if (ncached > 0)
+    return cache[--ncached];
+  P(&mutex);
+  if ((buf = free_list) != NULL)
+    free_list = *(char **)buf;
+  else
+    allocated++;
+  V(&mutex);
+  return buf ? buf : Malloc(RIO_BUFSIZE);
+}
+
+/* bufpool_put - return a buffer from bufpool_get() */
+void bufpool_put(char *buf) {
+  __sync_fetch_and_sub(&in_use, 1);
+  if (ncached < THREAD_CACHE) {
+    cache[ncached++] = buf;
+    return;
+  }
+  P(&mutex);
+  *(char **)buf = free_list;
+  free_list = buf;
+  V(&mutex);
+}
+
+/* bufpool_stats - store the buffers allocated and the buffers lent out */
+void bufpool_stats(long *alloc, long *used) {
+  P(&mutex);
+  *alloc = allocated;
+  V(&mutex);
+  *used = in_use;
+}
+
+void brio_readinitb(brio_t *rp, int fd) {
+  rp->fd = fd;
+  rp->cnt = 0;
+  rp->bufptr = NULL;
+  rp->buf = NULL;
+}
+
+/* brio_release - give back rp's buffer, dropping any unread bytes */
+void brio_release(brio_t *rp) {
+  if (rp->buf)
+    bufpool_put(rp->buf);
+  rp->buf = NULL;
+  rp->cnt = 0;
+}
+
+/*
+ * brio_read - the brio_t counterpart of rio_read(): copy up to n
+ *     buffered bytes to usrbuf, refilling the buffer first if it is
+ *     empty. The buffer goes back to the pool whenever it runs dry.
+ */
+static ssize_t brio_read(brio_t *rp, char *usrbuf, size_t n) {
+  int cnt;
+  char c;
+
+  while (rp->cnt <= 0) {
+    if (!rp->buf)
+      rp->buf = bufpool_get();
+    rp->cnt = recv(rp->fd, rp->buf, RIO_BUFSIZE, MSG_DONTWAIT);
+    if (rp->cnt > 0) {
+      rp->bufptr = rp->buf;
+      break;
+    }
+    if (rp->cnt == 0 || (errno != EAGAIN && errno != EINTR)) {
+      cnt = rp->cnt;
+      brio_release(rp);
+      return cnt; /* EOF or error */
+    }
+    if (errno == EAGAIN) { /* Wait for data without holding a buffer */
+      brio_release(rp);
+      if (recv(rp->fd, &c, 1, MSG_PEEK) < 0 && errno != EINTR)
+        return -1;
+    }
+  }
+
+  cnt = n < (size_t)rp->cnt ? (int)n : rp->cnt;
+  memcpy(usrbuf, rp->bufptr, cnt);
+  rp->bufptr += cnt;
+  rp->cnt -= cnt;
+  if (rp->cnt == 0)
+    brio_release(rp);
+  return cnt;
+}
+
+/*
+ * brio_readnb - robustly read n bytes, as rio_readnb() does. Once the
+ *     buffer is empty, reads of a whole buffer or more go straight to
+ *     usrbuf.
+ */
+ssize_t brio_readnb(brio_t *rp, void *usrbuf, size_t n) {
+  size_t nleft = n;
+  ssize_t nread;
+  char *bufp = usrbuf;
+
+  while (nleft > 0) {
+    if (rp->cnt <= 0 && nleft >= RIO_BUFSIZE) {
+      if ((nread = read(rp->fd, bufp, nleft)) < 0 && errno == EINTR)
+        continue;
+    } else
+      nread = brio_read(rp, bufp, nleft);
+    if (nread < 0)
+      return -1;
+    else if (nread == 0)
+      break; /* EOF */
+    nleft -= nread;
+    bufp += nread;
+  }
+  return n - nleft;
+}
+
+/* brio_readlineb - robustly read a text line, as rio_readlineb() does */
+ssize_t brio_readlineb(brio_t *rp, void *usrbuf, size_t maxlen) {
+  size_t n;
+  int rc;
+  char c, *bufp = usrbuf;
+
+  for (n = 1; n < maxlen; n++) {
+    if ((rc = brio_read(rp, &c, 1)) == 1) {
+      *bufp++ = c;
+      if (c == '\n') {
+        n++;
+        break;
+      }
+    } else if (rc == 0) {
+      if (n == 1)
+        return 0; /* EOF, no data read */
+      break;      /* EOF, some data was read */
+    } else
+      return -1; /* Error */
+  }
+  *bufp = 0;
+  return n - 1;
+}
@@ -0,0 +1,28 @@
+/*
+ * bufpool.h - shared pool of I/O buffers, and a Rio variant that only
+ *     holds one while it has unread data
+ */
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include "csapp.h"
+
+/* Like rio_t, with a buffer borrowed from the pool instead of inline */
+typedef struct {
+  int fd;       /* Descriptor read from */
+  int cnt;      /* Unread bytes in buf */
+  char *bufptr; /* Next unread byte in buf */
+  char *buf;    /* RIO_BUFSIZE bytes from the pool, or NULL */
+} brio_t;
+
+void bufpool_init(void);
+char *bufpool_get(void);
+void bufpool_put(char *buf);
+void bufpool_stats(long *allocated, long *in_use);
+
+void brio_readinitb(brio_t *rp, int fd);
+ssize_t brio_readnb(brio_t *rp, void *usrbuf, size_t n);
+ssize_t brio_readlineb(brio_t *rp, void *usrbuf, size_t maxlen);
+void brio_release(brio_t *rp);
+
+#endif /* __BUFPOOL_H__ */
@@ -0,0 +1,508 @@
+/*
+ * cache.c - LRU cache of Web objects shared by the proxy threads
+ *
+ * Objects are found through a chained hash table and kept on a doubly
+ * linked list in recency order. The total size of the cached bodies
+ * never exceeds MAX_CACHE_SIZE; the least recently used objects are
+ * evicted to make room. The table is indexed by the hash of the key,
+ * which callers compute once per request and pass in (see uri.c), and
+ * which each object keeps, so keys are never hashed here.
+ *
+ * Lookups hand out a reference to the object so that its body can be
+ * written to a slow client without holding the cache lock. An evicted
+ * object is freed when its last reference is released.
+ *
+ * Every object records when it stops being fresh. Stale objects stay
+ * cached so that the proxy can revalidate them with a conditional GET
+ * and, on a 304, extend their lifetime with cache_refresh(). The
+ * refreshing flag makes sure only one background refresh per object is
+ * under way at any time.
+ *
+ * An evicted object can be handed to a function set with
+ * cache_on_evict(), such as a second, larger cache tier (see disk.c).
+ * It is called after the mutex is released, with a reference held for
+ * the duration of the call.
+ *
+ * A variant is chained off its primary entry, found by the primary's
+ * key (see vary.c), which is the one key the cache hashes itself. One
+ * whose primary is not cached is not cached either, since no lookup
+ * would ever reach it.
+ *
+ * Bodies are kept in a content-addressed store (see dedup.c), so that
+ * objects cached under different keys with the same bytes share one
+ * copy. Each body counts towards MAX_CACHE_SIZE once, however many
+ * cached objects use it, and evicting one of them frees nothing while
+ * the others remain.
+ *
+ * After cache_share(), the cache lives in a shared memory segment
+ * instead, for worker processes forked afterwards (see shcache.c), and
+ * the functions below hand their work on to it. The objects it returns
+ * are marked shared. Should the segment become unusable, each process
+ * goes back to the private cache.
+ */
+#include "cache.h"
+#include "dedup.h"
+#include "shcache.h"
+#include "stats.h"
+#include "uri.h"
+#include "vary.h"
+
+#define NBUCKETS 1024
+
+static cache_obj_t *buckets[NBUCKETS];
+static cache_obj_t *head, *tail; /* Most and least recently used */
+static size_t cache_size;        /* Sum of the distinct cached bodies */
+static long cache_count;         /* Objects in the cache */
+static long evictions;           /* Objects evicted to make room */
+static sem_t mutex;              /* Protects all of the above */
+static void (*evict_hook)(cache_obj_t *obj); /* Takes evicted objects */
+
+/* Drop a reference; the caller holds the mutex */
+static void obj_put(cache_obj_t *obj) {
+  if (--obj->refcnt > 0)
+    return;
+  if (obj->shared)
+    shcache_release(obj);
+  else {
+    if (obj->store)
+      dedup_put(obj->store);
+    Free(obj); /* Strings included */
+  }
+}
+
+/* Bytes that caching obj would add, nothing if its body is cached */
+static size_t charge(cache_obj_t *obj) {
+  return obj->store && obj->store->cached ? 0 : obj->size;
+}
+
+static void lru_unlink(cache_obj_t *obj) {
+  if (obj->prev)
+    obj->prev->next = obj->next;
+  else
+    head = obj->next;
+  if (obj->next)
+    obj->next->prev = obj->prev;
+  else
+    tail = obj->prev;
+  obj->prev = obj->next = NULL;
+}
+
+static void lru_push(cache_obj_t *obj) {
+  obj->prev = NULL;
+  obj->next = head;
+  if (head)
+    head->prev = obj;
+  head = obj;
+  if (!tail)
+    tail = obj;
+}
+
+/*
+ * Take obj out of the index, and the variants of a primary entry with
+ * it; the caller holds the mutex
+ */
+static void unindex(cache_obj_t *obj) {
+  cache_obj_t **pp = &buckets[obj->hash % NBUCKETS];
+
+  while (*pp != obj)
+    pp = &(*pp)->hnext;
+  *pp = obj->hnext;
+  if (obj->primary) {
+    for (pp = &obj->primary->variants; *pp != obj; pp = &(*pp)->vnext)
+      ;
+    *pp = obj->vnext;
+    obj->primary = obj->vnext = NULL;
+  }
+  while (obj->variants)
+    unindex(obj->variants);
+  lru_unlink(obj);
+  if (obj->store)
+    obj->store->cached--;
+  cache_size -= charge(obj);
+  cache_count--;
+  obj_put(obj);
+}
+
+static cache_obj_t *find(const char *key, uint64_t hash) {
+  cache_obj_t *obj = buckets[hash % NBUCKETS];
+
+  while (obj && (obj->hash != hash || strcmp(obj->key, key)))
+    obj = obj->hnext;
+  return obj;
+}
+
+/*
+ * primary_key - return a Malloc'd copy of the key of the primary entry
+ *     of the variant under key, and its hash in *hash, or NULL if key is
+ *     not a variant's
+ */
+static char *primary_key(const char *key, uint64_t *hash) {
+  size_t n = vary_primary(key);
+  char *pkey;
+
+  if (n == 0)
+    return NULL;
+  pkey = Malloc(n + 1);
+  memcpy(pkey, key, n);
+  pkey[n] = '\0';
+  *hash = uri_hash(pkey);
+  return pkey;
+}
+
+/*
+ * adopt - chain the just-indexed variant obj off its primary entry, and
+ *     make that the most recently used; or if it is not cached, take obj
+ *     out again. The caller holds the mutex. Returns 1 if obj stays.
+ */
+static int adopt(cache_obj_t *obj, const char *pkey, uint64_t phash) {
+  cache_obj_t *primary = find(pkey, phash);
+
+  if (primary == NULL || !CACHE_VARIED(primary)) {
+    unindex(obj);
+    return 0;
+  }
+  obj->primary = primary;
+  obj->vnext = primary->variants;
+  primary->variants = obj;
+  lru_unlink(primary);
+  lru_push(primary);
+  return 1;
+}
+
+void cache_init(void) {
+  Sem_init(&mutex, 0, 1);
+  dedup_init();
+}
+
+/*
+ * cache_share - move the cache into a shared memory segment, for the
+ *     processes forked from now on; or with fd >= 0, into the segment
+ *     another process passed on. Each process calls cache_attach().
+ *     Returns the segment's memfd.
+ */
+int cache_share(int fd) {
+  shcache_init(fd);
+  return shcache_fd();
+}
+
+/* cache_attach - start using the shared cache in a forked process */
+void cache_attach(void) {
+  if (shcache_attach() < 0)
+    fprintf(stderr, "cache: no room in the shared cache, using our own\n");
+}
+
+/* cache_reap - let go of the shared objects a dead process held */
+int cache_reap(pid_t pid) {
+  return shcache_reap(pid);
+}
+
+/*
+ * cache_on_evict - have fn called with every object evicted to make
+ *     room from now on. Call it before the cache is used.
+ */
+void cache_on_evict(void (*fn)(cache_obj_t *obj)) {
+  evict_hook = fn;
+}
+
+/*
+ * cache_lookup - return a referenced object for key, or NULL on a miss.
+ *     The caller must hand it back with cache_release().
+ */
+cache_obj_t *cache_lookup(const char *key, uint64_t hash) {
+  cache_obj_t *obj;
+
+  stats_inc(ST_LOOKUPS);
+  if (shcache_usable())
+    obj = shcache_lookup(key, hash);
+  else {
+    P(&mutex);
+    if ((obj = find(key, hash)) != NULL) {
+      lru_unlink(obj);
+      lru_push(obj);
+      if (obj->primary) { /* Kept ahead of its variants */
+        lru_unlink(obj->primary);
+        lru_push(obj->primary);
+      }
+      obj->refcnt++;
+    }
+    V(&mutex);
+  }
+  if (obj)
+    stats_inc(ST_LOOKUP_HITS);
+  return obj;
+}
+
+/* Copy the n bytes at s to *p, and move *p past them */
+static char *put(char **p, const void *s, size_t n) {
+  char *dst = memcpy(*p, s, n);
+
+  *p += n;
+  return dst;
+}
+
+/*
+ * new_obj - build an unindexed copy of an object, with a reference for
+ *     the cache. The object and its strings share a single allocation;
+ *     the body comes from the store, shared if it is there already.
+ */
+static cache_obj_t *new_obj(const char *key, uint64_t hash,
+                            const objmeta_t *meta, const char *body,
+                            size_t size, size_t total) {
+  cache_obj_t *obj;
+  size_t keylen = strlen(key) + 1, typelen = strlen(meta->type) + 1;
+  size_t etaglen = strlen(meta->etag) + 1;
+  size_t modlen = strlen(meta->lastmod) + 1;
+  char *p;
+
+  obj = Malloc(sizeof(cache_obj_t) + keylen + typelen + etaglen + modlen);
+  p = (char *)(obj + 1);
+  obj->store = size ? dedup_get(body, size) : NULL;
+  obj->body = size ? obj->store->data : NULL;
+  obj->key = put(&p, key, keylen);
+  obj->hash = hash;
+  obj->meta.status = meta->status;
+  obj->meta.type = put(&p, meta->type, typelen);
+  obj->meta.etag = put(&p, meta->etag, etaglen);
+  obj->meta.lastmod = put(&p, meta->lastmod, modlen);
+  obj->meta.expires = meta->expires;
+  obj->meta.swr = meta->swr;
+  obj->meta.plain = meta->plain;
+  obj->size = size;
+  obj->total = total;
+  obj->refcnt = 1;
+  obj->refreshing = 0;
+  obj->shared = 0;
+  obj->primary = obj->variants = obj->vnext = NULL;
+  return obj;
+}
+
+/*
+ * add - index obj and make it the most recently used, evicting LRU
+ *     objects to make room. The caller holds the mutex. Returns the
+ *     evicted objects if there is an evict hook, chained through hnext
+ *     and each with a reference, for evicted().
+ */
+static cache_obj_t *add(cache_obj_t *obj) {
+  unsigned b = obj->hash % NBUCKETS;
+  cache_obj_t *victims = NULL, *victim;
+
+  while (cache_size + charge(obj) > MAX_CACHE_SIZE && tail) {
+    victim = tail;
+    if (evict_hook)
+      victim->refcnt++;
+    unindex(victim);
+    evictions++;
+    if (evict_hook) {
+      victim->hnext = victims;
+      victims = victim;
+    }
+  }
+  obj->hnext = buckets[b];
+  buckets[b] = obj;
+  lru_push(obj);
+  cache_size += charge(obj);
+  if (obj->store)
+    obj->store->cached++;
+  cache_count++;
+  return victims;
+}
+
+/* Pass objects evicted by add() to the evict hook, then let them go */
+static void evicted(cache_obj_t *victims) {
+  cache_obj_t *next;
+
+  for (; victims; victims = next) {
+    next = victims->hnext;
+    evict_hook(victims);
+    cache_release(victims);
+  }
+}
+
+/*
+ * cache_insert - copy an object into the cache, replacing any older copy
+ *     under the same key and evicting LRU objects to make room
+ */
+void cache_insert(const char *key, uint64_t hash, const objmeta_t *meta,
+                  const char *body, size_t size, size_t total) {
+  cache_obj_t *obj, *old, *victims;
+  uint64_t phash;
+  char *pkey;
+
+  if (size > MAX_OBJECT_SIZE)
+    return;
+  pkey = primary_key(key, &phash);
+  if (shcache_usable()) {
+    shcache_insert(key, hash, meta, body, size, total, pkey, phash);
+    Free(pkey);
+    return;
+  }
+
+  obj = new_obj(key, hash, meta, body, size, total);
+  P(&mutex);
+  if ((old = find(key, hash)) != NULL)
+    unindex(old);
+  victims = add(obj);
+  if (pkey)
+    adopt(obj, pkey, phash);
+  V(&mutex);
+  Free(pkey);
+  evicted(victims);
+}
+
+/*
+ * cache_restore - copy an object saved earlier into the cache, unless
+ *     something is cached under its key already, which is newer. Other
+ *     objects are evicted to make room only if evict is set. Returns 1
+ *     if the object went in, 0 if not.
+ */
+int cache_restore(const char *key, uint64_t hash, const objmeta_t *meta,
+                  const char *body, size_t size, size_t total, int evict) {
+  cache_obj_t *obj, *victims;
+  uint64_t phash;
+  char *pkey;
+  int rc = 1;
+
+  if (size > MAX_OBJECT_SIZE)
+    return 0;
+
+  obj = new_obj(key, hash, meta, body, size, total);
+  pkey = primary_key(key, &phash);
+  P(&mutex);
+  if (find(key, hash) ||
+      (!evict && cache_size + charge(obj) > MAX_CACHE_SIZE)) {
+    obj_put(obj);
+    V(&mutex);
+    Free(pkey);
+    return 0;
+  }
+  victims = add(obj);
+  if (pkey)
+    rc = adopt(obj, pkey, phash);
+  V(&mutex);
+  Free(pkey);
+  evicted(victims);
+  return rc;
+}
+
+/*
+ * cache_detached - return a referenced copy of an object that is not
+ *     in the cache, for a caller to serve once. cache_release() frees it.
+ */
+cache_obj_t *cache_detached(const char *key, uint64_t hash,
+                            const objmeta_t *meta, const char *body,
+                            size_t size, size_t total) {
+  cache_obj_t *obj = new_obj(key, hash, meta, body, size, total);
+
+  obj->hnext = obj->prev = obj->next = NULL;
+  return obj;
+}
+
+/*
+ * cache_hold_all - return a Malloc'd array of references to every
+ *     cached object, least recently used first, and their number in *n.
+ *     The caller releases each one and frees the array.
+ */
+cache_obj_t **cache_hold_all(int *n) {
+  cache_obj_t **objs, *obj;
+  int i = 0;
+
+  P(&mutex);
+  objs = Malloc((cache_count + 1) * sizeof(cache_obj_t *));
+  for (obj = tail; obj; obj = obj->prev) {
+    obj->refcnt++;
+    objs[i++] = obj;
+  }
+  V(&mutex);
+  *n = i;
+  return objs;
+}
+
+/*
+ * cache_refresh - mark a revalidated object fresh until expires. The
+ *     body stays where it is.
+ */
+void cache_refresh(cache_obj_t *obj, time_t expires) {
+  P(&mutex);
+  obj->meta.expires = expires;
+  V(&mutex);
+  if (obj->shared)
+    shcache_refresh(obj, expires);
+}
+
+/* cache_remove - forget the object cached under key, if any */
+void cache_remove(const char *key, uint64_t hash) {
+  cache_obj_t *obj;
+
+  if (shcache_usable())
+    shcache_remove(key, hash);
+  P(&mutex);
+  if ((obj = find(key, hash)) != NULL)
+    unindex(obj);
+  V(&mutex);
+}
+
+/* cache_hold - take another reference to an object we already hold */
+void cache_hold(cache_obj_t *obj) {
+  P(&mutex);
+  obj->refcnt++;
+  V(&mutex);
+}
+
+void cache_release(cache_obj_t *obj) {
+  P(&mutex);
+  obj_put(obj);
+  V(&mutex);
+}
+
+/*
+ * cache_claim_refresh - return 1 if the caller may start refreshing obj,
+ *     0 if another refresh of it is already under way
+ */
+int cache_claim_refresh(cache_obj_t *obj) {
+  int claimed;
+
+  if (obj->shared)
+    return shcache_claim_refresh(obj);
+  P(&mutex);
+  claimed = !obj->refreshing;
+  obj->refreshing = 1;
+  V(&mutex);
+  return claimed;
+}
+
+void cache_end_refresh(cache_obj_t *obj) {
+  if (obj->shared) {
+    shcache_end_refresh(obj);
+    return;
+  }
+  P(&mutex);
+  obj->refreshing = 0;
+  V(&mutex);
+}
+
+/* segment_key - build the key under which segment idx of key is cached */
+void segment_key(char *buf, const char *key, long idx) {
+  sprintf(buf, "%s#%ld", key, idx);
+}
+
+/*
+ * cache_stats - take a consistent snapshot of the cache's occupancy. The
+ *     lookups are summed from the threads' counters (see stats.c), or
+ *     taken from the shared cache, which counts them for all processes.
+ */
+void cache_stats(cache_stats_t *st) {
+  long totals[NSTATS];
+
+  if (shcache_usable()) {
+    shcache_stats(st);
+    return;
+  }
+  P(&mutex);
+  st->entries = cache_count;
+  st->bytes = cache_size;
+  st->evictions = evictions;
+  V(&mutex);
+  stats_sum(totals);
+  st->lookups = totals[ST_LOOKUPS];
+  st->found = totals[ST_LOOKUP_HITS];
+}
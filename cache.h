@@ -0,0 +1,122 @@
+/*
+ * cache.h - LRU cache of Web objects shared by the proxy threads
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/*
+ * Objects larger than MAX_OBJECT_SIZE are cached in SEGMENT_SIZE pieces.
+ * The object's own key then holds an index entry with no body (size 0,
+ * total = object length), and segment n lives under "<key>#<n>".
+ */
+#define SEGMENT_SIZE 32768
+
+/*
+ * A response that varies with the request's headers is cached as a
+ * variant (see vary.c). The URI's own key then holds the primary entry,
+ * whose body is the response's Vary list (size > 0, total 0), and each
+ * variant lives under "<key>#v<hash>". The primary owns its variants:
+ * a variant is only cached while its primary is, chained off it, and
+ * goes when it does. Inserting or looking up a variant makes its
+ * primary more recently used than it, so that the primary is never
+ * evicted ahead of a variant.
+ */
+
+/*
+ * Default freshness lifetime, used when the origin sends no max-age, and
+ * how long past that an object may still be served while a background
+ * refresh runs (stale-while-revalidate). Both are proxy options.
+ */
+#ifndef CACHE_TTL
+#define CACHE_TTL 60
+#endif
+#ifndef CACHE_SWR
+#define CACHE_SWR 300
+#endif
+
+/* Lifetime of a cached 4xx/5xx answer (a negative entry) */
+#ifndef CACHE_NEG_TTL
+#define CACHE_NEG_TTL 5
+#endif
+
+/* Response metadata kept with each object */
+typedef struct {
+  int status;     /* 200, or the error status of a negative entry */
+  char *type;     /* Content-Type */
+  char *etag;     /* ETag validator, "" if the origin sent none */
+  char *lastmod;  /* Last-Modified validator, "" if none */
+  time_t expires; /* Fresh until this time, then revalidated */
+  int swr;        /* Seconds past expires it may be served stale */
+  long plain;     /* Body length before gzip, 0 if kept as it came */
+} objmeta_t;
+
+typedef struct cache_obj {
+  char *key;                     /* Request URI, or "<uri>#<n>" */
+  uint64_t hash;                 /* uri_hash(key), see uri.c */
+  objmeta_t meta;                /* Type, validators and freshness */
+  char *body;                    /* Response body, NULL for index entries */
+  struct body *store;            /* Holds body, unless shared (dedup.c) */
+  size_t size;                   /* Bytes in body */
+  size_t total;                  /* Length of the whole object */
+  int refcnt;                    /* Holders, including the cache itself */
+  int refreshing;                /* A background refresh is under way */
+  int shared;                    /* Lives in the shared cache */
+  struct cache_obj *hnext;       /* Next object in the hash chain */
+  struct cache_obj *prev, *next; /* LRU list, most recent first */
+  struct cache_obj *primary;     /* Of a variant, NULL for other objects */
+  struct cache_obj *variants;    /* Of a primary entry, chained by vnext */
+  struct cache_obj *vnext;
+} cache_obj_t;
+
+/* Occupancy of the cache, see cache_stats() */
+typedef struct {
+  long entries;   /* Objects, index entries and segments in the cache */
+  long bytes;     /* Sum of their distinct bodies, at most MAX_CACHE_SIZE */
+  long evictions; /* Objects evicted to make room since startup */
+  long lookups;   /* Lookups since startup, by all processes sharing it */
+  long found;     /* ... of which found an object */
+} cache_stats_t;
+
+/* True for the index entry of an object stored as segments */
+#define CACHE_SEGMENTED(obj) ((obj)->size < (obj)->total)
+
+/* True for the primary entry of an object cached as variants */
+#define CACHE_VARIED(obj) ((obj)->total < (obj)->size)
+
+/* True while obj may be served without asking the origin */
+#define CACHE_FRESH(obj, now) ((now) < (obj)->meta.expires)
+
+/* True while a stale obj may be served as its refresh runs */
+#define CACHE_USABLE(obj, now) ((now) < (obj)->meta.expires + (obj)->meta.swr)
+
+void cache_init(void);
+int cache_share(int fd);
+void cache_attach(void);
+int cache_reap(pid_t pid);
+void cache_on_evict(void (*fn)(cache_obj_t *obj));
+cache_obj_t *cache_lookup(const char *key, uint64_t hash);
+void cache_insert(const char *key, uint64_t hash, const objmeta_t *meta,
+                  const char *body, size_t size, size_t total);
+int cache_restore(const char *key, uint64_t hash, const objmeta_t *meta,
+                  const char *body, size_t size, size_t total, int evict);
+cache_obj_t *cache_detached(const char *key, uint64_t hash,
+                            const objmeta_t *meta, const char *body,
+                            size_t size, size_t total);
+cache_obj_t **cache_hold_all(int *n);
+void cache_refresh(cache_obj_t *obj, time_t expires);
+void cache_remove(const char *key, uint64_t hash);
+void cache_hold(cache_obj_t *obj);
+void cache_release(cache_obj_t *obj);
+int cache_claim_refresh(cache_obj_t *obj);
+void cache_end_refresh(cache_obj_t *obj);
+void segment_key(char *buf, const char *key, long idx);
+void cache_stats(cache_stats_t *st);
+
+#endif /* __CACHE_H__ */
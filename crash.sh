@@ -0,0 +1,153 @@
+#!/bin/bash
+#
+# crash.sh - Checks that the cache shared by a proxy's -P worker
+#     processes outlives workers that die in the middle of using it.
+#     Starts synth and a proxy with CRASH_PROCS workers on loopback.
+#     First, under a stream of misses, it kills every worker with
+#     SIGKILL CRASH_ROUNDS times over, so that some may die filling in
+#     a new entry. Then it caches one object from a URL that synth takes
+#     2 seconds to answer, lets it go stale, and CRASH_ROUNDS times over
+#     asks for it, which has a worker hold the stale copy while it
+#     refreshes it, and kills every worker meanwhile. Last, it checks
+#     that the parent reaped every worker killed, that each round's
+#     refresh found the copy let go of by the last one, that no process
+#     gave up on the shared cache, and that the object is still served
+#     from it, intact.
+#
+#     usage: ./crash.sh
+#
+#     The environment variables CRASH_PROCS and CRASH_ROUNDS override
+#     the defaults below. Exits with 1 if a check fails.
+#
+
+PROCS=${CRASH_PROCS:-4}
+ROUNDS=${CRASH_ROUNDS:-10}
+OBJECT="/crash?size=81920&maxage=1&ttfb=2000"
+LOG=crash.log
+
+#
+# wait_for_port - Spins until something accepts connections on the TCP
+#     port passed as an argument. Gives up after 5 seconds.
+#
+function wait_for_port {
+    for i in `seq 50`
+    do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2> /dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing is listening on port $1"
+    exit 1
+}
+
+#
+# kill_workers - Kills every worker process of the proxy with SIGKILL,
+#     and counts them in killed
+#
+function kill_workers {
+    pids=`pgrep -P ${proxy_pid}`
+    kill -KILL ${pids} 2> /dev/null
+    killed=$((killed + `echo ${pids} | wc -w`))
+    sleep 0.5 # For the parent to reap them and fork new ones
+}
+
+#
+# lookup_hits - Prints how many lookups of the shared cache found an
+#     object, over all the processes sharing it
+#
+function lookup_hits {
+    curl --silent http://localhost:${proxy_port}/__proxy/stats \
+        | awk '/^proxy_cache_lookup_hits_total/ { print $2 }'
+}
+
+function cleanup {
+    kill ${synth_pid} ${proxy_pid} ${load_pid} 2> /dev/null
+    wait 2> /dev/null
+    rm -f ${LOG}
+}
+trap cleanup EXIT
+
+if [ ! -x ./proxy -o ! -x ./loadgen -o ! -x ./synth ]
+then
+    echo "Error: build proxy, loadgen and synth first (make)"
+    exit 1
+fi
+
+synth_port=`./free-port.sh`
+./synth ${synth_port} &> /dev/null &
+synth_pid=$!
+wait_for_port ${synth_port}
+
+# All of the load comes from 127.0.0.1, so no per-address limit here
+proxy_port=`./free-port.sh`
+./proxy -l 0 -P ${PROCS} ${proxy_port} 2> ${LOG} > /dev/null &
+proxy_pid=$!
+wait_for_port ${proxy_port}
+killed=0
+
+echo "== killing ${PROCS} workers ${ROUNDS} times, while they fill entries"
+./loadgen -c 16 -d $((ROUNDS + 2)) -n 1000000 -s 0 \
+    -p "/fill/%d?size=50000&maxage=600" -x localhost:${proxy_port} \
+    localhost ${synth_port} &> /dev/null &
+load_pid=$!
+sleep 1
+for i in `seq ${ROUNDS}`
+do
+    kill_workers
+    sleep 0.5
+done
+wait ${load_pid}
+
+echo "== killing ${PROCS} workers ${ROUNDS} times, while they hold entries"
+curl --silent --output /dev/null --proxy localhost:${proxy_port} \
+    "http://localhost:${synth_port}${OBJECT}"
+sleep 1.5 # Stale, and refreshed by the next request that hits it
+for i in `seq ${ROUNDS}`
+do
+    curl --silent --output /dev/null --proxy localhost:${proxy_port} \
+        "http://localhost:${synth_port}${OBJECT}"
+    sleep 0.5
+    kill_workers
+done
+
+echo "== after the crashes"
+failed=0
+reaped=`grep -c "killed by signal 9" ${LOG}`
+held=`awk '/killed by signal 9/ { n += $(NF - 1) } END { print n + 0 }' \
+    ${LOG}`
+echo "${killed} workers killed, ${reaped} reaped, holding ${held} entries"
+if [ ${reaped} -ne ${killed} ]
+then
+    echo "FAIL: the parent did not reap every worker killed"
+    failed=1
+fi
+if [ ${held} -lt ${ROUNDS} ]
+then
+    echo "FAIL: a refresh was still claimed by a worker killed before"
+    failed=1
+fi
+if grep -q "going back to private caches" ${LOG}
+then
+    echo "FAIL: a process gave up on the shared cache"
+    failed=1
+fi
+
+# Every fetch must hit the stale copy
+want=`curl --silent "http://localhost:${synth_port}${OBJECT}" | md5sum`
+before=`lookup_hits`
+bad=0
+for i in `seq $((PROCS * 4))`
+do
+    got=`curl --silent --proxy localhost:${proxy_port} \
+        "http://localhost:${synth_port}${OBJECT}" | md5sum`
+    [ "${got}" == "${want}" ] || bad=$((bad + 1))
+done
+after=`lookup_hits`
+echo "$((PROCS * 4)) fetches: $((after - before)) shared cache hits," \
+    "${bad} bad bodies"
+if [ $((after - before)) -lt $((PROCS * 4)) -o ${bad} -ne 0 ]
+then
+    echo "FAIL: the shared cache no longer serves the object"
+    failed=1
+fi
+[ ${failed} -eq 0 ] && echo "PASS"
+exit ${failed}
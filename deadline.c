@@ -0,0 +1,264 @@
+/*
+ * deadline.c - I/O deadlines for the proxy's blocking sockets
+ *
+ * Pending deadlines live in a hierarchical timing wheel: WHEEL_LEVELS
+ * levels of WHEEL_SLOTS slots, level l slot i holding the deadlines
+ * due in the i-th span of WHEEL_SLOTS^l ticks of the current level
+ * l + 1 span. Arming and cancelling link or unlink a list node, so
+ * both are O(1) and need no system call. A reaper thread advances the
+ * wheel every TICK_MS, moving the deadlines of each higher-level slot
+ * down a level when their span comes up, and shuts down the socket of
+ * every deadline that falls due, which makes whatever blocking call
+ * its thread is in return.
+ *
+ * Touching a deadline only moves its expiry tick later; the wheel is
+ * not updated. When the reaper reaches a deadline that is not due yet,
+ * it files it again under its new tick. A paused deadline is filed
+ * again a full period ahead each time, until it is touched or
+ * cancelled.
+ *
+ * A deadline with a minimum rate grants its period once, as a grace,
+ * plus one second for every rate bytes of progress, counted only while
+ * it runs. Its owner credits progress on reads as the data comes in.
+ * Progress on writes is what the peer has acknowledged, which the
+ * reaper asks the kernel for when the deadline comes due: bytes that
+ * were only copied into the socket's send buffer, which may hold
+ * megabytes, say nothing about how fast the client is reading.
+ *
+ * The owner of a deadline must cancel it before closing the socket.
+ * The reaper shuts sockets down with the mutex held, so after
+ * deadline_cancel() returns it can no longer touch a descriptor that
+ * the kernel has since handed out again.
+ */
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "deadline.h"
+
+#define TICK_MS 100
+#define TICKS_PER_SEC (1000 / TICK_MS)
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4 /* 2^24 ticks, about 19 days */
+
+const char *deadline_names[NDL] = {"header", "connect", "origin_idle",
+                                   "client_write"};
+
+static deadline_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static volatile long ticks; /* Ticks since deadline_init() */
+static long reaped[NDL];    /* Deadlines that fired, by reason */
+static sem_t mutex;         /* Protects all of the above */
+
+void *reaper(void *vargp);
+
+/* File d under its expiry tick; the caller holds the mutex */
+static void insert(deadline_t *d) {
+  long e = d->expires > ticks ? d->expires : ticks;
+  deadline_t **slot;
+  int l;
+
+  for (l = 0; l < WHEEL_LEVELS - 1; l++)
+    if ((e >> (WHEEL_BITS * (l + 1))) == (ticks >> (WHEEL_BITS * (l + 1))))
+      break;
+  if ((e >> (WHEEL_BITS * WHEEL_LEVELS)) !=
+      (ticks >> (WHEEL_BITS * WHEEL_LEVELS)))
+    e = ticks - (1L << (WHEEL_BITS * l)); /* Too far out: the last slot */
+  slot = &wheel[l][(e >> (WHEEL_BITS * l)) & WHEEL_MASK];
+
+  d->slot = slot;
+  d->prev = NULL;
+  d->next = *slot;
+  if (*slot)
+    (*slot)->prev = d;
+  *slot = d;
+}
+
+/* Take d out of its slot; the caller holds the mutex */
+static void unlink_slot(deadline_t *d) {
+  if (d->prev)
+    d->prev->next = d->next;
+  else
+    *d->slot = d->next;
+  if (d->next)
+    d->next->prev = d->prev;
+}
+
+/* Expiry of a rate deadline running since mark */
+static void rate_expiry(deadline_t *d) {
+  d->expires =
+      d->mark + d->period + d->bytes * TICKS_PER_SEC / d->rate - d->spent;
+}
+
+/*
+ * acked - credit a write deadline with what its peer has acknowledged
+ *     so far. The caller holds the mutex, so d->fd is still open.
+ */
+static void acked(deadline_t *d) {
+  int queued;
+
+  if (ioctl(d->fd, SIOCOUTQ, &queued) == 0)
+    d->bytes = d->written - queued;
+  rate_expiry(d);
+}
+
+/*
+ * advance - move the wheel on by one tick, cascading the higher levels
+ *     whose span starts now and firing the deadlines that are due.
+ *     The caller holds the mutex.
+ */
+static void advance(void) {
+  static struct linger abort_close = {1, 0};
+  deadline_t *d, *next, *list;
+  long t = ticks + 1;
+  int l;
+
+  ticks = t;
+  for (l = WHEEL_LEVELS - 1; l > 0; l--) {
+    if (t & ((1L << (WHEEL_BITS * l)) - 1))
+      continue;
+    list = wheel[l][(t >> (WHEEL_BITS * l)) & WHEEL_MASK];
+    wheel[l][(t >> (WHEEL_BITS * l)) & WHEEL_MASK] = NULL;
+    for (d = list; d; d = next) {
+      next = d->next;
+      insert(d);
+    }
+  }
+
+  list = wheel[0][t & WHEEL_MASK];
+  wheel[0][t & WHEEL_MASK] = NULL;
+  for (d = list; d; d = next) {
+    next = d->next;
+    if (d->paused)
+      d->expires = t + d->period;
+    else if (d->rate && d->written)
+      acked(d);
+    if (d->expires > t) { /* Touched, paused or progressed since filed */
+      insert(d);
+      continue;
+    }
+    if (d->written) /* Reset, dropping what the peer never took */
+      setsockopt(d->fd, SOL_SOCKET, SO_LINGER, &abort_close,
+                 sizeof(abort_close));
+    shutdown(d->fd, SHUT_RDWR);
+    reaped[d->reason]++;
+    d->armed = 0;
+  }
+}
+
+void deadline_init(void) {
+  pthread_t tid;
+
+  Sem_init(&mutex, 0, 1);
+  Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/*
+ * deadline_arm - shut fd down unless d is touched, paused or cancelled
+ *     within ms, counting it under reason if it fires. Rearming an
+ *     armed deadline replaces it.
+ */
+void deadline_arm(deadline_t *d, int fd, int reason, int ms) {
+  P(&mutex);
+  if (d->armed)
+    unlink_slot(d);
+  d->fd = fd;
+  d->reason = reason;
+  d->period = (ms + TICK_MS - 1) / TICK_MS + 1;
+  d->expires = ticks + d->period;
+  d->paused = 0;
+  d->armed = 1;
+  insert(d);
+  V(&mutex);
+}
+
+void deadline_cancel(deadline_t *d) {
+  P(&mutex);
+  if (d->armed)
+    unlink_slot(d);
+  d->armed = 0;
+  V(&mutex);
+}
+
+/* deadline_touch - restart d's period from now, and resume it if paused */
+void deadline_touch(deadline_t *d) {
+  if (!d)
+    return;
+  d->expires = ticks + d->period;
+  d->paused = 0;
+}
+
+/* deadline_pause - stop d from firing until it is next touched */
+void deadline_pause(deadline_t *d) {
+  if (!d)
+    return;
+  if (d->rate && !d->paused)
+    d->spent += ticks - d->mark;
+  d->paused = 1;
+}
+
+/* deadline_counts - store the number of reaped sockets by reason */
+void deadline_counts(long *counts) {
+  P(&mutex);
+  memcpy(counts, reaped, sizeof(reaped));
+  V(&mutex);
+}
+
+/*
+ * reaper - advance the wheel in step with CLOCK_MONOTONIC, catching up
+ *     on any ticks missed while it slept
+ */
+void *reaper(void *vargp) {
+  struct timespec start, now;
+  long target;
+
+  Pthread_detach(pthread_self());
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (1) {
+    usleep(TICK_MS * 1000);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    target = (now.tv_sec - start.tv_sec) * (1000 / TICK_MS) +
+             (now.tv_nsec - start.tv_nsec) / (TICK_MS * 1000000L);
+    P(&mutex);
+    while (ticks < target)
+      advance();
+    V(&mutex);
+  }
+}
+
+/*
+ * deadline_set_rate - make d demand bytes_per_sec of progress, on
+ *     average, beyond its grace period. Call it right after arming d.
+ */
+void deadline_set_rate(deadline_t *d, long bytes_per_sec) {
+  d->rate = bytes_per_sec;
+  d->bytes = 0;
+  d->written = 0;
+  d->spent = 0;
+  d->mark = ticks;
+}
+
+/* deadline_progress - credit a running rate deadline with n bytes read */
+void deadline_progress(deadline_t *d, long n) {
+  if (!d || !d->rate)
+    return;
+  d->bytes += n;
+  rate_expiry(d);
+}
+
+/*
+ * deadline_expect - resume d for a write of n more bytes, which are
+ *     credited as the peer acknowledges them. Without a rate, the same
+ *     as deadline_touch().
+ */
+void deadline_expect(deadline_t *d, long n) {
+  if (!d)
+    return;
+  if (!d->rate) {
+    deadline_touch(d);
+    return;
+  }
+  d->mark = ticks;
+  d->written += n;
+  rate_expiry(d);
+  d->paused = 0;
+}
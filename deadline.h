@@ -0,0 +1,70 @@
+/*
+ * deadline.h - I/O deadlines for the proxy's blocking sockets
+ */
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include "csapp.h"
+
+/* Default deadlines in milliseconds */
+#ifndef HEADER_TIMEOUT
+#define HEADER_TIMEOUT 5000 /* Grace for sending the request header */
+#endif
+#ifndef CONNECT_TIMEOUT
+#define CONNECT_TIMEOUT 5000 /* Origin accepts a connection */
+#endif
+#ifndef ORIGIN_TIMEOUT
+#define ORIGIN_TIMEOUT 30000 /* Origin sends anything at all */
+#endif
+#ifndef CLIENT_TIMEOUT
+#define CLIENT_TIMEOUT 10000 /* Grace for taking the response */
+#endif
+
+/*
+ * Beyond their timeouts, which act as a grace period, a client must go
+ * on sending its request header and taking the response at least this
+ * many bytes/s on average
+ */
+#ifndef HEADER_MIN_RATE
+#define HEADER_MIN_RATE 256
+#endif
+#ifndef CLIENT_MIN_RATE
+#define CLIENT_MIN_RATE 4096
+#endif
+
+/* Why a connection was reaped */
+enum { DL_HEADER, DL_CONNECT, DL_ORIGIN_IDLE, DL_CLIENT_WRITE, NDL };
+
+/*
+ * A deadline on one socket, usually on the stack of the thread that
+ * uses the socket. Only arming and cancelling take a lock; the other
+ * calls are plain stores, so they may be made on every read or write.
+ */
+typedef struct deadline {
+  int fd;                       /* Shut down when the deadline passes */
+  int reason;                   /* DL_*, for the reap counts */
+  long period;                  /* Ticks granted by each touch */
+  volatile long expires;        /* Tick at which it fires */
+  volatile int paused;          /* Not running, e.g. between writes */
+  int armed;                    /* In the wheel */
+  long rate;                    /* Minimum bytes/s, 0 for none */
+  long bytes;                   /* Progress credited so far */
+  volatile long written;        /* Bytes written, for a write deadline */
+  long spent;                   /* Ticks run before mark */
+  long mark;                    /* Tick it last resumed */
+  struct deadline **slot;       /* Head of the wheel slot it is in */
+  struct deadline *prev, *next; /* Wheel slot list */
+} deadline_t;
+
+void deadline_init(void);
+void deadline_arm(deadline_t *d, int fd, int reason, int ms);
+void deadline_cancel(deadline_t *d);
+void deadline_touch(deadline_t *d);
+void deadline_pause(deadline_t *d);
+void deadline_set_rate(deadline_t *d, long bytes_per_sec);
+void deadline_progress(deadline_t *d, long n);
+void deadline_expect(deadline_t *d, long n);
+void deadline_counts(long *reaped);
+extern const char *deadline_names[NDL];
+
+#endif /* __DEADLINE_H__ */
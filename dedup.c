@@ -0,0 +1,189 @@
+/*
+ * dedup.c - content-addressed store of cached bodies
+ *
+ * The same bytes are often cached under many URIs: query-string
+ * variants, mirrors, versioned paths. Rather than keep one copy for
+ * each, the cache hands every body it is given to dedup_get(), which
+ * hashes it with a 128-bit MurmurHash3 and returns the body already
+ * stored under that hash, with another reference, or else a new one.
+ * Objects then point at their body instead of carrying it, and a body
+ * is freed when the last object pointing at it goes.
+ *
+ * MurmurHash3 is fast, but it is not meant to resist an adversary, and
+ * the bodies come from origins we do not control. So a matching hash
+ * only picks the candidate; the bytes are compared before a body is
+ * shared, and one that differs is stored on its own.
+ */
+#include "dedup.h"
+
+#define NBUCKETS 1024
+
+static body_t *buckets[NBUCKETS];
+static long nbodies, nbytes;  /* Bodies stored, sum of their sizes */
+static long nrefs, nlogical;  /* References to them, bytes they stand for */
+static long hits;             /* Bodies found stored already */
+static sem_t mutex;           /* Protects all of the above */
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+/* MurmurHash3_x64_128 of the n bytes at data, with seed 0, into h */
+static void hash(const char *data, size_t n, uint64_t h[2]) {
+  const uint64_t c1 = 0x87c37b91114253d5ull, c2 = 0x4cf5ad432745937full;
+  const unsigned char *p = (const unsigned char *)data, *tail;
+  uint64_t h1 = 0, h2 = 0, k1, k2;
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    memcpy(&k1, p + i, 8);
+    memcpy(&k2, p + i + 8, 8);
+    h1 ^= rotl(k1 * c1, 31) * c2;
+    h1 = (rotl(h1, 27) + h2) * 5 + 0x52dce729;
+    h2 ^= rotl(k2 * c2, 33) * c1;
+    h2 = (rotl(h2, 31) + h1) * 5 + 0x38495ab5;
+  }
+
+  tail = p + i;
+  k1 = k2 = 0;
+  switch (n & 15) {
+  case 15: k2 ^= (uint64_t)tail[14] << 48; /* Fall through */
+  case 14: k2 ^= (uint64_t)tail[13] << 40; /* Fall through */
+  case 13: k2 ^= (uint64_t)tail[12] << 32; /* Fall through */
+  case 12: k2 ^= (uint64_t)tail[11] << 24; /* Fall through */
+  case 11: k2 ^= (uint64_t)tail[10] << 16; /* Fall through */
+  case 10: k2 ^= (uint64_t)tail[9] << 8;   /* Fall through */
+  case 9:
+    k2 ^= tail[8];
+    h2 ^= rotl(k2 * c2, 33) * c1;
+    /* Fall through */
+  case 8: k1 ^= (uint64_t)tail[7] << 56; /* Fall through */
+  case 7: k1 ^= (uint64_t)tail[6] << 48; /* Fall through */
+  case 6: k1 ^= (uint64_t)tail[5] << 40; /* Fall through */
+  case 5: k1 ^= (uint64_t)tail[4] << 32; /* Fall through */
+  case 4: k1 ^= (uint64_t)tail[3] << 24; /* Fall through */
+  case 3: k1 ^= (uint64_t)tail[2] << 16; /* Fall through */
+  case 2: k1 ^= (uint64_t)tail[1] << 8;  /* Fall through */
+  case 1:
+    k1 ^= tail[0];
+    h1 ^= rotl(k1 * c1, 31) * c2;
+  }
+
+  h1 ^= n;
+  h2 ^= n;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix(h1);
+  h2 = fmix(h2);
+  h1 += h2;
+  h2 += h1;
+  h[0] = h1;
+  h[1] = h2;
+}
+
+/* Return the stored body with these bytes, or NULL; mutex held */
+static body_t *find(const uint64_t h[2], const char *data, size_t size) {
+  body_t *b = buckets[h[0] % NBUCKETS];
+
+  for (; b; b = b->next)
+    if (b->hash[0] == h[0] && b->hash[1] == h[1] && b->size == size &&
+        !memcmp(b->data, data, size))
+      return b;
+  return NULL;
+}
+
+/* Take another reference to b; mutex held */
+static body_t *ref(body_t *b) {
+  b->refcnt++;
+  nrefs++;
+  nlogical += b->size;
+  return b;
+}
+
+void dedup_init(void) {
+  Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * dedup_get - return a referenced body holding the size bytes at data,
+ *     shared with any object that has the same bytes. The caller hands
+ *     it back with dedup_put().
+ */
+body_t *dedup_get(const char *data, size_t size) {
+  uint64_t h[2];
+  body_t *b, *old;
+
+  hash(data, size, h);
+  P(&mutex);
+  if ((b = find(h, data, size)) != NULL) {
+    hits++;
+    ref(b);
+    V(&mutex);
+    return b;
+  }
+  V(&mutex);
+
+  /* Copy it outside the lock, then check nobody stored it meanwhile */
+  b = Malloc(sizeof(body_t) + size);
+  memcpy(b->data, data, size);
+  b->hash[0] = h[0];
+  b->hash[1] = h[1];
+  b->size = size;
+  b->refcnt = 0;
+  b->cached = 0;
+  P(&mutex);
+  if ((old = find(h, data, size)) != NULL) {
+    hits++;
+    ref(old);
+    V(&mutex);
+    Free(b);
+    return old;
+  }
+  b->next = buckets[h[0] % NBUCKETS];
+  buckets[h[0] % NBUCKETS] = b;
+  nbodies++;
+  nbytes += size;
+  ref(b);
+  V(&mutex);
+  return b;
+}
+
+/* dedup_put - drop a reference to b, freeing it if it was the last */
+void dedup_put(body_t *b) {
+  body_t **pp;
+
+  P(&mutex);
+  nrefs--;
+  nlogical -= b->size;
+  if (--b->refcnt > 0) {
+    V(&mutex);
+    return;
+  }
+  for (pp = &buckets[b->hash[0] % NBUCKETS]; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+  nbodies--;
+  nbytes -= b->size;
+  V(&mutex);
+  Free(b);
+}
+
+/* dedup_stats - take a consistent snapshot of the store's counters */
+void dedup_stats(dedup_stats_t *st) {
+  P(&mutex);
+  st->bodies = nbodies;
+  st->bytes = nbytes;
+  st->refs = nrefs;
+  st->logical = nlogical;
+  st->hits = hits;
+  V(&mutex);
+}
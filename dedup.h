@@ -0,0 +1,34 @@
+/*
+ * dedup.h - content-addressed store of cached bodies
+ */
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* One stored body, shared by every object with the same bytes */
+typedef struct body {
+  uint64_t hash[2];  /* 128-bit hash of data */
+  size_t size;       /* Bytes in data */
+  int refcnt;        /* Objects pointing at it */
+  int cached;        /* ... of which in the cache, kept by cache.c */
+  struct body *next; /* Next body in the hash chain */
+  char data[];
+} body_t;
+
+/* What the store holds, see dedup_stats() */
+typedef struct {
+  long bodies;  /* Distinct bodies stored */
+  long bytes;   /* Sum of their sizes */
+  long refs;    /* Objects pointing at them */
+  long logical; /* Bytes those objects would take up on their own */
+  long hits;    /* Bodies found stored already since startup */
+} dedup_stats_t;
+
+void dedup_init(void);
+body_t *dedup_get(const char *data, size_t size);
+void dedup_put(body_t *b);
+void dedup_stats(dedup_stats_t *st);
+
+#endif /* __DEDUP_H__ */
@@ -0,0 +1,332 @@
+/*
+ * disk.c - second cache tier, a log of evicted objects in a file
+ *
+ * Objects evicted from the in-memory cache are demoted to a file of a
+ * fixed size, allocated in full when the proxy starts. The file is used
+ * as a circular log: each object is appended as one record (a
+ * disk_rec_t, the key, type, ETag and Last-Modified strings with their
+ * NULs, then the body) at the head, and when the head comes round to
+ * the start of the file again, the oldest records are overwritten. A
+ * record never wraps around the end; the space left there is skipped.
+ *
+ * Only the index lives in memory, and it is compact: a ring of small
+ * entries, one per record in log order, holding the record's position,
+ * length and key hash, and an open-addressing table of ring positions
+ * keyed by that hash. Keys are only kept on disk and are checked when a
+ * record is read. The oldest entries leave the ring as their records
+ * are overwritten, and an entry is marked dead when a newer copy of
+ * its object is appended.
+ *
+ * A lookup reads the whole record with pread() into the request's
+ * arena or, if it does not fit in what is left of that, into memory
+ * from the heap. Records are read without any lock held, so the writer may
+ * overwrite one while it is being read. Log positions only ever grow,
+ * and the writer moves the head past the space it is about to write
+ * before writing it, so a reader can tell afterwards, by comparing the
+ * record's position with the head, whether what it read could have
+ * been overwritten, and treats it as a miss if so.
+ *
+ * The first hit on a demoted object is served from a copy that is not
+ * put into the cache, so that an object asked for once does not push a
+ * hotter one out. An object hit again, or one that is no longer fresh
+ * and so needs a refresh, is promoted back into the cache, and so is the
+ * primary entry of a response cached as variants, on its first hit,
+ * since a variant is only cached while its primary is (see cache.h).
+ */
+#include <sys/uio.h>
+#include <stdint.h>
+#include "disk.h"
+
+#define PAD(n) (((n) + 7) & ~(uint64_t)7)
+#define MIN_RECORDS 1024  /* Least room in the ring */
+#define AVG_RECORD 4096   /* Record size the ring is sized for */
+
+typedef struct {
+  uint32_t keylen; /* String lengths, NULs included */
+  uint32_t typelen;
+  uint32_t etaglen;
+  uint32_t modlen;
+  int32_t status;
+  int32_t swr;
+  int64_t expires;
+  uint64_t size;  /* Bytes of body */
+  uint64_t total; /* Length of the whole object */
+  uint64_t plain; /* Body length before gzip, 0 if kept as it came */
+} disk_rec_t;
+
+typedef struct {
+  uint64_t hash;   /* Of the key, 0 once a newer copy is in the log */
+  uint64_t lsn;    /* Log position of the record */
+  int64_t expires; /* Of the object, to tell whether it has changed */
+  uint32_t len;    /* Bytes the record takes up */
+  uint32_t hits;   /* Lookups that found it */
+} disk_ent_t;
+
+static int fd = -1;        /* The file, -1 if there is no disk tier */
+static uint64_t disk_size; /* Bytes in the file */
+
+static disk_ent_t *ring;             /* Records in log order */
+static uint32_t nrecs;               /* Entries in ring, a power of two */
+static uint32_t ring_head, ring_tail; /* Next entry, oldest entry */
+static uint32_t *table;              /* Ring index + 1 by hash, 0 if empty */
+static uint32_t nslots;              /* Entries in table, 2 * nrecs */
+static volatile uint64_t log_head;   /* Log position of the next record */
+static long entries, bytes, demotions; /* Live records, their bytes */
+static sem_t mutex;                  /* Protects all of the above */
+static sem_t write_mutex;            /* One demotion at a time */
+
+static volatile long promotions; /* Hits copied back into the cache */
+static volatile long lost;       /* Reads overtaken by the writer */
+
+/* The key hash an entry is filed under; 0 marks a dead entry */
+static uint64_t tag(uint64_t hash) {
+  return hash ? hash : 1;
+}
+
+/* Return the table slot of the live entry for h, or -1; mutex held */
+static int find(uint64_t h) {
+  uint32_t i;
+
+  for (i = h & (nslots - 1); table[i]; i = (i + 1) & (nslots - 1))
+    if (ring[table[i] - 1].hash == h)
+      return i;
+  return -1;
+}
+
+/*
+ * unindex - take the entry in table slot i out of the table, moving
+ *     later entries of the same probe run back so that none is cut off
+ *     from its home slot. The caller holds the mutex.
+ */
+static void unindex(uint32_t i) {
+  uint32_t j, home, mask = nslots - 1;
+  disk_ent_t *e = &ring[table[i] - 1];
+
+  entries--;
+  bytes -= e->len;
+  table[i] = 0;
+  for (j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+    home = ring[table[j] - 1].hash & mask;
+    if (j > i ? (home <= i || home > j) : (home <= i && home > j)) {
+      table[i] = table[j];
+      table[j] = 0;
+      i = j;
+    }
+  }
+}
+
+/* True if writing up to log position end would overwrite e's record */
+static int overwrites(disk_ent_t *e, uint64_t end) {
+  return end > e->lsn + disk_size;
+}
+
+/* Drop the oldest entry from the ring; mutex held */
+static void retire(void) {
+  disk_ent_t *e = &ring[ring_tail & (nrecs - 1)];
+  int i;
+
+  if (e->hash && (i = find(e->hash)) >= 0)
+    unindex(i);
+  ring_tail++;
+}
+
+/*
+ * disk_init - use a file of size bytes at path as the disk tier,
+ *     creating it if need be. Whatever the file held is ignored.
+ */
+void disk_init(const char *path, long size) {
+  int rc;
+
+  if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+    unix_error("disk_init: open error");
+  if ((rc = posix_fallocate(fd, 0, size)) != 0)
+    posix_error(rc, "disk_init: posix_fallocate error");
+  disk_size = size;
+  for (nrecs = MIN_RECORDS; nrecs < size / AVG_RECORD; nrecs <<= 1)
+    ;
+  nslots = 2 * nrecs;
+  ring = Calloc(nrecs, sizeof(disk_ent_t));
+  table = Calloc(nslots, sizeof(uint32_t));
+  Sem_init(&mutex, 0, 1);
+  Sem_init(&write_mutex, 0, 1);
+}
+
+/*
+ * disk_demote - append an object evicted from the cache to the log,
+ *     unless it is of no more use or the log has it already
+ */
+void disk_demote(cache_obj_t *obj) {
+  struct iovec iov[7];
+  static const char zeros[8];
+  disk_rec_t r;
+  disk_ent_t *e;
+  uint64_t h, lsn, len, pad;
+  int i;
+
+  if (fd < 0 || !CACHE_USABLE(obj, time(NULL)))
+    return;
+  r.keylen = strlen(obj->key) + 1;
+  r.typelen = strlen(obj->meta.type) + 1;
+  r.etaglen = strlen(obj->meta.etag) + 1;
+  r.modlen = strlen(obj->meta.lastmod) + 1;
+  r.status = obj->meta.status;
+  r.swr = obj->meta.swr;
+  r.expires = obj->meta.expires;
+  r.size = obj->size;
+  r.total = obj->total;
+  r.plain = obj->meta.plain;
+  len = sizeof(r) + r.keylen + r.typelen + r.etaglen + r.modlen + r.size;
+  pad = PAD(len) - len;
+  len += pad;
+  if (len > disk_size / 2)
+    return;
+  h = tag(obj->hash);
+
+  P(&write_mutex);
+  P(&mutex);
+  if ((i = find(h)) >= 0 && (e = &ring[table[i] - 1])->len == len &&
+      e->expires == r.expires) {
+    V(&mutex); /* Demoted before, and not changed since */
+    V(&write_mutex);
+    return;
+  }
+  lsn = log_head;
+  if (lsn % disk_size + len > disk_size)
+    lsn += disk_size - lsn % disk_size; /* Skip to the start of the file */
+  while (ring_tail != ring_head &&
+         (ring_head - ring_tail == nrecs ||
+          overwrites(&ring[ring_tail & (nrecs - 1)], lsn + len)))
+    retire();
+  log_head = lsn + len;
+  V(&mutex);
+
+  iov[0] = (struct iovec){&r, sizeof(r)};
+  iov[1] = (struct iovec){obj->key, r.keylen};
+  iov[2] = (struct iovec){obj->meta.type, r.typelen};
+  iov[3] = (struct iovec){obj->meta.etag, r.etaglen};
+  iov[4] = (struct iovec){obj->meta.lastmod, r.modlen};
+  iov[5] = (struct iovec){obj->body, r.size};
+  iov[6] = (struct iovec){(void *)zeros, pad};
+  if (pwritev(fd, iov, 7, lsn % disk_size) == (ssize_t)len) {
+    P(&mutex);
+    if ((i = find(h)) >= 0) { /* An older copy */
+      e = &ring[table[i] - 1];
+      unindex(i);
+      e->hash = 0;
+    }
+    e = &ring[ring_head & (nrecs - 1)];
+    e->hash = h;
+    e->lsn = lsn;
+    e->expires = r.expires;
+    e->len = len;
+    e->hits = 0;
+    for (i = h & (nslots - 1); table[i]; i = (i + 1) & (nslots - 1))
+      ;
+    table[i] = (ring_head & (nrecs - 1)) + 1;
+    ring_head++;
+    entries++;
+    bytes += e->len;
+    demotions++;
+    V(&mutex);
+  }
+  V(&write_mutex);
+}
+
+/*
+ * record - return the record of len bytes at buf if it is whole and for
+ *     key, or NULL
+ */
+static disk_rec_t *record(char *buf, uint64_t len, const char *key) {
+  disk_rec_t *r = (disk_rec_t *)buf;
+  char *s = (char *)(r + 1);
+  uint64_t need;
+
+  if (len < sizeof(*r))
+    return NULL;
+  need = sizeof(*r) + (uint64_t)r->keylen + r->typelen + r->etaglen +
+         r->modlen + r->size;
+  if (need > len || !r->keylen || !r->typelen || !r->etaglen || !r->modlen ||
+      s[r->keylen - 1] || s[r->keylen + r->typelen - 1] ||
+      s[r->keylen + r->typelen + r->etaglen - 1] ||
+      s[r->keylen + r->typelen + r->etaglen + r->modlen - 1] || strcmp(s, key))
+    return NULL;
+  return r;
+}
+
+/*
+ * disk_lookup - return a referenced object for key, of the given hash,
+ *     from the log, or NULL if it is not there or no longer usable. The
+ *     record is read into a, or the heap if it does not fit, and the
+ *     space is given back before this returns.
+ */
+cache_obj_t *disk_lookup(const char *key, uint64_t hash, arena_t *a) {
+  uint64_t h, lsn, len;
+  size_t mark;
+  disk_rec_t *r;
+  objmeta_t meta;
+  cache_obj_t *obj = NULL;
+  time_t now;
+  char *buf, *heap = NULL;
+  int i, reused;
+
+  if (fd < 0)
+    return NULL;
+  h = tag(hash);
+  P(&mutex);
+  if ((i = find(h)) < 0) {
+    V(&mutex);
+    return NULL;
+  }
+  lsn = ring[table[i] - 1].lsn;
+  len = ring[table[i] - 1].len;
+  reused = ring[table[i] - 1].hits++ > 0;
+  V(&mutex);
+
+  mark = arena_save(a);
+  if ((buf = arena_alloc(a, len)) == NULL)
+    buf = heap = Malloc(len);
+  if (pread(fd, buf, len, lsn % disk_size) != (ssize_t)len ||
+      (__sync_synchronize(), log_head > lsn + disk_size) ||
+      (r = record(buf, len, key)) == NULL) {
+    __sync_fetch_and_add(&lost, 1); /* Overwritten meanwhile */
+    arena_restore(a, mark);
+    Free(heap);
+    return NULL;
+  }
+
+  meta.status = r->status;
+  meta.type = buf + sizeof(*r) + r->keylen;
+  meta.etag = meta.type + r->typelen;
+  meta.lastmod = meta.etag + r->etaglen;
+  meta.expires = r->expires;
+  meta.swr = r->swr;
+  meta.plain = r->plain;
+  now = time(NULL);
+  if (now >= meta.expires + meta.swr)
+    ; /* Of no use any more */
+  else if (reused || now >= meta.expires || r->total < r->size) {
+    cache_insert(key, hash, &meta, meta.lastmod + r->modlen, r->size,
+                 r->total);
+    obj = cache_lookup(key, hash);
+    __sync_fetch_and_add(&promotions, 1);
+  } else
+    obj = cache_detached(key, hash, &meta, meta.lastmod + r->modlen, r->size,
+                         r->total);
+  arena_restore(a, mark);
+  Free(heap);
+  return obj;
+}
+
+/* disk_stats - take a consistent snapshot of the disk tier's counters */
+void disk_stats(disk_stats_t *st) {
+  memset(st, 0, sizeof(*st));
+  if (fd < 0)
+    return;
+  P(&mutex);
+  st->entries = entries;
+  st->bytes = bytes;
+  st->demotions = demotions;
+  V(&mutex);
+  st->promotions = promotions;
+  st->lost = lost;
+}
@@ -0,0 +1,30 @@
+/*
+ * disk.h - second cache tier, a log of evicted objects in a file
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include "arena.h"
+#include "cache.h"
+
+/* Default size of the file, in MB */
+#ifndef DISK_SIZE_MB
+#define DISK_SIZE_MB 64
+#endif
+
+/* Counters of the disk tier, see disk_stats() */
+typedef struct {
+  long entries;    /* Objects in the log */
+  long bytes;      /* Bytes of log they take up */
+  long demotions;  /* Objects written to the log */
+  long promotions; /* Objects copied back into the cache */
+  long lost;       /* Reads overtaken by the log wrapping around */
+} disk_stats_t;
+
+void disk_init(const char *path, long size);
+void disk_demote(cache_obj_t *obj);
+cache_obj_t *disk_lookup(const char *key, uint64_t hash, arena_t *a);
+void disk_stats(disk_stats_t *st);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,82 @@
+/*
+ * door.c - doorkeeper that keeps one-hit wonders out of the cache
+ *
+ * Most URIs are asked for only once. Caching each of them as it goes
+ * by evicts objects that would have been asked for again, for nothing.
+ * With a doorkeeper, a miss is only cached if its URI has been seen
+ * before: the first miss leaves a mark in a Bloom filter instead, and
+ * a second one within the window finds the mark and is let in.
+ *
+ * There are two filters, the current one and the previous one. A URI
+ * is looked for in both and marked in the current one. Once window
+ * new URIs have been marked in it, the previous filter is cleared and
+ * becomes the current one, so a mark lasts for between one and two
+ * windows of new URIs, and the filters never fill up. Each is sized at
+ * DOOR_BITS_PER_KEY bits for every URI in a window, with DOOR_HASHES
+ * bits set per URI, which lets about 1% of new URIs through as if they
+ * had been seen before.
+ *
+ * Bits are set with atomic ORs, without a lock. A lookup that races
+ * with a rotation may miss a mark in the filter being cleared, which
+ * only keeps that one object out of the cache once more.
+ */
+#include <stdint.h>
+#include "door.h"
+
+static uint64_t *filters[2]; /* Bit arrays of nbits bits */
+static uint64_t nbits;       /* A power of two */
+static volatile int cur;     /* Index of the current filter */
+static volatile long marked; /* New URIs marked in it */
+static long window;          /* Marked before it is rotated, 0 if off */
+
+/*
+ * door_init - keep URIs out of the cache until their second miss within
+ *     a window of that many new URIs
+ */
+void door_init(long n) {
+  uint64_t words;
+
+  for (nbits = 64; nbits < (uint64_t)n * DOOR_BITS_PER_KEY; nbits <<= 1)
+    ;
+  words = nbits / 64;
+  filters[0] = Calloc(words, sizeof(uint64_t));
+  filters[1] = Calloc(words, sizeof(uint64_t));
+  window = n;
+}
+
+/*
+ * door_admit - return 1 if the key with hash h, its uri_hash(), has been
+ *     seen within the window, and so may be cached; otherwise mark it as
+ *     seen and return 0. Everything is let in if there is no doorkeeper.
+ */
+int door_admit(uint64_t h) {
+  uint64_t h1, h2, bit, *now, *prev;
+  int c = cur, i, seen = 1, before = 1;
+
+  if (window == 0)
+    return 1;
+  h1 = h & 0xffffffff;
+  h2 = (h >> 32) | 1; /* Odd, so the DOOR_HASHES bits differ */
+  now = filters[c];
+  prev = filters[c ^ 1];
+  for (i = 0; i < DOOR_HASHES; i++) {
+    bit = (h1 + i * h2) & (nbits - 1);
+    if (!(prev[bit / 64] & (1ull << (bit % 64))))
+      before = 0;
+    if (!(__sync_fetch_and_or(&now[bit / 64], 1ull << (bit % 64)) &
+          (1ull << (bit % 64))))
+      seen = 0;
+  }
+  if (seen || before)
+    return 1;
+
+  /* A new URI; whoever marks the last one of the window rotates */
+  if (__sync_add_and_fetch(&marked, 1) == window) {
+    c = cur;
+    memset(filters[c ^ 1], 0, nbits / 8);
+    __sync_synchronize();
+    cur = c ^ 1;
+    marked = 0;
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * door.h - doorkeeper that keeps one-hit wonders out of the cache
+ */
+#ifndef __DOOR_H__
+#define __DOOR_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* Filter bits per key in a window, and bits set for each key */
+#ifndef DOOR_BITS_PER_KEY
+#define DOOR_BITS_PER_KEY 10
+#endif
+#ifndef DOOR_HASHES
+#define DOOR_HASHES 7
+#endif
+
+void door_init(long window);
+int door_admit(uint64_t hash);
+
+#endif /* __DOOR_H__ */
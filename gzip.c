@@ -0,0 +1,107 @@
+/*
+ * gzip.c - gzip compression of cached text bodies
+ *
+ * With -g, text bodies (HTML, CSS, scripts, JSON, XML, plain text) are
+ * kept in the cache gzipped, which for typical markup and code makes
+ * each one take a third to a fifth of the space. The gzip format, not
+ * a faster one such as LZ4, is what HTTP clients accept, so a client
+ * that sends "Accept-Encoding: gzip" is sent the cached bytes as they
+ * are, with "Content-Encoding: gzip". Other clients, and range
+ * requests, get the body inflated into the request's arena.
+ *
+ * zlib's streams are costly to set up (a deflate stream allocates a
+ * few hundred KB), so each thread sets up one of each kind on first
+ * use and resets it between bodies.
+ */
+#include <zlib.h>
+#include "gzip.h"
+
+static __thread z_stream *deflater, *inflater; /* This thread's streams */
+
+/* True if a body of Content-Type type is text that compresses well */
+int gzip_type(const char *type) {
+  static const char *types[] = {
+      "text/",           "application/javascript", "application/json",
+      "application/xml", "application/xhtml+xml",  "image/svg+xml",
+      NULL};
+  int i;
+
+  for (i = 0; types[i]; i++)
+    if (!strncasecmp(type, types[i], strlen(types[i])))
+      return 1;
+  return 0;
+}
+
+/*
+ * gzip_accepted - true if the request header lines in hdrs hold an
+ *     Accept-Encoding that allows gzip, with a q-value above zero
+ */
+int gzip_accepted(const char *hdrs) {
+  const char *p, *end, *tok;
+  size_t len;
+
+  for (p = hdrs; *p; p = *end ? end + 1 : end) {
+    end = p + strcspn(p, "\n");
+    if (strncasecmp(p, "Accept-Encoding:", 16))
+      continue;
+    for (tok = p + 16; tok < end; tok += len + 1) {
+      tok += strspn(tok, " \t");
+      len = strcspn(tok, ",\r\n");
+      if (len < 4 || strncasecmp(tok, "gzip", 4) ||
+          (len > 4 && tok[4] != ';' && tok[4] != ' '))
+        continue;
+      for (tok += 4; *tok == ' ' || *tok == ';'; tok++)
+        ;
+      return strncasecmp(tok, "q=", 2) || atof(tok + 2) > 0;
+    }
+  }
+  return 0;
+}
+
+/*
+ * gzip_pack - compress the n bytes at src into dst, which has room
+ *     bytes. Returns the compressed length, or -1 if it does not fit.
+ */
+long gzip_pack(const char *src, long n, char *dst, long room) {
+  z_stream *z = deflater;
+
+  if (z == NULL) {
+    z = Calloc(1, sizeof(z_stream));
+    if (deflateInit2(z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      app_error("gzip_pack: deflateInit2 failed");
+    deflater = z;
+  } else
+    deflateReset(z);
+  z->next_in = (Bytef *)src;
+  z->avail_in = n;
+  z->next_out = (Bytef *)dst;
+  z->avail_out = room;
+  if (deflate(z, Z_FINISH) != Z_STREAM_END)
+    return -1;
+  return z->total_out;
+}
+
+/*
+ * gzip_unpack - inflate the gzip data of n bytes at src into dst, which
+ *     has room bytes. Returns the inflated length, or -1 if the data is
+ *     damaged or does not fit.
+ */
+long gzip_unpack(const char *src, long n, char *dst, long room) {
+  z_stream *z = inflater;
+
+  if (z == NULL) {
+    z = Calloc(1, sizeof(z_stream));
+    if (inflateInit2(z, 15 + 16) != Z_OK)
+      app_error("gzip_unpack: inflateInit2 failed");
+    inflater = z;
+  } else
+    inflateReset(z);
+  z->next_in = (Bytef *)src;
+  z->avail_in = n;
+  z->next_out = (Bytef *)dst;
+  z->avail_out = room;
+  if (inflate(z, Z_FINISH) != Z_STREAM_END)
+    return -1;
+  return z->total_out;
+}
@@ -0,0 +1,24 @@
+/*
+ * gzip.h - gzip compression of cached text bodies
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include "csapp.h"
+
+/* zlib level, 1 (fastest) to 9 (smallest) */
+#ifndef GZIP_LEVEL
+#define GZIP_LEVEL 6
+#endif
+
+/* Bodies smaller than this are not worth compressing */
+#ifndef GZIP_MIN_SIZE
+#define GZIP_MIN_SIZE 256
+#endif
+
+int gzip_type(const char *type);
+int gzip_accepted(const char *hdrs);
+long gzip_pack(const char *src, long n, char *dst, long room);
+long gzip_unpack(const char *src, long n, char *dst, long room);
+
+#endif /* __GZIP_H__ */
@@ -0,0 +1,79 @@
+/*
+ * hist.c - log-linear (HDR-style) latency histograms
+ *
+ * A histogram has a single writer and is not locked: recording is a
+ * bucket lookup and an increment. Readers that merge histograms owned
+ * by other threads may miss an increment that is in flight, which is
+ * harmless for reporting.
+ */
+#include "hist.h"
+
+/* Bucket holding value v */
+static int bucket(uint64_t v) {
+  int e;
+
+  if (v < HIST_SUB)
+    return v;
+  e = 63 - __builtin_clzll(v); /* floor(log2(v)), at least HIST_SUB_BITS */
+  if (e > HIST_MAX_EXP)
+    return HIST_BUCKETS - 1;
+  return HIST_SUB + (e - HIST_SUB_BITS) * HIST_HALF +
+         (int)(v >> (e - HIST_SUB_BITS + 1)) - HIST_HALF;
+}
+
+/* Value reported for bucket i: the middle of the range it covers */
+static uint64_t bucket_value(int i) {
+  int e, shift;
+  uint64_t lo;
+
+  if (i < HIST_SUB)
+    return i;
+  e = (i - HIST_SUB) / HIST_HALF + HIST_SUB_BITS;
+  shift = e - HIST_SUB_BITS + 1;
+  lo = (uint64_t)((i - HIST_SUB) % HIST_HALF + HIST_HALF) << shift;
+  return lo + ((uint64_t)1 << shift) / 2;
+}
+
+void hist_record(hist_t *h, uint64_t v) {
+  h->counts[bucket(v)]++;
+  h->count++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src) {
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+/*
+ * hist_quantile - return the value below which a fraction q of the
+ *     recorded values lie, e.g. q = 0.99 for the 99th percentile
+ */
+uint64_t hist_quantile(const hist_t *h, double q) {
+  uint64_t rank, seen = 0, v;
+  int i;
+
+  if (h->count == 0)
+    return 0;
+  rank = (uint64_t)(q * h->count);
+  if (rank >= h->count)
+    rank = h->count - 1;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      if (i == HIST_BUCKETS - 1) /* Clamped values */
+        return h->max;
+      v = bucket_value(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
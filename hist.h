@@ -0,0 +1,32 @@
+/*
+ * hist.h - log-linear (HDR-style) latency histograms
+ */
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+
+/*
+ * Values below 2^HIST_SUB_BITS are counted exactly. Above that, every
+ * power-of-two range is split into 2^(HIST_SUB_BITS-1) equal buckets,
+ * so a value is known to within 1/32 (about 3%) of itself. The top
+ * range starts at 2^HIST_MAX_EXP; larger values are clamped into it.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_MAX_EXP 40
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB >> 1)
+#define HIST_BUCKETS (HIST_SUB + (HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_HALF)
+
+typedef struct {
+  uint64_t count;                /* Values recorded */
+  uint64_t sum;                  /* Their total */
+  uint64_t max;                  /* Largest value recorded */
+  uint64_t counts[HIST_BUCKETS];
+} hist_t;
+
+void hist_record(hist_t *h, uint64_t v);
+void hist_merge(hist_t *dst, const hist_t *src);
+uint64_t hist_quantile(const hist_t *h, double q);
+
+#endif /* __HIST_H__ */
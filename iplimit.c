@@ -0,0 +1,91 @@
+/*
+ * iplimit.c - per-client-address limit on concurrent connections
+ *
+ * Open connections are counted per client address in a fixed table of
+ * 64-bit words, each holding a 32-bit address key and a 32-bit count,
+ * found by linear probing from the key's hash. Every update is a single
+ * compare-and-swap of a whole word, so the acceptor and the workers
+ * never wait for each other. Keys are never deleted; a slot whose
+ * count has dropped to zero may be taken over by another address,
+ * atomically with its first count. Only the acceptor takes slots, so
+ * an address never ends up counted in two. An address that finds no slot
+ * within MAX_PROBES is not limited. IPv4 addresses are their own keys;
+ * IPv6 addresses are hashed down to 32 bits.
+ */
+#include "iplimit.h"
+
+#define NSLOTS 4096 /* A power of two; 32 KB */
+#define MAX_PROBES 16
+
+#define KEY(w) ((uint32_t)((w) >> 32))
+#define COUNT(w) ((uint32_t)(w))
+#define WORD(key, count) (((uint64_t)(key) << 32) | (count))
+
+static uint64_t slots[NSLOTS];
+static int limit; /* 0 for no limit */
+
+static uint32_t addr_key(struct sockaddr_storage *addr) {
+  unsigned char *p;
+  uint32_t h = 2166136261u; /* FNV-1a */
+  int i;
+
+  if (addr->ss_family == AF_INET)
+    h = ((struct sockaddr_in *)addr)->sin_addr.s_addr;
+  else if (addr->ss_family == AF_INET6) {
+    p = ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+    for (i = 0; i < 16; i++) {
+      h ^= p[i];
+      h *= 16777619u;
+    }
+  }
+  return h ? h : 1; /* 0 marks a never-used slot */
+}
+
+void iplimit_init(int n) {
+  limit = n;
+}
+
+/*
+ * iplimit_acquire - count a new connection from addr. Returns the slot
+ *     to release when it closes, -1 if it is not counted, or -2 if
+ *     addr already holds its limit and the connection must be refused.
+ *     Only one thread may acquire; any thread may release.
+ */
+int iplimit_acquire(struct sockaddr_storage *addr) {
+  uint32_t key, h;
+  uint64_t w;
+  int i, s = -1;
+
+  if (!limit)
+    return -1;
+  key = addr_key(addr);
+  h = key * 2654435761u; /* Spread sequential addresses */
+
+  /* Use addr's own slot if it has one, else the first unused one */
+  for (i = 0; i < MAX_PROBES; i++) {
+    w = slots[(h + i) & (NSLOTS - 1)];
+    if (KEY(w) == key) {
+      s = (h + i) & (NSLOTS - 1);
+      break;
+    }
+    if (s < 0 && COUNT(w) == 0)
+      s = (h + i) & (NSLOTS - 1);
+  }
+  if (s < 0)
+    return -1;
+
+  /* Releases may race with us, but nothing else changes the slot */
+  do {
+    w = slots[s];
+    if (KEY(w) == key && COUNT(w) >= limit)
+      return -2;
+  } while (!__sync_bool_compare_and_swap(
+      &slots[s], w, KEY(w) == key ? w + 1 : WORD(key, 1)));
+  return s;
+}
+
+/* iplimit_release - uncount a connection counted in slot */
+void iplimit_release(int slot) {
+  if (slot >= 0)
+    __sync_fetch_and_sub(&slots[slot], 1);
+}
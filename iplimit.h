@@ -0,0 +1,18 @@
+/*
+ * iplimit.h - per-client-address limit on concurrent connections
+ */
+#ifndef __IPLIMIT_H__
+#define __IPLIMIT_H__
+
+#include "csapp.h"
+
+/* Default connections one client address may hold open at a time */
+#ifndef IP_CONN_LIMIT
+#define IP_CONN_LIMIT 8
+#endif
+
+void iplimit_init(int limit);
+int iplimit_acquire(struct sockaddr_storage *addr);
+void iplimit_release(int slot);
+
+#endif /* __IPLIMIT_H__ */
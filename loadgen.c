@@ -0,0 +1,417 @@
+/*
+ * loadgen.c - HTTP load generator for measuring the proxy's throughput
+ *     and tail latency
+ *
+ * A fixed number of threads, each with one connection at a time, fetch
+ * URLs whose popularity follows a Zipf distribution over a numbered set
+ * of files (by default /bench/<n>, which bench.sh creates under tiny).
+ * Requests go to the server at <host> <port>; with -x they are sent to
+ * a proxy as absolute URIs for that server instead.
+ *
+ * In closed-loop mode (the default) every thread sends its next request
+ * as soon as the previous response has arrived. In open-loop mode (-r)
+ * requests are due at a constant total rate whether or not earlier ones
+ * have finished. A request that starts late because its thread was
+ * still busy is then charged for the wait as well: the corrected
+ * latency runs from when it was due, not from when it was sent, so a
+ * server stall shows up in every request it delays rather than in just
+ * the one request that was in flight (coordinated omission).
+ *
+ * The proxy closes every connection after one response, so each request
+ * uses a fresh connection. With -g, requests say they accept gzip.
+ *
+ * Alongside (or, with -c 0, instead of) the regular load, -L and -R run
+ * hostile clients that each hold one connection at a time to the path
+ * given by -u. A slowloris client sends a request line and then one
+ * byte of header per second, never finishing the request; a slow
+ * reader sends a whole request with a tiny receive buffer and takes
+ * the response one byte per second. Both reconnect as soon as the
+ * server drops them. With -B they connect from that local address, so
+ * that a server limiting connections per address can tell them apart
+ * from the regular load.
+ */
+#include <poll.h>
+#include "csapp.h"
+#include "hist.h"
+
+#define MAXCONNS 1024 /* Most concurrent connections */
+#define TIMEOUT 10    /* Seconds to wait on a stalled server */
+#define RESPBUF 65536 /* Bytes read from a response at a time */
+#define SLOW_RCVBUF 1024 /* Slow readers' receive buffer */
+#define RECONNECT_MS 100 /* Attackers' pause before reconnecting */
+
+/* Per-thread results */
+typedef struct {
+  int id;
+  long requests, errors, bytes;
+  hist_t service;          /* Send to last byte */
+  hist_t corrected;        /* Due time to last byte */
+  unsigned short xsubi[3]; /* erand48() state */
+} worker_t;
+
+static char *host, *port;             /* Where requests are sent */
+static char *proxy_host, *proxy_port; /* -x, if going through a proxy */
+static char *pattern = "/bench/%d";   /* printf pattern of the URL paths */
+static int nconns = 16;               /* Concurrent connections */
+static double duration = 10;          /* Seconds to run */
+static double rate;                   /* Total requests/s, 0: closed loop */
+static int nurls = 1000;              /* Distinct URLs */
+static double zipf_s = 1.0;           /* Zipf exponent */
+static double *cdf;                   /* Zipf CDF over the URL ranks */
+static int64_t start, stop;           /* Run window, CLOCK_MONOTONIC ns */
+static int nloris, nslowread;         /* -L, -R: attackers of each kind */
+static char *attack_path = "/bench/0"; /* -u: what attackers request */
+static char *bind_addr;               /* -B: attackers' local address */
+static int accept_gzip;               /* -g: send Accept-Encoding: gzip */
+static long attack_conns, attack_cuts; /* Attack connections made, cut */
+
+void *worker(void *vargp);
+void *attacker(void *vargp);
+int attack_connect(int slow_reader);
+int fetch(int url, long *bytes);
+int zipf_sample(worker_t *w);
+void build_cdf(void);
+int64_t now_ns(void);
+void sleep_until(int64_t t);
+void print_row(char *name, hist_t *h);
+
+int main(int argc, char **argv) {
+  worker_t *workers, total;
+  pthread_t *tids, tid;
+  double secs;
+  char *colon;
+  int i, c;
+
+  while ((c = getopt(argc, argv, "c:d:r:n:s:p:x:L:R:u:B:g")) != -1) {
+    switch (c) {
+    case 'c': /* Concurrent connections */
+      nconns = atoi(optarg);
+      break;
+    case 'd': /* Duration in seconds */
+      duration = atof(optarg);
+      break;
+    case 'r': /* Open loop at this many requests/s */
+      rate = atof(optarg);
+      break;
+    case 'n': /* Number of distinct URLs */
+      nurls = atoi(optarg);
+      break;
+    case 's': /* Zipf exponent, 0 for uniform */
+      zipf_s = atof(optarg);
+      break;
+    case 'p': /* URL path pattern, with one %d for the URL number */
+      pattern = optarg;
+      break;
+    case 'x': /* Send requests through the proxy at host:port */
+      if ((colon = strrchr(optarg, ':')) == NULL)
+        argc = 0;
+      else {
+        *colon = '\0';
+        proxy_host = optarg;
+        proxy_port = colon + 1;
+      }
+      break;
+    case 'L': /* Slowloris connections */
+      nloris = atoi(optarg);
+      break;
+    case 'R': /* Slow-reader connections */
+      nslowread = atoi(optarg);
+      break;
+    case 'u': /* Path the attackers request */
+      attack_path = optarg;
+      break;
+    case 'B': /* Local address for the attackers */
+      bind_addr = optarg;
+      break;
+    case 'g': /* Accept gzipped responses */
+      accept_gzip = 1;
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if (optind != argc - 2 || nconns < 0 || nconns > MAXCONNS || nurls < 1 ||
+      duration <= 0 || rate < 0 || nloris < 0 || nslowread < 0 ||
+      nconns + nloris + nslowread == 0) {
+    fprintf(stderr,
+            "usage: %s [-c conns] [-d secs] [-r rate] [-n urls] [-s zipf] "
+            "[-p pattern] [-x proxyhost:port] [-g]\n"
+            "       [-L loris] [-R slowreaders] [-u path] [-B bindaddr] "
+            "<host> <port>\n",
+            argv[0]);
+    exit(1);
+  }
+  host = argv[optind];
+  port = argv[optind + 1];
+
+  Signal(SIGPIPE, SIG_IGN);
+  build_cdf();
+  workers = Calloc(nconns + 1, sizeof(worker_t));
+  tids = Calloc(nconns + 1, sizeof(pthread_t));
+  start = now_ns();
+  stop = start + (int64_t)(duration * 1e9);
+  for (i = 0; i < nloris + nslowread; i++) /* Detached; never joined */
+    Pthread_create(&tid, NULL, attacker, (void *)(long)(i >= nloris));
+  for (i = 0; i < nconns; i++) {
+    workers[i].id = i;
+    workers[i].xsubi[0] = i;
+    workers[i].xsubi[1] = i >> 16;
+    workers[i].xsubi[2] = 0x330e;
+    Pthread_create(&tids[i], NULL, worker, &workers[i]);
+  }
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < nconns; i++) {
+    Pthread_join(tids[i], NULL);
+    total.requests += workers[i].requests;
+    total.errors += workers[i].errors;
+    total.bytes += workers[i].bytes;
+    hist_merge(&total.service, &workers[i].service);
+    hist_merge(&total.corrected, &workers[i].corrected);
+  }
+  if (nconns == 0)
+    sleep_until(stop);
+  secs = (now_ns() - start) / 1e9;
+
+  if (nloris + nslowread > 0)
+    printf("attack     %d slowloris, %d slow readers: %ld conns, %ld cut\n",
+           nloris, nslowread, attack_conns, attack_cuts);
+  if (nconns == 0)
+    exit(0);
+  if (rate > 0)
+    printf("mode       open loop, %d conns, %.0f req/s offered\n", nconns,
+           rate);
+  else
+    printf("mode       closed loop, %d conns\n", nconns);
+  printf("urls       %d, zipf s=%.2f\n", nurls, zipf_s);
+  printf("requests   %ld in %.1f s, %.1f req/s, %.2f MB/s, %ld errors\n",
+         total.requests, secs, total.requests / secs,
+         total.bytes / secs / 1e6, total.errors);
+  printf("%-10s %9s %9s %9s %9s %9s\n", "ms", "p50", "p90", "p99", "p999",
+         "max");
+  print_row("service", &total.service);
+  if (rate > 0)
+    print_row("corrected", &total.corrected);
+  exit(0);
+}
+
+/*
+ * worker - issue requests until the run window closes. In open-loop
+ *     mode thread i owns every nconns-th slot of the global schedule.
+ */
+void *worker(void *vargp) {
+  worker_t *w = vargp;
+  int64_t due, sent, done, gap = 0;
+  long k, bytes;
+
+  if (rate > 0)
+    gap = (int64_t)(1e9 / rate);
+  for (k = 0;; k++) {
+    due = rate > 0 ? start + (w->id + k * nconns) * gap : now_ns();
+    if (due >= stop)
+      break;
+    sleep_until(due);
+    sent = now_ns();
+    if (sent >= stop)
+      break;
+
+    if (fetch(zipf_sample(w), &bytes) < 0) {
+      w->errors++;
+      continue;
+    }
+    done = now_ns();
+    w->requests++;
+    w->bytes += bytes;
+    hist_record(&w->service, done - sent);
+    hist_record(&w->corrected, done - due);
+  }
+  return NULL;
+}
+
+/*
+ * attacker - hold one hostile connection at a time until the run window
+ *     closes: a slow reader if vargp is nonzero, a slowloris otherwise
+ */
+void *attacker(void *vargp) {
+  int slow_reader = (long)vargp, fd, ms, rc;
+  char c;
+  struct pollfd pfd;
+  int64_t now;
+
+  Pthread_detach(pthread_self());
+  while ((now = now_ns()) < stop) {
+    if ((fd = attack_connect(slow_reader)) < 0) {
+      usleep(RECONNECT_MS * 1000);
+      continue;
+    }
+    __sync_fetch_and_add(&attack_conns, 1);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while ((now = now_ns()) < stop) {
+      /* One byte each second, or sooner if the server closes on us */
+      ms = (stop - now) / 1000000 < 1000 ? (stop - now) / 1000000 : 1000;
+      if (!slow_reader && poll(&pfd, 1, ms) != 0) {
+        while ((rc = read(fd, &c, 1)) > 0) /* Drain any error page */
+          ;
+        break;
+      }
+      if (slow_reader) {
+        usleep(ms * 1000);
+        if ((rc = recv(fd, &c, 1, MSG_DONTWAIT)) < 0 && errno == EAGAIN)
+          continue; /* Nothing sent yet */
+      } else
+        rc = write(fd, "X", 1);
+      if (rc <= 0)
+        break;
+    }
+    close(fd);
+    if (now < stop) {
+      __sync_fetch_and_add(&attack_cuts, 1);
+      usleep(RECONNECT_MS * 1000);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * attack_connect - connect to the server (or proxy) from bind_addr and
+ *     send the start of a request for attack_path: the whole request for
+ *     a slow reader, which also gets a tiny receive buffer, only the
+ *     request line and the start of a header for a slowloris. Returns
+ *     the connected descriptor, or -1 on error.
+ */
+int attack_connect(int slow_reader) {
+  char req[MAXBUF];
+  struct addrinfo hints, *ai;
+  struct sockaddr_in local;
+  int fd, n, size = SLOW_RCVBUF;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(proxy_host ? proxy_host : host,
+                  proxy_host ? proxy_port : port, &hints, &ai) != 0)
+    return -1;
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    freeaddrinfo(ai);
+    return -1;
+  }
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  if (slow_reader) /* Before connect, so the window starts small */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  if ((bind_addr && (inet_pton(AF_INET, bind_addr, &local.sin_addr) != 1 ||
+                     bind(fd, (SA *)&local, sizeof(local)) < 0)) ||
+      connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+    freeaddrinfo(ai);
+    close(fd);
+    return -1;
+  }
+  freeaddrinfo(ai);
+
+  if (proxy_host)
+    n = snprintf(req, sizeof(req), "GET http://%s:%s%s HTTP/1.0\r\n", host,
+                 port, attack_path);
+  else
+    n = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n", attack_path);
+  n += snprintf(req + n, sizeof(req) - n, "Host: %s:%s\r\n%s", host, port,
+                slow_reader ? "\r\n" : "X-Padding: ");
+  if (rio_writen(fd, req, n) != n) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * fetch - GET URL number url and read the whole response. Returns 0 for
+ *     a 200 response, -1 on any error or other status.
+ */
+int fetch(int url, long *bytes) {
+  char path[MAXLINE], req[MAXBUF], buf[RESPBUF];
+  struct timeval tv = {TIMEOUT, 0};
+  int fd, n, status = 0;
+  ssize_t rc;
+
+  snprintf(path, sizeof(path), pattern, url);
+  if (proxy_host) {
+    fd = open_clientfd(proxy_host, proxy_port);
+    n = snprintf(req, sizeof(req), "GET http://%s:%s%s HTTP/1.0\r\n", host,
+                 port, path);
+  } else {
+    fd = open_clientfd(host, port);
+    n = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n", path);
+  }
+  if (fd < 0)
+    return -1;
+  n += snprintf(req + n, sizeof(req) - n, "Host: %s:%s\r\n%s\r\n", host,
+                port, accept_gzip ? "Accept-Encoding: gzip\r\n" : "");
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if (rio_writen(fd, req, n) != n) {
+    close(fd);
+    return -1;
+  }
+
+  *bytes = 0;
+  while ((rc = read(fd, buf, sizeof(buf) - 1)) > 0) {
+    if (*bytes == 0) {
+      buf[rc] = '\0';
+      sscanf(buf, "HTTP/%*s %d", &status);
+    }
+    *bytes += rc;
+  }
+  close(fd);
+  return rc == 0 && status == 200 ? 0 : -1;
+}
+
+/* zipf_sample - draw a URL number, 0 being the most popular */
+int zipf_sample(worker_t *w) {
+  double u = erand48(w->xsubi);
+  int lo = 0, hi = nurls - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* build_cdf - tabulate P(rank <= i) for rank weights 1/(i+1)^s */
+void build_cdf(void) {
+  double sum = 0;
+  int i;
+
+  cdf = Calloc(nurls, sizeof(double));
+  for (i = 0; i < nurls; i++)
+    cdf[i] = sum += pow(i + 1, -zipf_s);
+  for (i = 0; i < nurls; i++)
+    cdf[i] /= sum;
+}
+
+int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* sleep_until - wait until CLOCK_MONOTONIC time t, if it is still ahead */
+void sleep_until(int64_t t) {
+  struct timespec ts;
+
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+void print_row(char *name, hist_t *h) {
+  printf("%-10s %9.2f %9.2f %9.2f %9.2f %9.2f\n", name,
+         hist_quantile(h, 0.5) / 1e6, hist_quantile(h, 0.9) / 1e6,
+         hist_quantile(h, 0.99) / 1e6, hist_quantile(h, 0.999) / 1e6,
+         h->max / 1e6);
+}
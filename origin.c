@@ -0,0 +1,205 @@
+/*
+ * origin.c - per-origin state shared by the proxy threads
+ *
+ * Each origin server the proxy talks to, named by "host:port", gets an
+ * entry in a small hash table the first time it is sent a request.
+ * While an origin is marked down, connects to it fail at once instead
+ * of paying for another getaddrinfo() and connect() attempt. Entries
+ * are never removed; there is one per distinct origin.
+ *
+ * Requests that must go to an origin are also admitted against two
+ * adaptive concurrency limits, and shed when either is full. Each
+ * origin's limit follows the gradient between the lowest time to first
+ * byte seen lately and the latest one: while the origin answers as
+ * fast as it can, the limit grows by about its square root, which
+ * leaves room for a small queue; once requests queue up inside the
+ * origin, their latency grows and the limit shrinks in proportion,
+ * down to half per sample. A failed request counts as the worst
+ * gradient. The global limit, on origin requests over all origins, is
+ * there to keep workers free for cache hits and for answering shed
+ * requests. It is AIMD on how long requests waited for a worker: it is
+ * cut by a tenth, at most once per QUEUE_TARGET * 20, while that wait
+ * is over QUEUE_TARGET, and otherwise grows by one per limit's worth of
+ * admissions. No limit goes below 1 or above ORIGIN_SHARE of the
+ * process's workers: the threads that the proxy managed to start, so
+ * that a stack size too large for all of them (-s) lowers it too. With
+ * -P, each worker process has its own workers and its own limits.
+ */
+#include "origin.h"
+
+#define NBUCKETS 256
+#define WINDOW 500     /* Latency samples per baseline window */
+#define SMOOTHING 0.2  /* Weight of each new per-origin limit */
+
+static origin_t *buckets[NBUCKETS];
+static double max_limit; /* ORIGIN_SHARE of the workers, at least 1 */
+static limiter_t global; /* Origin requests over all origins */
+static sem_t mutex;      /* Protects the table, its entries and global */
+
+static unsigned hash(const char *s) {
+  unsigned h = 2166136261u; /* FNV-1a */
+
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Find the entry for host:port, creating it if asked to */
+static origin_t *find(char *host, char *port, int create) {
+  char name[MAXLINE];
+  origin_t *o;
+  unsigned b;
+
+  snprintf(name, sizeof(name), "%s:%s", host, port);
+  b = hash(name) % NBUCKETS;
+  for (o = buckets[b]; o; o = o->next)
+    if (!strcmp(o->name, name))
+      return o;
+  if (!create)
+    return NULL;
+
+  o = Malloc(sizeof(origin_t));
+  o->name = strdup(name);
+  o->down_until = 0;
+  memset(&o->lim, 0, sizeof(limiter_t));
+  o->lim.limit = max_limit / 2; /* Per-origin, at first */
+  o->next = buckets[b];
+  buckets[b] = o;
+  return o;
+}
+
+/* Keep a limit within bounds */
+static double clamp(double limit) {
+  if (limit < 1)
+    return 1;
+  return limit > max_limit ? max_limit : limit;
+}
+
+/*
+ * gradient - adapt l to a request that took ttfb ns to its first byte,
+ *     or failed if ttfb is 0. The caller holds the mutex.
+ */
+static void gradient(limiter_t *l, int64_t ttfb) {
+  double g = 0.5, target;
+
+  if (ttfb > 0) {
+    if (l->window == 0 || ttfb < l->window)
+      l->window = ttfb;
+    if (l->baseline == 0 || ttfb < l->baseline)
+      l->baseline = ttfb;
+    if (++l->samples == WINDOW) { /* Let the baseline rise again */
+      l->baseline = l->window;
+      l->window = 0;
+      l->samples = 0;
+    }
+    g = (double)l->baseline / ttfb;
+    if (g < 0.5)
+      g = 0.5;
+  }
+  if (g == 1.0 && l->inflight * 2 < l->limit)
+    return; /* Not using the limit it has; no reason to raise it */
+  target = l->limit * g + sqrt(l->limit);
+  l->limit = clamp((1 - SMOOTHING) * l->limit + SMOOTHING * target);
+}
+
+/*
+ * aimd - adapt the global limit to a request that waited queued ns for
+ *     a worker. The caller holds the mutex.
+ */
+static void aimd(int64_t queued, int64_t now) {
+  if (queued > QUEUE_TARGET) {
+    if (now - global.last_drop > QUEUE_TARGET * 20) {
+      global.limit = clamp(global.limit * 0.9);
+      global.last_drop = now;
+    }
+  } else if (global.inflight * 2 >= global.limit)
+    global.limit = clamp(global.limit + 1 / global.limit);
+}
+
+/* origin_init - set the limits up for a process with workers threads */
+void origin_init(int workers) {
+  Sem_init(&mutex, 0, 1);
+  max_limit = floor(workers * ORIGIN_SHARE);
+  if (max_limit < 1)
+    max_limit = 1;
+  global.limit = max_limit;
+}
+
+/* origin_is_down - return 1 if connects to host:port should fail fast */
+int origin_is_down(char *host, char *port, time_t now) {
+  origin_t *o;
+  int down;
+
+  P(&mutex);
+  o = find(host, port, 0);
+  down = o && now < o->down_until;
+  V(&mutex);
+  return down;
+}
+
+/* origin_failed - make connects to host:port fail fast until until */
+void origin_failed(char *host, char *port, time_t until) {
+  P(&mutex);
+  find(host, port, 1)->down_until = until;
+  V(&mutex);
+}
+
+/* origin_succeeded - clear any cooldown once host:port answers again */
+void origin_succeeded(char *host, char *port) {
+  origin_t *o;
+
+  P(&mutex);
+  if ((o = find(host, port, 0)) != NULL)
+    o->down_until = 0;
+  V(&mutex);
+}
+
+/*
+ * origin_admit - take a place for a request to host:port, which waited
+ *     queued ns for a worker. Returns 0 if it may go ahead, in which
+ *     case the caller must call origin_release() once it is done, or -1
+ *     if it should be shed. With force set it is never shed, and only
+ *     counts against the limits.
+ */
+int origin_admit(char *host, char *port, int64_t queued, int64_t now,
+                 int force) {
+  origin_t *o;
+  int rc = -1;
+
+  P(&mutex);
+  aimd(queued, now);
+  o = find(host, port, 1);
+  if (force || (global.inflight < (int)global.limit &&
+                o->lim.inflight < (int)o->lim.limit)) {
+    global.inflight++;
+    o->lim.inflight++;
+    rc = 0;
+  }
+  V(&mutex);
+  return rc;
+}
+
+/*
+ * origin_release - give back the place of an admitted request to
+ *     host:port, whose response header took ttfb ns, or 0 if it failed
+ */
+void origin_release(char *host, char *port, int64_t ttfb) {
+  origin_t *o;
+
+  P(&mutex);
+  o = find(host, port, 1);
+  gradient(&o->lim, ttfb);
+  o->lim.inflight--;
+  global.inflight--;
+  V(&mutex);
+}
+
+/* origin_limits - store the global limit and the requests in flight */
+void origin_limits(double *limit, int *inflight) {
+  P(&mutex);
+  *limit = global.limit;
+  *inflight = global.inflight;
+  V(&mutex);
+}
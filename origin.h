@@ -0,0 +1,54 @@
+/*
+ * origin.h - per-origin state shared by the proxy threads
+ */
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include "csapp.h"
+
+/* Seconds connects to an origin fail fast after a failed attempt */
+#ifndef ORIGIN_COOLDOWN
+#define ORIGIN_COOLDOWN 5
+#endif
+
+/*
+ * Share of a process's worker threads that origin requests may take up
+ * at once, over all origins; the others stay free for cache hits and
+ * for answering shed requests. 12 of the usual 16 workers.
+ */
+#ifndef ORIGIN_SHARE
+#define ORIGIN_SHARE 0.75
+#endif
+
+/* Queueing for a worker beyond this many ns means the proxy is behind */
+#ifndef QUEUE_TARGET
+#define QUEUE_TARGET 5000000
+#endif
+
+/* An adaptive limit on concurrent requests */
+typedef struct {
+  double limit;      /* Requests allowed in flight */
+  int inflight;      /* Requests now in flight */
+  int64_t baseline;  /* Lowest latency of the last full window, ns */
+  int64_t window;    /* Lowest latency of the current window, ns */
+  int samples;       /* Samples in the current window */
+  int64_t last_drop; /* When the limit was last cut, ns */
+} limiter_t;
+
+typedef struct origin {
+  char *name;          /* "host:port" */
+  time_t down_until;   /* Connects fail fast until this time */
+  limiter_t lim;       /* Requests to this origin */
+  struct origin *next; /* Next origin in the hash chain */
+} origin_t;
+
+void origin_init(int workers);
+int origin_is_down(char *host, char *port, time_t now);
+void origin_failed(char *host, char *port, time_t until);
+void origin_succeeded(char *host, char *port);
+int origin_admit(char *host, char *port, int64_t queued, int64_t now,
+                 int force);
+void origin_release(char *host, char *port, int64_t ttfb);
+void origin_limits(double *limit, int *inflight);
+
+#endif /* __ORIGIN_H__ */
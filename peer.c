@@ -0,0 +1,105 @@
+/*
+ * peer.c - sibling proxies that split the cache between them
+ *
+ * A fleet of proxies that each cache the same popular objects has the
+ * cache capacity of one of them. Given the same list of peers, every
+ * proxy in the fleet maps a URI to the same owner with a consistent
+ * hash ring, and fetches what it does not own from the owner instead
+ * of the origin, without keeping a copy (see open_origin() in
+ * proxy.c). Each object is then cached on one proxy only, and the
+ * fleet's capacity is the sum of theirs.
+ *
+ * Each peer is put on the ring at PEER_VNODES points, hashed from its
+ * name and the point's number. A URI belongs to the peer at the first
+ * point at or after the URI's own hash, wrapping around. With many
+ * points per peer, each owns close to an equal share of the ring, and
+ * a peer added to or dropped from the list only moves the URIs it
+ * takes or gives up; the rest keep their owner and stay cached.
+ */
+#include <stdint.h>
+#include "peer.h"
+#include "uri.h"
+
+typedef struct {
+  uint64_t hash; /* Where on the ring */
+  int peer;      /* Index into peers */
+} point_t;
+
+static peer_t peers[MAX_PEERS];
+static int npeers;
+static int self = -1;   /* This proxy's index in peers */
+static point_t *ring;   /* Sorted by hash */
+static int npoints;
+
+static int cmp_point(const void *a, const void *b) {
+  uint64_t x = ((const point_t *)a)->hash, y = ((const point_t *)b)->hash;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * peer_init - set up the ring from list, a comma-separated list of
+ *     host:port names, one of which must be self, this proxy
+ */
+void peer_init(char *list, char *self_name) {
+  char *name, *save, *colon, buf[MAXLINE];
+  int i, v;
+
+  for (name = strtok_r(list, ",", &save); name;
+       name = strtok_r(NULL, ",", &save)) {
+    if ((colon = strrchr(name, ':')) == NULL || colon == name || !colon[1])
+      app_error("peer_init: peers are named host:port");
+    if (npeers == MAX_PEERS)
+      app_error("peer_init: too many peers");
+    peers[npeers].name = strdup(name);
+    peers[npeers].host = strndup(name, colon - name);
+    peers[npeers].port = strdup(colon + 1);
+    if (!strcmp(name, self_name))
+      self = npeers;
+    npeers++;
+  }
+  if (self < 0)
+    app_error("peer_init: this proxy is not in the peer list");
+
+  ring = Malloc(npeers * PEER_VNODES * sizeof(point_t));
+  for (i = 0; i < npeers; i++)
+    for (v = 0; v < PEER_VNODES; v++) {
+      snprintf(buf, sizeof(buf), "%s#%d", peers[i].name, v);
+      ring[npoints].hash = uri_hash(buf);
+      ring[npoints++].peer = i;
+    }
+  qsort(ring, npoints, sizeof(point_t), cmp_point);
+}
+
+/*
+ * peer_owner - return the index of the peer that owns the key with hash
+ *     h, its uri_hash(), or -1 if this proxy owns it or there are no
+ *     peers
+ */
+int peer_owner(uint64_t h) {
+  int lo, hi, mid, owner;
+
+  if (npoints == 0)
+    return -1;
+  lo = 0;
+  hi = npoints; /* The first point at or after h is in [lo, hi] */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  owner = ring[lo == npoints ? 0 : lo].peer;
+  return owner == self ? -1 : owner;
+}
+
+/* peer_get - return peer i */
+peer_t *peer_get(int i) {
+  return &peers[i];
+}
+
+/* peer_self - return this proxy's name in the peer list, NULL if none */
+char *peer_self(void) {
+  return self < 0 ? NULL : peers[self].name;
+}
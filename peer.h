@@ -0,0 +1,29 @@
+/*
+ * peer.h - sibling proxies that split the cache between them
+ */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* Points each peer gets on the hash ring */
+#ifndef PEER_VNODES
+#define PEER_VNODES 160
+#endif
+
+#define MAX_PEERS 64
+
+/* A proxy in the fleet */
+typedef struct {
+  char *name; /* "host:port", as in the peer list */
+  char *host;
+  char *port;
+} peer_t;
+
+void peer_init(char *list, char *self);
+int peer_owner(uint64_t hash);
+peer_t *peer_get(int i);
+char *peer_self(void);
+
+#endif /* __PEER_H__ */
@@ -1,15 +1,2469 @@
-#include <stdio.h>
+/*
+ * proxy.c - A concurrent, caching HTTP/1.0 Web proxy
+ *
+ * The main thread accepts connections and hands the descriptors to a
+ * fixed pool of worker threads through a bounded buffer. A worker
+ * parses the request, answers it from the cache when it can, and
+ * otherwise forwards it to the origin server, caching the response on
+ * the way back if it is small enough.
+ *
+ * The cache key is the request URI in a canonical form (see uri.c), so
+ * that spellings of one URI that differ in case, default port or
+ * percent-encoding share one object. A request may also give just the
+ * path, with the host in a Host header. The key is hashed once, and
+ * the hash goes with it to the cache, its tiers and the peer ring.
+ *
+ * A response with a Vary header is cached as one of the variants of its
+ * URI (see vary.c): the URI's entry holds just the Vary list, and each
+ * request looks up the variant its own values of those headers select.
+ * A body the origin sent gzipped is cached as it came, and inflated for
+ * a client that does not accept gzip, as with -g below; a body in any
+ * other encoding is not cached.
+ *
+ * Objects larger than MAX_OBJECT_SIZE are cached as SEGMENT_SIZE
+ * segments. Full and single-range requests for such objects are
+ * assembled from the cached segments, and only the missing runs of
+ * segments are fetched from the origin with a Range request.
+ *
+ * Cached objects keep the origin's ETag and Last-Modified validators
+ * and stay fresh for the response's max-age, or a configured default.
+ * A stale object is still served at once for a while longer
+ * (stale-while-revalidate) and handed to a background refresher thread,
+ * which revalidates it with a conditional GET; a 304 makes the cached
+ * copy fresh again. Objects stale beyond that window are revalidated
+ * inline by the request that finds them.
+ *
+ * Error responses are cached too, for a short time, so that clients
+ * retrying a missing URL do not reach the origin each time. An origin
+ * that refuses a connection, or whose name does not resolve, is marked
+ * down for a cooldown period during which connects to it fail at once.
+ *
+ * Each request is stamped with CLOCK_MONOTONIC at fixed points on its
+ * way through the proxy, and the time between stamps is recorded into
+ * per-thread phase histograms (see timing.c). Events are counted per
+ * thread as well (see stats.c). A GET of STATS_PATH, sent to the proxy
+ * itself, returns the summed counters, the cache occupancy, the queue
+ * depths and the phase latency quantiles in Prometheus text format;
+ * SIGUSR1 prints the counters and quantiles to stderr.
+ *
+ * Every blocking socket call runs under a deadline (see deadline.c):
+ * a client must send its request header within HEADER_TIMEOUT and take
+ * each write of the response within CLIENT_TIMEOUT, and an origin must
+ * accept the connection within CONNECT_TIMEOUT and deliver each block
+ * of its response within ORIGIN_TIMEOUT. A socket whose deadline passes
+ * is shut down, which fails the call that was stuck on it. Past their
+ * timeouts, clients must also keep sending the header at
+ * HEADER_MIN_RATE and taking the response at CLIENT_MIN_RATE, so that
+ * trickling a request (slowloris) or reading a response a few bytes at
+ * a time cannot hold a worker for long. Request headers are capped at
+ * MAX_HDR_LINES lines and MAX_HDR_BYTES bytes, and each client address
+ * may hold only a few connections at once (see iplimit.c).
+ *
+ * A connection is only accepted once its request has arrived
+ * (TCP_DEFER_ACCEPT), and the main thread peeks at it first. A plain GET
+ * for a fresh, whole cached object of at most FAST_MAX_SIZE bytes is
+ * answered right there with one non-blocking write, sparing it the trip
+ * through the bounded buffer to a worker. Anything else, or whatever of
+ * the response the socket would not take at once, goes to a worker.
+ *
+ * Workers run on small stacks, WORKER_STACK bytes unless -s says
+ * otherwise, each with a guard page below it, so that an overflow
+ * faults at once instead of writing over something else. Nothing large
+ * lives on them: what a request allocates comes from its thread's
+ * arena (see arena.c). With -a, every worker measures how deep its
+ * stack went on each request (see stackuse.c), and the deepest seen on
+ * each code path is reported with the other statistics.
+ *
+ * With -f, the cache is saved to a snapshot file on SIGTERM, and every
+ * -i seconds if that is set too (see snapshot.c). A proxy started with
+ * the same -f warms its cache up from the file: a request for an object
+ * in it restores that object at once, and the rest follow in the
+ * background.
+ *
+ * With -d, objects evicted from the cache go to a second, much larger
+ * tier in a file of -z MB (see disk.c). A request that misses the cache
+ * is answered from there if it can be, and an object found there more
+ * than once goes back into the cache.
+ *
+ * With -P, the proxy forks that many worker processes, each one the
+ * whole proxy described above, accepting from the same listening
+ * socket. They share a single cache in a shared memory segment (see
+ * shcache.c). The parent only replaces workers that die, after letting
+ * go of the cache entries they held, and stops them all on SIGTERM.
+ * Everything else, such as the counters and the per-address limits,
+ * stays per process.
+ *
+ * With -g, text bodies are kept in the cache gzipped (see gzip.c). A
+ * client that accepts gzip is sent such a body as it is; any other
+ * client, and any range request, gets it inflated on the way out.
+ *
+ * With -k, a miss is only cached if its URI missed before, within the
+ * last -k new URIs or so (see door.c), so that objects asked for once
+ * do not push out those asked for again. Revalidated objects are always
+ * cached again. Each -P worker keeps a doorkeeper of its own.
+ *
+ * With -p, the proxy is one of a fleet of peers, named host:port in
+ * the list, this one by -m (see peer.c). Every URI has an owner among
+ * them, and a miss on a URI another peer owns is fetched from that peer
+ * rather than the origin, unless the peer is unreachable or sheds it.
+ * What comes from a peer is not cached again, so the fleet caches about
+ * as much as all its peers together. A request from a peer carries
+ * X-Proxy-Peer, and is never sent on to another peer.
+ *
+ * With -H, the proxy can be replaced without dropping a connection or
+ * its cache (see restart.c). A new proxy started with the same -H takes
+ * the listening socket and the shared cache over from the running one,
+ * which then stops accepting, finishes the connections it has, for at
+ * most DRAIN_TIMEOUT, and exits. The listening socket is non-blocking
+ * in this mode, so that the main thread can wait for a connection and
+ * for the handoff at once.
+ */
+#include <sys/resource.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <limits.h>
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include "csapp.h"
+#include "arena.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "deadline.h"
+#include "dedup.h"
+#include "disk.h"
+#include "door.h"
+#include "gzip.h"
+#include "iplimit.h"
+#include "origin.h"
+#include "peer.h"
+#include "restart.h"
+#include "sbuf.h"
+#include "snapshot.h"
+#include "stackuse.h"
+#include "stats.h"
+#include "timing.h"
+#include "uri.h"
+#include "vary.h"
+
+#define NTHREADS 16     /* Worker threads */
+#define SBUFSIZE 64     /* Accepted connections waiting for a worker */
+#define REFRESH_QLEN 64 /* Background refreshes waiting to run */
+#define FAST_MAX_SIZE 65536 /* Largest object the main thread answers */
+#define DEFER_ACCEPT 1      /* Seconds to wait for a request, then accept */
+#define WORKER_STACK 65536  /* Stack size of the worker threads */
+#define HDR_SIZE 768        /* Room for a header from format_hdrs() */
+#define STATS_SIZE (2 * MAXBUF) /* First room for the statistics page */
+#define DRAIN_TIMEOUT 30    /* Seconds to finish connections after -H */
+#define MAX_PLAIN_SIZE (8 * MAX_OBJECT_SIZE) /* Most a gzip body inflates to */
+
+/* Limits on a client's request header */
+#define MAX_HDR_LINES 64
+#define MAX_HDR_BYTES MAXBUF
+
+/* How format_hdrs() describes a body: as it came, inflated from a gzipped
+   copy, or gzipped */
+enum { ENC_NONE, ENC_IDENTITY, ENC_GZIP };
+
+/* What read_requesthdrs() does with each client header */
+enum { HDR_DROP, HDR_HOST, HDR_RANGE, HDR_COND, HDR_PEER, HDR_FORWARD };
+
+/* Code paths whose stack use -a measures */
+enum {
+  R_ERROR,    /* Refused or failed before it got anywhere */
+  R_STATS,    /* STATS_PATH */
+  R_HIT,      /* Answered from a whole cached object */
+  R_SEGMENTS, /* Answered from cached segments, fetching the missing ones */
+  R_MISS,     /* Forwarded to the origin */
+  R_FAST,     /* Rest of a response the main thread started */
+  R_REFRESH,  /* Background refresh */
+  NROUTES
+};
+
+/* Path at which the proxy answers with its own statistics */
+#define STATS_PATH "/__proxy/stats"
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
 
-int main() {
-  printf("%s", user_agent_hdr);
+/* A parsed client request */
+typedef struct {
+  char *uri;            /* Canonical absolute URI */
+  uint64_t hash;        /* uri_hash(uri), computed once */
+  char *key;            /* Cache key: uri, or the key of its variant */
+  uint64_t keyhash;     /* uri_hash(key) */
+  char *vary;           /* Vary list of uri's primary entry, "" if none */
+  char *host;           /* Origin host */
+  char *port;           /* Origin port */
+  char *path;           /* Path sent on the origin request line */
+  char *range;          /* Client's Range header value, "" if none */
+  char *hosthdr;        /* Client's Host header value, "" if none */
+  char *cond;           /* Client's own conditional header lines */
+  char *hdrs;           /* Other client headers, forwarded verbatim */
+  arena_t *arena;       /* Holds the strings above, and all scratch */
+  stamps_t stamps;      /* When it reached each point, see timing.h */
+  deadline_t client_dl; /* Deadline on the client connection */
+  deadline_t origin_dl; /* Deadline on the current origin connection */
+  brio_t client_rio;    /* Reads the request */
+  brio_t origin_rio;    /* Reads the current origin response */
+  int64_t queued;       /* ns it waited for a worker */
+  int64_t origin_start; /* When the current origin request was admitted */
+  int64_t origin_ttfb;  /* Its time to first byte, 0 until known */
+  int route;            /* R_*, how it was answered */
+  int from_peer;        /* Sent by a peer, for a URI this proxy owns */
+  int peer;             /* Peer to fetch a miss from, -1 for the origin */
+  int via_peer;         /* The current origin connection is to that peer */
+} request_t;
+
+/* The interesting parts of an origin response header */
+typedef struct {
+  int status;
+  long length;           /* Content-Length, -1 if absent */
+  long first, last;      /* From Content-Range */
+  long total;            /* From Content-Range, -1 if absent */
+  int accept_ranges;     /* Origin advertised "Accept-Ranges: bytes" */
+  long max_age;          /* Cache-Control freshness lifetime, -1 if none */
+  long swr;              /* Cache-Control stale-while-revalidate, or -1 */
+  int no_store;          /* Cache-Control forbids a shared cache copy */
+  int encoded;           /* Has a Content-Encoding other than identity */
+  int gzipped;           /* ... which is gzip */
+  char *vary;            /* Vary list (see vary.c), "" if absent */
+  char *type;            /* Content-Type */
+  char *etag;            /* ETag, "" if absent */
+  char *lastmod;         /* Last-Modified, "" if absent */
+  char *hdrs;            /* Raw status line and headers */
+  size_t hdrlen;
+} response_t;
+
+/* Collects a body stream into cacheable segments */
+typedef struct {
+  char buf[SEGMENT_SIZE];
+  long idx;  /* Segment being filled */
+  long fill; /* Bytes of it seen so far */
+  int valid; /* Filling started at the segment's first byte */
+  char *key; /* Room for a segment key of the request's URI */
+} segfill_t;
+
+/* A response the main thread started and left to a worker to finish */
+typedef struct {
+  cache_obj_t *obj;   /* The object, referenced */
+  char hdr[HDR_SIZE]; /* Response header */
+  size_t hdrlen;
+  size_t sent;        /* Bytes of header and body already written */
+  stamps_t stamps;
+} fastrest_t;
+
+/* A background refresh of a stale cached object */
+typedef struct refresh {
+  request_t req;        /* Stripped-down copy of the triggering request */
+  cache_obj_t *obj;     /* The stale copy, referenced */
+  struct refresh *next;
+  char strs[];          /* req's strings */
+} refresh_t;
+
+/* The statistics page, as it is written */
+typedef struct {
+  char *buf;
+  int len;  /* Bytes written */
+  int size; /* Bytes allocated */
+} page_t;
+
+static sbuf_t sbuf;
+static int default_ttl = CACHE_TTL; /* Lifetime without a max-age */
+static int default_swr = CACHE_SWR; /* Stale-while-revalidate window */
+static int neg_ttl = CACHE_NEG_TTL;  /* Lifetime of cached errors */
+static int cooldown = ORIGIN_COOLDOWN; /* Fail-fast period of a down origin */
+static int stack_audit;              /* -a: measure stack use per request */
+static int gzip_bodies;              /* -g: keep text bodies gzipped */
+static volatile long stack_hw[NROUTES]; /* Deepest stack seen, by route */
+static const char *route_names[NROUTES] = {
+    "error", "stats", "hit", "segments", "miss", "fast_rest", "refresh"};
+
+static char *snapshot_file;          /* -f: where the cache is saved */
+static int snapshot_interval;        /* -i: seconds between saves, or 0 */
+static char *disk_file;              /* -d: file of the disk tier */
+static pid_t *workers;               /* -P: the worker processes */
+static int nworkers;                 /* Entries in workers */
+static char *handoff_path;           /* -H: socket to hand over on */
+static volatile int draining;        /* Handed over, accepting no more */
+static int wake[2];                  /* Pipe to wake the main thread */
+
+static sigset_t report_mask; /* SIGUSR1 and SIGTERM, for the reporter */
+
+static __thread deadline_t *client_dl; /* This thread's client deadline */
+
+static int64_t *accepted_at; /* Accept time of each open descriptor */
+static int *ipslot;          /* iplimit slot of each open descriptor */
+static fastrest_t **fastrest; /* Unfinished fast hit of each descriptor */
+static int maxfds;           /* Entries in each of the above */
+
+/* Queue of pending background refreshes */
+static refresh_t *refresh_head, *refresh_tail;
+static int refresh_len;
+static sem_t refresh_mutex, refresh_items;
+
+void *thread(void *vargp);
+void *refresher(void *vargp);
+void *reporter(void *vargp);
+void *snapshotter(void *vargp);
+void prefork(int n);
+pid_t fork_worker(void);
+void stop_workers(int sig);
+void stop_accepting(void);
+int wait_accept(int listenfd);
+void drain(void);
+cache_obj_t *lookup(char *key, uint64_t hash, arena_t *a);
+cache_obj_t *lookup_variant(request_t *req, cache_obj_t *primary);
+int set_variant(request_t *req, char *vary);
+void schedule_refresh(request_t *req, cache_obj_t *obj);
+void doit(int fd, arena_t *arena);
+void audit_stack(int route);
+int fast_hit(int fd);
+void forwarded_hdrs(char *buf, char *hdrs);
+void finish_fast(int fd, fastrest_t *fr);
+void handle(int fd, request_t *req);
+int make_key(request_t *req);
+int parse_uri(arena_t *a, char *uri, char **host, char **port,
+              char **path);
+int request_hdr(char *line);
+int read_requesthdrs(brio_t *rp, request_t *req);
+int read_responsehdrs(brio_t *rp, response_t *resp, arena_t *a);
+void parse_cache_control(char *value, response_t *resp);
+void response_meta(response_t *resp, objmeta_t *meta);
+int negative_cacheable(int status);
+char *reason_phrase(int status);
+int resolve_range(char *range, long total, long *first, long *last);
+int connect_origin(request_t *req, char *host, char *port);
+int open_peer(request_t *req);
+int open_origin(request_t *req, char *range, char *cond, int force);
+void close_origin(request_t *req, int originfd);
+void forward(int fd, request_t *req, cache_obj_t *stale);
+void store_whole(request_t *req, response_t *resp, objmeta_t *meta,
+                 char *body, long n);
+void serve_cached(int fd, request_t *req, cache_obj_t *obj);
+int serve_segments(int fd, request_t *req, cache_obj_t *obj);
+cache_obj_t *lookup_segment(request_t *req, cache_obj_t *obj, char *skey,
+                            long idx);
+int fetch_segments(int fd, request_t *req, cache_obj_t *obj, long lo, long hi,
+                   long first, long last);
+segfill_t *new_segfill(request_t *req);
+void seg_feed(segfill_t *sf, request_t *req, objmeta_t *meta, long total,
+              long pos, char *data, long n);
+int write_slice(int fd, long pos, char *data, long n, long first, long last);
+int format_hdrs(char *buf, int status, char *type, long first, long last,
+                long total, int enc, char *vary);
+int write_hdrs(int fd, int status, char *type, long first, long last,
+               long total, int enc, char *vary);
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg);
+ssize_t client_writen(int fd, void *buf, size_t n);
+void serve_stats(int fd);
+void page_printf(page_t *page, const char *fmt, ...);
+void put_metric(page_t *page, char *name, char *type, char *help, long v);
+
+int main(int argc, char **argv) {
+  int i, c, listenfd, connfd;
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+  pthread_t tid;
+  pthread_attr_t attr;
+  struct rlimit rl;
+  int slot, iplimit = IP_CONN_LIMIT;
+  long stack = WORKER_STACK, disk_mb = DISK_SIZE_MB, door_window = 0;
+  int nprocs = 0, cachefd = -1;
+  char *peers = NULL, *self = NULL;
+
+  /* Check command line args */
+  while ((c = getopt(argc, argv, "t:w:n:c:l:s:agk:f:i:d:z:P:H:p:m:")) != -1) {
+    switch (c) {
+    case 't': /* Default freshness lifetime in seconds */
+      default_ttl = atoi(optarg);
+      break;
+    case 'w': /* Stale-while-revalidate window in seconds */
+      default_swr = atoi(optarg);
+      break;
+    case 'n': /* Lifetime of cached error responses in seconds */
+      neg_ttl = atoi(optarg);
+      break;
+    case 'c': /* Fail-fast period after a failed connect in seconds */
+      cooldown = atoi(optarg);
+      break;
+    case 'l': /* Connections per client address, 0 for no limit */
+      iplimit = atoi(optarg);
+      break;
+    case 's': /* Worker stack size in KB, 0 for the system default */
+      stack = atol(optarg) * 1024;
+      break;
+    case 'a': /* Measure the stack use of each request */
+      stack_audit = 1;
+      break;
+    case 'g': /* Keep text bodies gzipped in the cache */
+      gzip_bodies = 1;
+      break;
+    case 'k': /* New URIs in the doorkeeper's window, 0 for none */
+      door_window = atol(optarg);
+      break;
+    case 'f': /* Snapshot file to warm up from and save to */
+      snapshot_file = optarg;
+      break;
+    case 'i': /* Seconds between snapshots, 0 for only on SIGTERM */
+      snapshot_interval = atoi(optarg);
+      break;
+    case 'd': /* File for the disk tier */
+      disk_file = optarg;
+      break;
+    case 'z': /* Size of the disk tier in MB */
+      disk_mb = atol(optarg);
+      break;
+    case 'P': /* Worker processes sharing the cache, 0 for just this one */
+      nprocs = atoi(optarg);
+      break;
+    case 'H': /* Socket for handing over to a restarted proxy */
+      handoff_path = optarg;
+      break;
+    case 'p': /* Peers, host:port,host:port,..., this proxy included */
+      peers = optarg;
+      break;
+    case 'm': /* This proxy's name in the peer list */
+      self = optarg;
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if (optind != argc - 1 ||
+      ((nprocs > 0 || handoff_path) && (snapshot_file || disk_file)) ||
+      (nprocs > 0 && handoff_path) || !peers != !self) {
+    fprintf(stderr,
+            "usage: %s [-t ttl] [-w swr] [-n negttl] [-c cooldown] "
+            "[-l perip] [-s stack_kb] [-a] [-g] [-k window] [-f snapshot] "
+            "[-i secs] [-d diskfile] [-z disk_mb] [-P procs | -H socket] "
+            "[-p peers -m self] <port>\n"
+            "       -P and -H do not go with -f or -d\n",
+            argv[0]);
+    exit(1);
+  }
+
+  /* Peers that hang up early must not kill the proxy */
+  Signal(SIGPIPE, SIG_IGN);
+
+  /* With -H, take the socket and the cache over from an older proxy if
+     one is running; the port then goes unused */
+  if (handoff_path == NULL ||
+      restart_takeover(handoff_path, &listenfd, &cachefd) < 0) {
+    listenfd = Open_listenfd(argv[optind]);
+    i = DEFER_ACCEPT;
+    setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &i, sizeof(i));
+  }
+  if (handoff_path) {
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    cachefd = cache_share(cachefd);
+    if (pipe(wake) < 0)
+      unix_error("pipe error");
+  }
+
+  /* With -P, only the workers get past here, each with its own threads */
+  if (nprocs > 0) {
+    cache_share(-1);
+    prefork(nprocs);
+  }
+
+  /* SIGUSR1, and SIGTERM if there is a snapshot to save, are only ever
+     taken by the reporter thread */
+  Sigemptyset(&report_mask);
+  Sigaddset(&report_mask, SIGUSR1);
+  if (snapshot_file)
+    Sigaddset(&report_mask, SIGTERM);
+  Sigprocmask(SIG_BLOCK, &report_mask, NULL);
+  Pthread_create(&tid, NULL, reporter, NULL);
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  maxfds = rl.rlim_cur == RLIM_INFINITY ? 65536 : rl.rlim_cur;
+  accepted_at = Calloc(maxfds, sizeof(int64_t));
+  ipslot = Calloc(maxfds, sizeof(int));
+  fastrest = Calloc(maxfds, sizeof(fastrest_t *));
+
+  stats_init(); /* Before the cache, which counts its lookups */
+  cache_init();
+  if (nprocs > 0 || handoff_path)
+    cache_attach();
+  if (disk_file && disk_mb > 0) {
+    disk_init(disk_file, disk_mb << 20);
+    cache_on_evict(disk_demote);
+  }
+  if (snapshot_file) {
+    snapshot_init(snapshot_file);
+    if (snapshot_interval > 0)
+      Pthread_create(&tid, NULL, snapshotter, NULL);
+  }
+  if (peers)
+    peer_init(peers, self);
+  if (door_window > 0)
+    door_init(door_window);
+  bufpool_init();
+  timing_init();
+  deadline_init();
+  iplimit_init(iplimit);
+  sbuf_init(&sbuf, SBUFSIZE);
+
+  /* Small stacks for the threads that handle requests, guard included */
+  pthread_attr_init(&attr);
+  if (stack > 0) {
+    if (stack < PTHREAD_STACK_MIN)
+      stack = PTHREAD_STACK_MIN;
+    if ((c = pthread_attr_setstacksize(&attr, stack)) != 0)
+      posix_error(c, "pthread_attr_setstacksize error");
+  }
+  pthread_attr_setguardsize(&attr, sysconf(_SC_PAGESIZE));
+  for (i = 0; i < NTHREADS; i++)
+    if ((c = pthread_create(&tid, &attr, thread, NULL)) != 0)
+      break;
+  if (i == 0)
+    posix_error(c, "Pthread_create error");
+  if (i < NTHREADS)
+    fprintf(stderr, "Started %d of %d worker threads: %s\n", i, NTHREADS,
+            strerror(c));
+  origin_init(i); /* Before any request reaches a worker */
+  Sem_init(&refresh_mutex, 0, 1);
+  Sem_init(&refresh_items, 0, 0);
+  Pthread_create(&tid, &attr, refresher, NULL);
+  pthread_attr_destroy(&attr);
+  if (handoff_path)
+    restart_serve(handoff_path, listenfd, cachefd, stop_accepting);
+
+  while (!draining) {
+    clientlen = sizeof(clientaddr);
+    connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+    if (connfd < 0) {
+      if (errno == EAGAIN && handoff_path)
+        wait_accept(listenfd);
+      continue;
+    }
+    if (connfd >= maxfds) {
+      close(connfd);
+      continue;
+    }
+    if ((slot = iplimit_acquire(&clientaddr)) == -2) {
+      stats_inc(ST_IP_REJECTS);
+      close(connfd);
+      continue;
+    }
+    ipslot[connfd] = slot;
+    accepted_at[connfd] = now_ns();
+    stats_inc(ST_ACCEPTED);
+    if (fast_hit(connfd)) { /* Answered already */
+      Close(connfd);
+      iplimit_release(slot);
+      stats_inc(ST_CLOSED);
+      continue;
+    }
+    sbuf_insert(&sbuf, connfd);
+  }
+  drain();
+}
+
+void *thread(void *vargp) {
+  arena_t arena;
+
+  Pthread_detach(pthread_self());
+  arena_init(&arena, ARENA_SIZE);
+  if (stack_audit)
+    stack_paint();
+  while (1) {
+    int connfd = sbuf_remove(&sbuf);
+    int slot = ipslot[connfd]; /* Before the descriptor can be reused */
+    fastrest_t *fr = fastrest[connfd];
+
+    if (fr) {
+      fastrest[connfd] = NULL;
+      finish_fast(connfd, fr);
+      audit_stack(R_FAST);
+    } else
+      doit(connfd, &arena);
+    Close(connfd);
+    iplimit_release(slot);
+    stats_inc(ST_CLOSED);
+  }
+}
+
+/*
+ * refresher - revalidate stale objects in the background, one at a time
+ */
+void *refresher(void *vargp) {
+  refresh_t *job;
+  arena_t arena;
+
+  Pthread_detach(pthread_self());
+  arena_init(&arena, ARENA_SIZE);
+  if (stack_audit)
+    stack_paint();
+  while (1) {
+    P(&refresh_items);
+    P(&refresh_mutex);
+    job = refresh_head;
+    if ((refresh_head = job->next) == NULL)
+      refresh_tail = NULL;
+    refresh_len--;
+    V(&refresh_mutex);
+
+    job->req.arena = &arena;
+    forward(-1, &job->req, job->obj);
+    audit_stack(R_REFRESH);
+    arena_reset(&arena);
+    cache_end_refresh(job->obj);
+    cache_release(job->obj);
+    Free(job);
+  }
+}
+
+/*
+ * reporter - print the proxy's counters and the per-phase latency
+ *     quantiles, in microseconds, to stderr on every SIGUSR1. On SIGTERM,
+ *     save the cache to the snapshot file and exit.
+ */
+void *reporter(void *vargp) {
+  static hist_t phases[NPHASES];
+  long totals[NSTATS], reaped[NDL];
+  int i, sig;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    if (sigwait(&report_mask, &sig) != 0)
+      continue;
+    if (sig == SIGTERM) {
+      if ((i = snapshot_write(snapshot_file)) >= 0)
+        fprintf(stderr, "Saved %d objects to %s\n", i, snapshot_file);
+      exit(i < 0);
+    }
+    stats_sum(totals);
+    for (i = 0; i < NSTATS; i++)
+      fprintf(stderr, "%s %ld\n", stat_names[i], totals[i]);
+    fprintf(stderr, "origin_connects_avoided %ld\n",
+            totals[ST_NEGATIVE_HITS] + totals[ST_COOLDOWN_SKIPS]);
+    deadline_counts(reaped);
+    for (i = 0; i < NDL; i++)
+      fprintf(stderr, "reaped_%s %ld\n", deadline_names[i], reaped[i]);
+    for (i = 0; stack_audit && i < NROUTES; i++)
+      fprintf(stderr, "stack_%s %ld\n", route_names[i], stack_hw[i]);
+
+    memset(phases, 0, sizeof(phases));
+    timing_merge(phases);
+    fprintf(stderr, "%-9s %9s %9s %9s %9s %9s\n", "phase", "count", "p50",
+            "p99", "p999", "max");
+    for (i = 0; i < NPHASES; i++)
+      fprintf(stderr, "%-9s %9lu %9.1f %9.1f %9.1f %9.1f\n", phase_names[i],
+              phases[i].count, hist_quantile(&phases[i], 0.5) / 1e3,
+              hist_quantile(&phases[i], 0.99) / 1e3,
+              hist_quantile(&phases[i], 0.999) / 1e3, phases[i].max / 1e3);
+  }
+}
+
+/*
+ * snapshotter - save the cache to the snapshot file every
+ *     snapshot_interval seconds
+ */
+void *snapshotter(void *vargp) {
+  Pthread_detach(pthread_self());
+  while (1) {
+    sleep(snapshot_interval);
+    snapshot_write(snapshot_file);
+  }
+}
+
+/*
+ * prefork - fork n worker processes, and return in each of them. The
+ *     parent stays behind for good, replacing any worker that dies once
+ *     the shared cache entries it held are let go of.
+ */
+void prefork(int n) {
+  int i, status;
+  pid_t pid;
+
+  workers = Calloc(n, sizeof(pid_t));
+  nworkers = n;
+  Signal(SIGTERM, stop_workers);
+  Signal(SIGINT, stop_workers);
+  Signal(SIGUSR1, SIG_IGN); /* Meant for the workers */
+  for (i = 0; i < n; i++)
+    if ((workers[i] = fork_worker()) == 0)
+      return;
+
+  while (1) {
+    if ((pid = wait(&status)) < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("wait error");
+    }
+    n = cache_reap(pid);
+    if (WIFSIGNALED(status))
+      fprintf(stderr, "Worker %d killed by signal %d, held %d entries\n",
+              (int)pid, WTERMSIG(status), n);
+    else
+      fprintf(stderr, "Worker %d exited with %d, held %d entries\n",
+              (int)pid, WEXITSTATUS(status), n);
+    for (i = 0; i < nworkers; i++)
+      if (workers[i] == pid && (workers[i] = fork_worker()) == 0)
+        return;
+  }
+}
+
+/* fork_worker - fork a worker process, with the default signal actions */
+pid_t fork_worker(void) {
+  pid_t pid;
+
+  if ((pid = Fork()) == 0) {
+    Signal(SIGTERM, SIG_DFL);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGUSR1, SIG_DFL);
+  }
+  return pid;
+}
+
+/* stop_workers - stop every worker process, then the parent */
+void stop_workers(int sig) {
+  int i;
+
+  for (i = 0; i < nworkers; i++)
+    if (workers[i] > 0)
+      kill(workers[i], SIGTERM);
+  _exit(0);
+}
+
+/*
+ * stop_accepting - called once the listening socket has been handed
+ *     over: wake the main thread, which then accepts no more
+ */
+void stop_accepting(void) {
+  draining = 1;
+  if (write(wake[1], "", 1) < 0)
+    unix_error("stop_accepting: write error");
+}
+
+/*
+ * wait_accept - wait until the non-blocking listening socket has a
+ *     connection for us, or we are told to stop accepting
+ */
+int wait_accept(int listenfd) {
+  struct pollfd fds[2];
+
+  fds[0].fd = listenfd;
+  fds[0].events = POLLIN;
+  fds[1].fd = wake[0];
+  fds[1].events = POLLIN;
+  return poll(fds, 2, -1);
+}
+
+/*
+ * drain - wait for the connections this process accepted to finish, for
+ *     at most DRAIN_TIMEOUT seconds, then exit
+ */
+void drain(void) {
+  long totals[NSTATS];
+  int i;
+
+  for (i = 0; i < DRAIN_TIMEOUT * 10; i++) {
+    stats_sum(totals);
+    if (totals[ST_CLOSED] == totals[ST_ACCEPTED])
+      break;
+    usleep(100000);
+  }
+  fprintf(stderr, "Drained, %ld connections left unfinished\n",
+          totals[ST_ACCEPTED] - totals[ST_CLOSED]);
+  exit(0);
+}
+
+/*
+ * lookup - look key, of the given hash, up in the cache, failing that in
+ *     the snapshot the cache is still being warmed up from, and failing
+ *     that in the disk tier, which reads the object's record into the
+ *     request's arena a (or the heap, if it does not fit) and gives the
+ *     space back before it returns. A disk hit that is not promoted into
+ *     the cache comes back as a detached copy. Either way, the caller
+ *     must cache_release() the object, which frees a detached one.
+ */
+cache_obj_t *lookup(char *key, uint64_t hash, arena_t *a) {
+  cache_obj_t *obj = cache_lookup(key, hash);
+
+  if (obj == NULL && snapshot_file && snapshot_restore(key))
+    obj = cache_lookup(key, hash);
+  if (obj == NULL && disk_file && (obj = disk_lookup(key, hash, a)) != NULL)
+    stats_inc(ST_DISK_HITS);
+  return obj;
+}
+
+/*
+ * lookup_variant - given the primary entry of the request's URI, which
+ *     it releases, look up the variant that the request's headers select
+ *     and make its key the request's cache key. Returns the variant,
+ *     referenced, or NULL on a miss.
+ */
+cache_obj_t *lookup_variant(request_t *req, cache_obj_t *primary) {
+  char *vary = NULL;
+
+  if (primary->size <= VARY_MAX)
+    vary = arena_strndup(req->arena, primary->body, primary->size);
+  cache_release(primary);
+  if (vary == NULL || set_variant(req, vary) < 0)
+    return NULL;
+  return lookup(req->key, req->keyhash, req->arena);
+}
+
+/*
+ * set_variant - make the cache key of the request the key of the
+ *     variant of its URI that the Vary list vary and the request's
+ *     headers select, or the URI itself for an empty list. Returns 0 on
+ *     success, -1 if there is no room for the key, leaving it as it was.
+ */
+int set_variant(request_t *req, char *vary) {
+  char *key = req->uri;
+
+  if (vary[0]) {
+    if ((key = arena_alloc(req->arena, strlen(req->uri) + VARY_KEYLEN)) ==
+        NULL)
+      return -1;
+    vary_key(key, req->uri, vary_select(vary, req->hdrs));
+  }
+  req->vary = vary;
+  req->key = key;
+  req->keyhash = key == req->uri ? req->hash : uri_hash(key);
+  return 0;
+}
+
+/*
+ * schedule_refresh - queue a background refresh of the stale object obj,
+ *     unless one is already under way or the queue is full
+ */
+void schedule_refresh(request_t *req, cache_obj_t *obj) {
+  refresh_t *job;
+  size_t urilen, keylen, varylen, hdrslen, hostlen, portlen;
+  /* A variant is refreshed with the headers that selected it */
+  char *hdrs = req->vary[0] ? req->hdrs : "";
+
+  if (!cache_claim_refresh(obj))
+    return;
+
+  /* The job outlives the request's arena, so it takes its own copies */
+  urilen = strlen(req->uri) + 1;
+  keylen = strlen(req->key) + 1;
+  varylen = strlen(req->vary) + 1;
+  hdrslen = strlen(hdrs) + 1;
+  hostlen = strlen(req->host) + 1;
+  portlen = strlen(req->port) + 1;
+  job = Malloc(sizeof(refresh_t) + urilen + keylen + varylen + hdrslen +
+               hostlen + portlen + strlen(req->path) + 1);
+  job->req.uri = strcpy(job->strs, req->uri);
+  job->req.key = strcpy(job->req.uri + urilen, req->key);
+  job->req.vary = strcpy(job->req.key + keylen, req->vary);
+  job->req.hdrs = strcpy(job->req.vary + varylen, hdrs);
+  job->req.host = strcpy(job->req.hdrs + hdrslen, req->host);
+  job->req.port = strcpy(job->req.host + hostlen, req->port);
+  job->req.path = strcpy(job->req.port + portlen, req->path);
+  job->req.hash = req->hash;
+  job->req.keyhash = req->keyhash;
+  /* For a segmented object, one byte is enough to learn the new length */
+  job->req.range = CACHE_SEGMENTED(obj) ? "bytes=0-0" : "";
+  job->req.cond = "";
+  job->req.peer = -1; /* Our own copy, so ours to revalidate */
+  memset(job->req.stamps, 0, sizeof(stamps_t));
+  memset(&job->req.origin_dl, 0, sizeof(deadline_t));
+  job->req.queued = 0;
+  job->obj = obj;
+  job->next = NULL;
+
+  P(&refresh_mutex);
+  if (refresh_len == REFRESH_QLEN) {
+    V(&refresh_mutex);
+    cache_end_refresh(obj);
+    Free(job);
+    return;
+  }
+  cache_hold(obj);
+  if (refresh_tail)
+    refresh_tail->next = job;
+  else
+    refresh_head = job;
+  refresh_tail = job;
+  refresh_len++;
+  V(&refresh_mutex);
+  V(&refresh_items);
+}
+
+/*
+ * doit - handle one HTTP request/response transaction, and account for
+ *     the time spent in each of its phases. Everything the request
+ *     allocates comes from arena, which is emptied at the end.
+ */
+void doit(int fd, arena_t *arena) {
+  request_t req;
+
+  req.arena = arena;
+  req.route = R_ERROR;
+  memset(req.stamps, 0, sizeof(stamps_t));
+  req.stamps[T_ACCEPT] = accepted_at[fd];
+  req.queued = now_ns() - req.stamps[T_ACCEPT];
+  memset(&req.client_dl, 0, sizeof(deadline_t));
+  memset(&req.origin_dl, 0, sizeof(deadline_t));
+  deadline_arm(&req.client_dl, fd, DL_HEADER, HEADER_TIMEOUT);
+  deadline_set_rate(&req.client_dl, HEADER_MIN_RATE);
+  client_dl = &req.client_dl;
+  brio_readinitb(&req.client_rio, fd);
+  handle(fd, &req);
+  brio_release(&req.client_rio);
+  deadline_cancel(&req.client_dl);
+  client_dl = NULL;
+  req.stamps[T_DONE] = now_ns();
+  timing_record(req.stamps);
+  audit_stack(req.route);
+  arena_reset(arena);
+}
+
+/*
+ * audit_stack - with -a, take the calling thread's stack high-water
+ *     mark since the last call into the mark for route
+ */
+void audit_stack(int route) {
+  long used, hw;
+
+  if (!stack_audit)
+    return;
+  used = stack_used();
+  while (used > (hw = stack_hw[route]))
+    if (__sync_bool_compare_and_swap(&stack_hw[route], hw, used))
+      break;
+}
+
+/*
+ * fast_hit - answer the request on a just-accepted connection from the
+ *     main thread, if it is all there already, it is a GET without Range
+ *     or conditional headers, and it hits a fresh, whole object, or
+ *     variant of one, of at most FAST_MAX_SIZE bytes. Never blocks.
+ *     Returns 1 if fd was answered in full, 0 if it must go to a worker:
+ *     as a new request, or with the rest of the response in fastrest[fd].
+ */
+int fast_hit(int fd) {
+  /* Only the main thread gets here, so these need not be on its stack */
+  static char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  static char key[MAXLINE + 1], vkey[MAXLINE + VARY_KEYLEN];
+  static char hdrs[MAXLINE];
+  char vary[VARY_MAX + 1], hdr[HDR_SIZE], *end, *line;
+  int enc = ENC_NONE;
+  struct iovec iov[2];
+  struct msghdr msg;
+  cache_obj_t *obj;
+  fastrest_t *fr;
+  stamps_t stamps;
+  ssize_t n, sent;
+  int hdrlen, size;
+  socklen_t len;
+
+  if ((n = recv(fd, buf, sizeof(buf) - 1, MSG_PEEK | MSG_DONTWAIT)) <= 0)
+    return 0;
+  buf[n] = '\0';
+  if ((end = strstr(buf, "\r\n\r\n")) == NULL ||
+      sscanf(buf, "%s %s %s", method, uri, version) != 3 ||
+      strcasecmp(method, "GET") || strncasecmp(uri, "http://", 7))
+    return 0;
+  for (line = strstr(buf, "\r\n") + 2; line <= end;
+       line = strstr(line, "\r\n") + 2)
+    if (!strncasecmp(line, "Range:", 6) || !strncasecmp(line, "If-", 3))
+      return 0;
+  if (uri_normalize(key, uri) < 0 ||
+      (obj = cache_lookup(key, uri_hash(key))) == NULL)
+    return 0;
+  forwarded_hdrs(hdrs, strstr(buf, "\r\n") + 2);
+  vary[0] = '\0';
+  if (CACHE_VARIED(obj)) {
+    if (obj->size > VARY_MAX) {
+      cache_release(obj);
+      return 0;
+    }
+    memcpy(vary, obj->body, obj->size);
+    vary[obj->size] = '\0';
+    cache_release(obj);
+    vary_key(vkey, key, vary_select(vary, hdrs));
+    if ((obj = cache_lookup(vkey, uri_hash(vkey))) == NULL)
+      return 0;
+  }
+  if (obj->meta.plain) {
+    if (!gzip_accepted(hdrs)) {
+      cache_release(obj); /* Inflating it is for a worker */
+      return 0;
+    }
+    enc = ENC_GZIP;
+  }
+  if (!CACHE_FRESH(obj, time(NULL)) || CACHE_SEGMENTED(obj) ||
+      obj->size > FAST_MAX_SIZE ||
+      recv(fd, buf, end + 4 - buf, MSG_DONTWAIT) != end + 4 - buf) {
+    cache_release(obj);
+    return 0;
+  }
+  memset(stamps, 0, sizeof(stamps_t));
+  stamps[T_ACCEPT] = accepted_at[fd];
+  stamps[T_PARSED] = now_ns();
+  stats_inc(ST_REQUESTS);
+  stats_inc(ST_HITS);
+  stats_inc(ST_FAST_HITS);
+  if (obj->meta.status != 200)
+    stats_inc(ST_NEGATIVE_HITS);
+  if (enc == ENC_GZIP)
+    stats_inc(ST_GZIP_HITS);
+  if (vary[0])
+    stats_inc(ST_VARIANT_HITS);
+
+  /* Make room for all of it, so that the write rarely falls short */
+  hdrlen = format_hdrs(hdr, obj->meta.status, obj->meta.type, 0,
+                       (long)obj->size - 1, obj->size, enc, vary);
+  len = sizeof(size);
+  if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == 0 &&
+      size < hdrlen + (int)obj->size) {
+    size = hdrlen + obj->size;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  }
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = hdrlen;
+  iov[1].iov_base = obj->body;
+  iov[1].iov_len = obj->size;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = obj->size ? 2 : 1;
+  if ((sent = sendmsg(fd, &msg, MSG_DONTWAIT)) < 0 && errno == EAGAIN)
+    sent = 0;
+  if (sent >= 0 && sent < hdrlen + (ssize_t)obj->size) {
+    fr = Malloc(sizeof(fastrest_t));
+    fr->obj = obj;
+    memcpy(fr->hdr, hdr, hdrlen);
+    fr->hdrlen = hdrlen;
+    fr->sent = sent;
+    memcpy(fr->stamps, stamps, sizeof(stamps_t));
+    fastrest[fd] = fr;
+    return 0;
+  }
+  cache_release(obj);
+  stamps[T_DONE] = now_ns();
+  timing_record(stamps);
+  return 1;
+}
+
+/*
+ * forwarded_hdrs - copy to buf the lines of the raw request header hdrs,
+ *     which ends at a blank line, that a worker would forward and so
+ *     select a variant with: those request_hdr() calls HDR_FORWARD. buf
+ *     needs as much room as hdrs.
+ */
+void forwarded_hdrs(char *buf, char *hdrs) {
+  char *line, *eol;
+  size_t len;
+
+  for (line = hdrs; *line && *line != '\r' && *line != '\n'; line = eol) {
+    eol = line + strcspn(line, "\n");
+    eol += *eol == '\n';
+    len = eol - line;
+    if (request_hdr(line) == HDR_FORWARD) {
+      memcpy(buf, line, len);
+      buf += len;
+    }
+  }
+  *buf = '\0';
+}
+
+/*
+ * finish_fast - write the rest of a response that fast_hit() started,
+ *     under the usual client deadline
+ */
+void finish_fast(int fd, fastrest_t *fr) {
+  deadline_t dl;
+  size_t off;
+
+  memset(&dl, 0, sizeof(deadline_t));
+  deadline_arm(&dl, fd, DL_CLIENT_WRITE, CLIENT_TIMEOUT);
+  deadline_set_rate(&dl, CLIENT_MIN_RATE);
+  client_dl = &dl;
+  if (fr->sent < fr->hdrlen &&
+      client_writen(fd, fr->hdr + fr->sent, fr->hdrlen - fr->sent) !=
+          (ssize_t)(fr->hdrlen - fr->sent))
+    goto done;
+  off = fr->sent > fr->hdrlen ? fr->sent - fr->hdrlen : 0;
+  if (off < fr->obj->size)
+    client_writen(fd, fr->obj->body + off, fr->obj->size - off);
+done:
+  deadline_cancel(&dl);
+  client_dl = NULL;
+  fr->stamps[T_DONE] = now_ns();
+  timing_record(fr->stamps);
+  cache_release(fr->obj);
+  Free(fr);
+}
+
+/*
+ * handle - parse a request and answer it from the cache or the origin
+ */
+void handle(int fd, request_t *req) {
+  char *line, *method, *version, *save;
+  cache_obj_t *obj;
+  time_t now;
+  brio_t *rio = &req->client_rio;
+  ssize_t n;
+  int rc;
+
+  /* Read request line and headers */
+  if ((line = arena_top(req->arena, MAXLINE)) == NULL ||
+      (n = brio_readlineb(rio, line, MAXLINE)) <= 0)
+    return;
+  arena_extend(req->arena, n + 1);
+  deadline_progress(client_dl, n);
+  method = strtok_r(line, " \t\r\n", &save);
+  req->uri = strtok_r(NULL, " \t\r\n", &save);
+  version = strtok_r(NULL, " \t\r\n", &save);
+  if (version == NULL) {
+    clienterror(fd, line, "400", "Bad Request",
+                "Proxy could not parse the request line");
+    return;
+  }
+  if (strcasecmp(method, "GET")) {
+    clienterror(fd, method, "501", "Not Implemented",
+                "Proxy does not implement this method");
+    return;
+  }
+  if (!strcmp(req->uri, STATS_PATH)) { /* Addressed to the proxy itself */
+    req->route = R_STATS;
+    if (read_requesthdrs(rio, req) == 0)
+      serve_stats(fd);
+    return;
+  }
+  if (req->uri[0] != '/' && strncasecmp(req->uri, "http://", 7)) {
+    clienterror(fd, req->uri, "400", "Bad Request",
+                "Proxy only handles http:// URIs");
+    return;
+  }
+  if ((rc = read_requesthdrs(rio, req)) == -2)
+    return; /* Hung up or reaped halfway through */
+  if (rc < 0) {
+    stats_inc(ST_HEADER_REJECTS);
+    clienterror(fd, req->uri, "431", "Request Header Fields Too Large",
+                "Request headers are too long");
+    return;
+  }
+  if (make_key(req) < 0) {
+    clienterror(fd, req->uri, "400", "Bad Request",
+                "Proxy only handles http:// URIs, absolute or with a Host");
+    return;
+  }
+  req->peer = req->from_peer ? -1 : peer_owner(req->hash);
+  STAMP(req->stamps, T_PARSED);
+  stats_inc(ST_REQUESTS);
+  deadline_arm(&req->client_dl, fd, DL_CLIENT_WRITE, CLIENT_TIMEOUT);
+  deadline_set_rate(&req->client_dl, CLIENT_MIN_RATE);
+  deadline_pause(&req->client_dl); /* Runs only while we write */
+
+  if ((obj = lookup(req->uri, req->hash, req->arena)) && CACHE_VARIED(obj))
+    obj = lookup_variant(req, obj);
+  now = time(NULL);
+  if (obj && !CACHE_FRESH(obj, now) && CACHE_USABLE(obj, now))
+    schedule_refresh(req, obj); /* Serve the stale copy meanwhile */
+  if (obj && CACHE_USABLE(obj, now)) {
+    stats_inc(ST_HITS);
+    if (!CACHE_FRESH(obj, now))
+      stats_inc(ST_STALE_HITS);
+    if (obj->meta.status != 200)
+      stats_inc(ST_NEGATIVE_HITS);
+    if (req->vary[0])
+      stats_inc(ST_VARIANT_HITS);
+    req->route = CACHE_SEGMENTED(obj) ? R_SEGMENTS : R_HIT;
+    if (CACHE_SEGMENTED(obj))
+      serve_segments(fd, req, obj);
+    else
+      serve_cached(fd, req, obj);
+  } else {
+    stats_inc(ST_MISSES);
+    req->route = R_MISS;
+    forward(fd, req, obj); /* A miss, or a stale copy to revalidate */
+  }
+  if (obj)
+    cache_release(obj);
+}
+
+/*
+ * make_key - replace the request's URI with its canonical form, the
+ *     cache key (see uri.c) unless a Vary list says otherwise, and hash
+ *     it, once for everything that looks the key up. A URI that is only
+ *     a path is taken to be on the host named by the Host header. Also
+ *     fills in the origin host, port and path. Returns 0 on success, -1
+ *     if the URI has no such form.
+ */
+int make_key(request_t *req) {
+  char *raw = req->uri, *key;
+  size_t hostlen = strlen(req->hosthdr);
+
+  if (raw[0] == '/') {
+    if (hostlen == 0 || strcspn(req->hosthdr, "/?# \t") != hostlen ||
+        (raw = arena_alloc(req->arena, hostlen + strlen(req->uri) + 8)) ==
+            NULL)
+      return -1;
+    sprintf(raw, "http://%s%s", req->hosthdr, req->uri);
+  }
+  if ((key = arena_alloc(req->arena, strlen(raw) + 2)) == NULL ||
+      uri_normalize(key, raw) < 0 ||
+      parse_uri(req->arena, key, &req->host, &req->port, &req->path) < 0)
+    return -1;
+  req->uri = req->key = key;
+  req->hash = req->keyhash = uri_hash(key);
+  req->vary = "";
+  return 0;
+}
+
+/*
+ * parse_uri - split an absolute http:// URI into host, port and path.
+ *     The path points into uri, and the host and port into a copy made
+ *     in a. Returns 0 on success, -1 if the URI is not of that form.
+ */
+int parse_uri(arena_t *a, char *uri, char **host, char **port,
+              char **path) {
+  char *hostp, *portp, *pathp;
+  size_t len;
+
+  if (strncasecmp(uri, "http://", 7))
+    return -1;
+  hostp = uri + 7;
+  pathp = strchr(hostp, '/');
+  len = pathp ? (size_t)(pathp - hostp) : strlen(hostp);
+  if (len == 0 || (*host = arena_strndup(a, hostp, len)) == NULL)
+    return -1;
+  *path = pathp ? pathp : "/";
+
+  if ((portp = strchr(*host, ':')) != NULL) {
+    *portp = '\0';
+    *port = portp + 1;
+  } else
+    *port = "80";
+  return 0;
+}
+
+/*
+ * request_hdr - classify a client header line: HDR_DROP for those the
+ *     proxy rewrites, HDR_HOST, which it rewrites too but may need for a
+ *     relative URI, HDR_RANGE, HDR_COND for the conditional headers,
+ *     HDR_PEER for the mark of a request from a peer, or HDR_FORWARD
+ */
+int request_hdr(char *line) {
+  if (!strncasecmp(line, "Host:", 5))
+    return HDR_HOST;
+  if (!strncasecmp(line, "User-Agent:", 11) ||
+      !strncasecmp(line, "Connection:", 11) ||
+      !strncasecmp(line, "Proxy-Connection:", 17))
+    return HDR_DROP;
+  if (!strncasecmp(line, "Range:", 6))
+    return HDR_RANGE;
+  if (!strncasecmp(line, "If-None-Match:", 14) ||
+      !strncasecmp(line, "If-Modified-Since:", 18))
+    return HDR_COND;
+  if (!strncasecmp(line, "X-Proxy-Peer:", 13))
+    return HDR_PEER;
+  return HDR_FORWARD;
+}
+
+/*
+ * read_requesthdrs - read the client's request headers into the
+ *     request's arena. Headers the proxy rewrites are dropped; Range
+ *     and the conditional headers are kept aside. Returns 0 on success,
+ *     -1 if they do not fit, -2 if the client stopped sending before
+ *     the blank line that ends them.
+ */
+int read_requesthdrs(brio_t *rp, request_t *req) {
+  arena_t *a = req->arena;
+  char *line, *first, *p, *next;
+  size_t len, used = 0, condlen = 0, total = 0;
+  ssize_t n;
+  int i, lines = 0, kept = 0;
+
+  /* Keep the lines side by side, each with its NUL, then sort them */
+  req->range = "";
+  req->hosthdr = "";
+  req->from_peer = 0;
+  first = arena_top(a, 0);
+  while ((line = arena_top(a, MAXLINE)) != NULL &&
+         (n = brio_readlineb(rp, line, MAXLINE)) > 0) {
+    deadline_progress(client_dl, n);
+    if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+      break;
+    if (++lines > MAX_HDR_LINES || (total += n) > MAX_HDR_BYTES)
+      return -1;
+    len = strlen(line);
+    switch (request_hdr(line)) {
+    case HDR_DROP:
+      continue;
+    case HDR_PEER:
+      req->from_peer = 1;
+      continue;
+    case HDR_COND:
+      condlen += len;
+      break;
+    case HDR_FORWARD:
+      used += len;
+    }
+    arena_extend(a, len + 1);
+    kept++;
+  }
+  if (line == NULL)
+    return -1;
+  if (n <= 0)
+    return -2;
+  if (condlen >= MAXLINE || (req->cond = arena_alloc(a, condlen + 1)) == NULL ||
+      (req->hdrs = arena_alloc(a, used + 1)) == NULL)
+    return -1;
+
+  used = condlen = 0;
+  for (i = 0, p = first; i < kept; i++, p = next) {
+    next = p + strlen(p) + 1;
+    switch (request_hdr(p)) {
+    case HDR_HOST:
+      for (p += 5; *p == ' ' || *p == '\t'; p++)
+        ;
+      p[strcspn(p, " \t\r\n")] = '\0';
+      req->hosthdr = p;
+      break;
+    case HDR_RANGE:
+      for (p += 6; *p == ' ' || *p == '\t'; p++)
+        ;
+      p[strcspn(p, "\r\n")] = '\0';
+      req->range = p;
+      break;
+    case HDR_COND:
+      memcpy(req->cond + condlen, p, next - 1 - p);
+      condlen += next - 1 - p;
+      break;
+    default:
+      memcpy(req->hdrs + used, p, next - 1 - p);
+      used += next - 1 - p;
+    }
+  }
+  req->cond[condlen] = '\0';
+  req->hdrs[used] = '\0';
+  return 0;
+}
+
+/*
+ * read_responsehdrs - read the origin's status line and headers into
+ *     a. Returns 0 on success, -1 on a malformed or oversized header.
+ */
+int read_responsehdrs(brio_t *rp, response_t *resp, arena_t *a) {
+  char *line, *p, *end, *eol;
+  ssize_t n;
+
+  resp->status = 0;
+  resp->length = -1;
+  resp->total = -1;
+  resp->accept_ranges = 0;
+  resp->type = "application/octet-stream";
+  resp->etag = "";
+  resp->lastmod = "";
+  resp->max_age = -1;
+  resp->swr = -1;
+  resp->no_store = 0;
+  resp->encoded = 0;
+  resp->gzipped = 0;
+  resp->vary = "";
+  resp->hdrlen = 0;
+
+  /* Read the lines end to end, as they are relayed to the client */
+  resp->hdrs = arena_top(a, 0);
+  do {
+    if ((line = arena_top(a, MAXLINE)) == NULL ||
+        (n = brio_readlineb(rp, line, MAXLINE)) <= 0 ||
+        resp->hdrlen + n >= MAXBUF)
+      return -1;
+    arena_extend(a, n);
+    resp->hdrlen += n;
+  } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+  arena_extend(a, 1);
+  if (sscanf(resp->hdrs, "HTTP/%*d.%*d %d", &resp->status) != 1)
+    return -1;
+
+  /* Pick out the headers we care about, each from a copy of its line */
+  end = resp->hdrs + resp->hdrlen;
+  for (p = resp->hdrs; p < end; p = eol + 1) {
+    eol = memchr(p, '\n', end - p);
+    if (strncasecmp(p, "Content-", 8) && strncasecmp(p, "Accept-Ranges:", 14) &&
+        strncasecmp(p, "Cache-Control:", 14) &&
+        strncasecmp(p, "Transfer-Encoding:", 18) &&
+        strncasecmp(p, "ETag:", 5) && strncasecmp(p, "Last-Modified:", 14) &&
+        strncasecmp(p, "Vary:", 5))
+      continue;
+    if ((line = arena_strndup(a, p, eol - p)) == NULL)
+      return -1;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!strncasecmp(line, "Content-Length:", 15))
+      resp->length = atol(line + 15);
+    else if (!strncasecmp(line, "Content-Type:", 13)) {
+      for (resp->type = line + 13; *resp->type == ' '; resp->type++)
+        ;
+    } else if (!strncasecmp(line, "Content-Range:", 14)) {
+      if (sscanf(line + 14, " bytes %ld-%ld/%ld", &resp->first, &resp->last,
+                 &resp->total) != 3)
+        resp->total = -1;
+    } else if (!strncasecmp(line, "Accept-Ranges:", 14))
+      resp->accept_ranges = strstr(line + 14, "bytes") != NULL;
+    else if (!strncasecmp(line, "Cache-Control:", 14))
+      parse_cache_control(line + 14, resp);
+    else if (!strncasecmp(line, "Content-Encoding:", 17)) {
+      line += 17 + strspn(line + 17, " \t");
+      line[strcspn(line, " \t")] = '\0';
+      resp->encoded = strcasecmp(line, "identity") != 0;
+      resp->gzipped = !strcasecmp(line, "gzip") || !strcasecmp(line, "x-gzip");
+    }
+    else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+      resp->no_store = 1; /* The body is framed; relay it, never cache it */
+    else if (!strncasecmp(line, "ETag:", 5)) {
+      for (resp->etag = line + 5; *resp->etag == ' '; resp->etag++)
+        ;
+    } else if (!strncasecmp(line, "Last-Modified:", 14)) {
+      for (resp->lastmod = line + 14; *resp->lastmod == ' '; resp->lastmod++)
+        ;
+    } else if (!strncasecmp(line, "Vary:", 5)) {
+      if (!resp->vary[0]) {
+        if ((resp->vary = arena_alloc(a, VARY_MAX + 1)) == NULL)
+          return -1;
+        resp->vary[0] = '\0';
+      }
+      if (vary_list(resp->vary, line + 5) < 0)
+        resp->no_store = 1; /* Varies on "*", or on too much to key on */
+    }
+  }
+  return 0;
+}
+
+/*
+ * parse_cache_control - pick out the Cache-Control directives that
+ *     matter to a shared cache. s-maxage wins over max-age.
+ */
+void parse_cache_control(char *value, response_t *resp) {
+  char *p, *save;
+  int s_maxage = 0;
+
+  for (p = strtok_r(value, ", ", &save); p; p = strtok_r(NULL, ", ", &save)) {
+    if (!strncasecmp(p, "s-maxage=", 9)) {
+      resp->max_age = atol(p + 9);
+      s_maxage = 1;
+    } else if (!strncasecmp(p, "max-age=", 8) && !s_maxage)
+      resp->max_age = atol(p + 8);
+    else if (!strncasecmp(p, "stale-while-revalidate=", 23))
+      resp->swr = atol(p + 23);
+    else if (!strcasecmp(p, "no-cache")) { /* Store, but always revalidate */
+      resp->max_age = 0;
+      s_maxage = 1;
+    }
+    else if (!strcasecmp(p, "no-store") || !strcasecmp(p, "private"))
+      resp->no_store = 1;
+  }
+}
+
+/*
+ * response_meta - describe a cacheable response for cache_insert().
+ *     Errors get the short negative lifetime and are never served stale.
+ */
+void response_meta(response_t *resp, objmeta_t *meta) {
+  int negative = resp->status >= 400;
+
+  meta->status = negative ? resp->status : 200;
+  meta->type = resp->type;
+  meta->etag = resp->etag;
+  meta->lastmod = resp->lastmod;
+  meta->expires = time(NULL) + (resp->max_age >= 0 ? resp->max_age
+                                : negative         ? neg_ttl
+                                                   : default_ttl);
+  meta->swr = negative ? 0 : resp->swr >= 0 ? resp->swr : default_swr;
+  meta->plain = 0;
+}
+
+/*
+ * negative_cacheable - return 1 for error statuses that say something
+ *     about the resource or the origin, rather than about this client
+ *     or this particular request
+ */
+int negative_cacheable(int status) {
+  if (status >= 500)
+    return status < 600;
+  return status >= 400 && status != 401 && status != 407 && status != 408 &&
+         status != 416 && status != 429;
+}
+
+char *reason_phrase(int status) {
+  switch (status) {
+  case 200: return "OK";
+  case 206: return "Partial Content";
+  case 400: return "Bad Request";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 410: return "Gone";
+  case 416: return "Range Not Satisfiable";
+  case 500: return "Internal Server Error";
+  case 501: return "Not Implemented";
+  case 502: return "Bad Gateway";
+  case 503: return "Service Unavailable";
+  case 504: return "Gateway Timeout";
+  default:  return status >= 500 ? "Server Error" : "Client Error";
+  }
+}
+
+/*
+ * resolve_range - resolve a single "bytes=" range against an object of
+ *     total bytes. Returns 1 with *first and *last set, 0 if the whole
+ *     object should be sent (no Range, several ranges, or a header we do
+ *     not understand), and -1 if the range is not satisfiable.
+ */
+int resolve_range(char *range, long total, long *first, long *last) {
+  char *p, *end;
+
+  if (strncasecmp(range, "bytes=", 6) || strchr(range, ','))
+    return 0;
+  p = range + 6;
+  while (*p == ' ')
+    p++;
+  if (*p == '-') { /* Last N bytes */
+    *first = strtol(p + 1, &end, 10);
+    if (end == p + 1 || *first < 0)
+      return 0;
+    if (*first == 0 || total == 0)
+      return -1;
+    *first = total > *first ? total - *first : 0;
+    *last = total - 1;
+    return 1;
+  }
+  *first = strtol(p, &end, 10);
+  if (end == p || *end != '-' || *first < 0)
+    return 0;
+  p = end + 1;
+  if (*p >= '0' && *p <= '9') {
+    *last = strtol(p, &end, 10);
+    if (*last < *first)
+      return 0;
+    if (*last > total - 1)
+      *last = total - 1;
+  } else
+    *last = total - 1;
+  return *first < total ? 1 : -1;
+}
+
+/*
+ * connect_origin - open_clientfd() for host and port, the origin of req
+ *     or a peer, stamping when the name is resolved and when the
+ *     connection is up. Returns the descriptor, -2 if the name did not
+ *     resolve, or -1 on other errors.
+ */
+int connect_origin(request_t *req, char *host, char *port) {
+  struct addrinfo hints, *listp, *p;
+  int clientfd = -1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if (getaddrinfo(host, port, &hints, &listp) != 0)
+    return -2;
+  STAMP(req->stamps, T_RESOLVED);
+
+  for (p = listp; p; p = p->ai_next) {
+    if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    deadline_arm(&req->origin_dl, clientfd, DL_CONNECT, CONNECT_TIMEOUT);
+    if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
+      break;
+    deadline_cancel(&req->origin_dl);
+    close(clientfd);
+  }
+  freeaddrinfo(listp);
+  if (!p)
+    return -1;
+  deadline_arm(&req->origin_dl, clientfd, DL_ORIGIN_IDLE, ORIGIN_TIMEOUT);
+  STAMP(req->stamps, T_CONNECTED);
+  return clientfd;
+}
+
+/*
+ * open_peer - connect to the peer that owns req's URI, unless it is
+ *     marked down like an origin would be. Returns the descriptor, or -1
+ *     if the request should go to the origin instead.
+ */
+int open_peer(request_t *req) {
+  peer_t *p = peer_get(req->peer);
+  time_t now = time(NULL);
+  int peerfd;
+
+  if (origin_is_down(p->host, p->port, now))
+    return -1;
+  if ((peerfd = connect_origin(req, p->host, p->port)) < 0) {
+    origin_failed(p->host, p->port, now + cooldown);
+    stats_inc(ST_PEER_FAILURES);
+    return -1;
+  }
+  origin_succeeded(p->host, p->port);
+  stats_inc(ST_PEER_FETCHES);
+  return peerfd;
+}
+
+/*
+ * open_origin - connect to the origin, or to the peer that owns the
+ *     URI, and send it the request, with a Range header if range is not
+ *     empty and the conditional header lines in cond. Returns the
+ *     connected descriptor, -1 on failure, or -2 if the request was shed
+ *     because the origin, or the proxy as a whole, is at its concurrency
+ *     limit (see origin.c). With force set it is never shed, only
+ *     counted against the limits. Origins that recently failed to
+ *     connect fail again at once. A peer is not subject to the limits.
+ */
+int open_origin(request_t *req, char *range, char *cond, int force) {
+  char *buf;
+  int originfd, n;
+  time_t now = time(NULL);
+  size_t mark = arena_save(req->arena);
+
+  req->origin_start = now_ns();
+  req->origin_ttfb = 0;
+  req->via_peer = 0;
+  if (req->peer >= 0 && (originfd = open_peer(req)) >= 0) {
+    req->via_peer = 1;
+    goto connected;
+  }
+  if (origin_is_down(req->host, req->port, now)) {
+    stats_inc(ST_COOLDOWN_SKIPS);
+    return -1;
+  }
+  if (origin_admit(req->host, req->port, req->queued, req->origin_start,
+                   force) < 0)
+    return -2;
+  if ((originfd = connect_origin(req, req->host, req->port)) < 0) {
+    origin_release(req->host, req->port, 0);
+    origin_failed(req->host, req->port, now + cooldown);
+    return -1;
+  }
+  origin_succeeded(req->host, req->port);
+  stats_inc(ST_ORIGIN_CONNECTS);
+connected:
+  brio_readinitb(&req->origin_rio, originfd);
+
+  /* Room for the lines below, with their fixed parts in the constant */
+  buf = arena_alloc(req->arena, strlen(req->uri) + strlen(req->host) +
+                                     strlen(req->port) + strlen(range) +
+                                     strlen(cond) + strlen(req->hdrs) +
+                                     strlen(user_agent_hdr) + MAXLINE);
+  if (buf == NULL) {
+    close_origin(req, originfd);
+    return -1;
+  }
+  /* A peer is a proxy, so it gets the absolute URI */
+  n = sprintf(buf, "GET %s HTTP/1.0\r\n",
+              req->via_peer ? req->uri : req->path);
+  if (!strcmp(req->port, "80"))
+    n += sprintf(buf + n, "Host: %s\r\n", req->host);
+  else
+    n += sprintf(buf + n, "Host: %s:%s\r\n", req->host, req->port);
+  n += sprintf(buf + n, "%s", user_agent_hdr);
+  n += sprintf(buf + n, "Connection: close\r\n");
+  n += sprintf(buf + n, "Proxy-Connection: close\r\n");
+  if (req->via_peer)
+    n += sprintf(buf + n, "X-Proxy-Peer: %s\r\n", peer_self());
+  if (range[0])
+    n += sprintf(buf + n, "Range: %s\r\n", range);
+  n += sprintf(buf + n, "%s", cond);
+  n += sprintf(buf + n, "%s\r\n", req->hdrs);
+
+  if (rio_writen(originfd, buf, n) != n) {
+    close_origin(req, originfd);
+    return -1;
+  }
+  arena_restore(req->arena, mark); /* Sent; only the response is kept */
+  STAMP(req->stamps, T_SENT);
+  return originfd;
+}
+
+/*
+ * close_origin - close an origin connection opened by open_origin(),
+ *     cancelling its deadline first, and give back its place under the
+ *     concurrency limits
+ */
+void close_origin(request_t *req, int originfd) {
+  deadline_cancel(&req->origin_dl);
+  brio_release(&req->origin_rio);
+  Close(originfd);
+  if (!req->via_peer)
+    origin_release(req->host, req->port, req->origin_ttfb);
+}
+
+/*
+ * forward - relay a request that missed the cache to the origin and
+ *     its response back to the client, caching what we can of it. If
+ *     stale is not NULL the request revalidates that cached copy, and
+ *     a 304 from the origin is answered from it. With fd < 0 there is
+ *     no client, and only the cache is updated.
+ */
+void forward(int fd, request_t *req, cache_obj_t *stale) {
+  int originfd, rc, whole = 0, segmented = 0, client_ok = fd >= 0;
+  char *buf, *objbuf = NULL, *cond = req->cond;
+  long pos = 0, total = 0, got = 0;
+  ssize_t n, want;
+  response_t resp;
+  objmeta_t meta;
+  segfill_t *sf = NULL;
+
+  /* Off the stack, so that workers can run on small ones */
+  if ((buf = arena_alloc(req->arena, MAXBUF)) == NULL) {
+    if (fd >= 0)
+      clienterror(fd, req->host, "500", "Internal Server Error",
+                  "Proxy has no room left for this request");
+    return;
+  }
+
+  /* Revalidate with our own validators instead of the client's */
+  if (stale && (cond = arena_alloc(req->arena, MAXLINE)) != NULL) {
+    n = 0;
+    if (stale->meta.etag[0])
+      n += sprintf(cond + n, "If-None-Match: %.*s\r\n", MAXLINE / 2 - 32,
+                   stale->meta.etag);
+    if (stale->meta.lastmod[0])
+      n += sprintf(cond + n, "If-Modified-Since: %.*s\r\n", MAXLINE / 2 - 32,
+                   stale->meta.lastmod);
+    cond[n] = '\0';
+  } else if (stale)
+    cond = "";
+
+again:
+  if ((originfd = open_origin(req, req->range, cond, 0)) == -2) {
+    if (fd < 0) /* A background refresh; try again on a later hit */
+      return;
+    if (stale) { /* Never shed what the cache can still answer */
+      stats_inc(ST_SHED_STALE);
+      if (CACHE_SEGMENTED(stale))
+        serve_segments(fd, req, stale);
+      else
+        serve_cached(fd, req, stale);
+      return;
+    }
+    stats_inc(ST_SHED);
+    clienterror(fd, req->host, "503", "Service Unavailable",
+                "Proxy is at its limit for this origin server");
+    return;
+  }
+  if (originfd < 0) {
+    if (fd >= 0)
+      clienterror(fd, req->host, "502", "Bad Gateway",
+                  "Proxy could not reach the origin server");
+    return;
+  }
+  rc = read_responsehdrs(&req->origin_rio, &resp, req->arena);
+  if (req->via_peer && (rc < 0 || resp.status == 503)) {
+    /* The owner shed it or failed; ask the origin ourselves */
+    close_origin(req, originfd);
+    stats_inc(ST_PEER_FAILURES);
+    req->peer = -1;
+    goto again;
+  }
+  if (rc < 0) {
+    if (fd >= 0)
+      clienterror(fd, req->host, "502", "Bad Gateway",
+                  "Proxy got a malformed response from the origin server");
+    close_origin(req, originfd);
+    return;
+  }
+  STAMP(req->stamps, T_FIRSTBYTE);
+  req->origin_ttfb = now_ns() - req->origin_start;
+  response_meta(&resp, &meta);
+  if (stale && resp.status == 304) { /* Our copy is still good */
+    req->stamps[T_LASTBYTE] = now_ns();
+    close_origin(req, originfd);
+    cache_refresh(stale, meta.expires);
+    if (fd < 0)
+      return;
+    if (CACHE_SEGMENTED(stale))
+      serve_segments(fd, req, stale);
+    else
+      serve_cached(fd, req, stale);
+    return;
+  }
+  if (client_ok && client_writen(fd, resp.hdrs, resp.hdrlen) != resp.hdrlen) {
+    close_origin(req, originfd);
+    return;
+  }
+
+  /* Decide how much of the response can be cached */
+  if (resp.no_store || req->via_peer)
+    ; /* From a peer, the peer keeps the copy */
+  else if (stale && stale->meta.status == 200 && resp.status >= 500)
+    ; /* Keep the good copy through an origin hiccup */
+  else if (resp.encoded && (!resp.gzipped || resp.status != 200 ||
+                            resp.length > MAX_OBJECT_SIZE))
+    ; /* Only a whole gzip body can be sent again with its encoding */
+  else if ((resp.status == 200 || negative_cacheable(resp.status)) &&
+           resp.length <= MAX_OBJECT_SIZE) {
+    /* Without a Content-Length, as long as it stays small */
+    objbuf = arena_alloc(req->arena,
+                         resp.length > 0 ? resp.length : MAX_OBJECT_SIZE);
+    whole = objbuf != NULL;
+  } else if (resp.status == 200 && resp.length > MAX_OBJECT_SIZE &&
+             resp.accept_ranges) {
+    segmented = 1;
+    total = resp.length;
+  } else if (resp.status == 206 && resp.total > MAX_OBJECT_SIZE &&
+             resp.length == resp.last - resp.first + 1) {
+    segmented = 1;
+    total = resp.total;
+    pos = resp.first;
+  }
+  if ((whole || segmented) && !stale && !door_admit(req->hash)) {
+    stats_inc(ST_DOOR_SKIPS); /* Not until it is asked for again */
+    whole = segmented = 0;
+  }
+  if ((whole || segmented) && strcmp(resp.vary, req->vary)) {
+    /* It varies on other headers than we knew of, or no longer varies */
+    if (resp.vary[0])
+      cache_insert(req->uri, req->hash, &meta, resp.vary, strlen(resp.vary),
+                   0);
+    if (set_variant(req, resp.vary) < 0)
+      whole = segmented = 0;
+  }
+  if (segmented && (sf = new_segfill(req)) == NULL)
+    segmented = 0;
+  if (segmented)
+    cache_insert(req->key, req->keyhash, &meta, NULL, 0, total);
+
+  /* Relay the body */
+  while (resp.length < 0 || got < resp.length) {
+    want = MAXBUF;
+    if (resp.length >= 0 && resp.length - got < want)
+      want = resp.length - got;
+    deadline_touch(&req->origin_dl);
+    n = brio_readnb(&req->origin_rio, buf, want);
+    deadline_pause(&req->origin_dl); /* Not while the client is slow */
+    if (n <= 0)
+      break;
+    if (client_ok && client_writen(fd, buf, n) != n)
+      client_ok = 0;
+    if (!client_ok && !whole && !segmented)
+      break;
+    if (whole && got + n > MAX_OBJECT_SIZE)
+      whole = 0;
+    if (whole)
+      memcpy(objbuf + got, buf, n);
+    if (segmented)
+      seg_feed(sf, req, &meta, total, pos, buf, n);
+    got += n;
+    pos += n;
+  }
+  req->stamps[T_LASTBYTE] = now_ns();
+
+  close_origin(req, originfd);
+  if (whole && (resp.length >= 0 ? got == resp.length : n == 0))
+    store_whole(req, &resp, &meta, objbuf, got);
+}
+
+/*
+ * store_whole - cache the whole body of a response, n bytes at body.
+ *     A body the origin gzipped is cached as it is, once it is known to
+ *     inflate to the length its gzip trailer gives, which must be at
+ *     most MAX_PLAIN_SIZE. With -g, text that gzip shrinks by at least
+ *     an eighth is cached gzipped instead.
+ */
+void store_whole(request_t *req, response_t *resp, objmeta_t *meta,
+                 char *body, long n) {
+  long room = n - n / 8, zn, plain;
+  unsigned char *t;
+  char *z, *heap;
+  int ok;
+
+  if (resp->gzipped) {
+    if (n < 18) /* Not even an empty gzip stream */
+      return;
+    t = (unsigned char *)body + n - 4;
+    plain = t[0] | t[1] << 8 | t[2] << 16 | (long)t[3] << 24;
+    if (plain == 0 || plain > MAX_PLAIN_SIZE)
+      return;
+    heap = NULL;
+    if ((z = arena_alloc(req->arena, plain)) == NULL)
+      z = heap = Malloc(plain);
+    ok = gzip_unpack(body, n, z, plain) == plain;
+    Free(heap);
+    if (!ok)
+      return;
+    meta->plain = plain;
+  } else if (gzip_bodies && meta->status == 200 && !resp->encoded &&
+      n >= GZIP_MIN_SIZE && gzip_type(meta->type) &&
+      (z = arena_alloc(req->arena, room)) != NULL &&
+      (zn = gzip_pack(body, n, z, room)) > 0) {
+    meta->plain = n;
+    body = z;
+    n = zn;
+  }
+  cache_insert(req->key, req->keyhash, meta, body, n, n);
+}
+
+/*
+ * serve_cached - answer a request from an object held in memory. A
+ *     gzipped body is sent as it is to a client that accepts gzip and
+ *     asks for all of it, and inflated for anyone else, into the heap
+ *     if the request's arena has no room left for it.
+ */
+void serve_cached(int fd, request_t *req, cache_obj_t *obj) {
+  char *body = obj->body, *heap = NULL;
+  long size = obj->size, first = 0, last = size - 1;
+  int rc, enc = ENC_NONE;
+
+  if (obj->meta.status != 200) { /* A cached error, sent as it came */
+    if (write_hdrs(fd, obj->meta.status, obj->meta.type, first, last,
+                   obj->size, enc, req->vary) == 0 && obj->size)
+      client_writen(fd, obj->body, obj->size);
+    return;
+  }
+  if (obj->meta.plain && !req->range[0] && gzip_accepted(req->hdrs)) {
+    enc = ENC_GZIP;
+    stats_inc(ST_GZIP_HITS);
+  } else if (obj->meta.plain) {
+    size = obj->meta.plain;
+    if (size <= MAX_PLAIN_SIZE &&
+        (body = arena_alloc(req->arena, size)) == NULL)
+      body = heap = Malloc(size);
+    if (size > MAX_PLAIN_SIZE ||
+        gzip_unpack(obj->body, obj->size, body, size) != size) {
+      clienterror(fd, req->uri, "500", "Internal Server Error",
+                  "Proxy could not inflate the cached object");
+      goto done;
+    }
+    enc = ENC_IDENTITY;
+    stats_inc(ST_GUNZIPS);
+  }
+  rc = resolve_range(req->range, size, &first, &last);
+  if (rc < 0) {
+    write_hdrs(fd, 416, obj->meta.type, 0, 0, size, enc, req->vary);
+    goto done;
+  }
+  if (rc == 0) {
+    first = 0;
+    last = size - 1;
+  }
+  if (write_hdrs(fd, rc ? 206 : 200, obj->meta.type, first, last, size,
+                 enc, req->vary) < 0)
+    goto done;
+  if (last >= first)
+    client_writen(fd, body + first, last - first + 1);
+done:
+  Free(heap);
+}
+
+/*
+ * serve_segments - answer a request for the segmented object whose
+ *     index entry is obj from its cached segments, fetching any runs of
+ *     missing segments from the origin. Returns 0 on success, -1 if the
+ *     response had to be cut short.
+ */
+int serve_segments(int fd, request_t *req, cache_obj_t *obj) {
+  char *skey;
+  cache_obj_t *seg;
+  long first, last, idx, end, lastidx, off, total = obj->total;
+  int rc;
+
+  if ((skey = arena_alloc(req->arena, strlen(req->key) + 32)) == NULL)
+    return -1;
+  rc = resolve_range(req->range, total, &first, &last);
+  if (rc < 0)
+    return write_hdrs(fd, 416, obj->meta.type, 0, 0, total, ENC_NONE,
+                      req->vary);
+  if (rc == 0) {
+    first = 0;
+    last = total - 1;
+  }
+  if (write_hdrs(fd, rc ? 206 : 200, obj->meta.type, first, last, total,
+                 ENC_NONE, req->vary) < 0)
+    return -1;
+
+  lastidx = last / SEGMENT_SIZE;
+  for (idx = first / SEGMENT_SIZE; idx <= lastidx;) {
+    if ((seg = lookup_segment(req, obj, skey, idx)) != NULL) {
+      off = idx * SEGMENT_SIZE;
+      rc = write_slice(fd, off, seg->body, seg->size, first, last);
+      cache_release(seg);
+      if (rc < 0)
+        return -1;
+      idx++;
+      continue;
+    }
+
+    /* Extend the run of missing segments as far as it goes */
+    for (end = idx + 1; end <= lastidx; end++) {
+      if ((seg = lookup_segment(req, obj, skey, end)) != NULL) {
+        cache_release(seg);
+        break;
+      }
+    }
+    if (fetch_segments(fd, req, obj, idx, end - 1, first, last) < 0)
+      return -1;
+    idx = end;
+  }
   return 0;
 }
+
+/*
+ * lookup_segment - look up segment idx of the object indexed by obj,
+ *     building its key in skey. A segment left from another version of
+ *     the object, with another length or ETag, is removed and counts as
+ *     missing, so that it is fetched again. Returns the segment, which
+ *     the caller must release, or NULL.
+ */
+cache_obj_t *lookup_segment(request_t *req, cache_obj_t *obj, char *skey,
+                            long idx) {
+  cache_obj_t *seg;
+
+  segment_key(skey, req->key, idx);
+  if ((seg = lookup(skey, uri_hash(skey), req->arena)) == NULL)
+    return NULL;
+  if (seg->total == obj->total && !strcmp(seg->meta.etag, obj->meta.etag))
+    return seg;
+  cache_release(seg);
+  cache_remove(skey, uri_hash(skey));
+  return NULL;
+}
+
+/*
+ * fetch_segments - fetch segments lo..hi of the object indexed by obj
+ *     from the origin, cache them, and write the part of them that falls
+ *     within [first, last] to the client. Returns 0 on success, -1 on
+ *     failure.
+ */
+int fetch_segments(int fd, request_t *req, cache_obj_t *obj, long lo, long hi,
+                   long first, long last) {
+  char range[64], *buf;
+  long pos, end, total = obj->total;
+  int originfd, rc = -1;
+  ssize_t n, want;
+  response_t resp;
+  segfill_t *sf;
+  size_t mark = arena_save(req->arena); /* A request may fetch many runs */
+
+  pos = lo * SEGMENT_SIZE;
+  end = (hi + 1) * SEGMENT_SIZE < total ? (hi + 1) * SEGMENT_SIZE : total;
+  sprintf(range, "bytes=%ld-%ld", pos, end - 1);
+  /* Not shed: the client has the header, and maybe some of the body */
+  if ((originfd = open_origin(req, range, "", 1)) < 0)
+    return -1;
+  if (read_responsehdrs(&req->origin_rio, &resp, req->arena) < 0)
+    goto done;
+  STAMP(req->stamps, T_FIRSTBYTE);
+  req->origin_ttfb = now_ns() - req->origin_start;
+
+  if (resp.encoded) /* Not the bytes of the object we are serving */
+    goto done;
+  if (resp.status == 206) {
+    if (resp.total != total || resp.first != pos ||
+        strcmp(resp.etag, obj->meta.etag)) {
+      /* The object changed under us; forget what we know about it */
+      cache_remove(req->key, req->keyhash);
+      goto done;
+    }
+  } else if (resp.status != 200 || resp.length != total)
+    goto done;
+  else
+    pos = 0; /* Origin ignored the Range; skip up to what we need */
+
+  if ((sf = new_segfill(req)) == NULL ||
+      (buf = arena_alloc(req->arena, MAXBUF)) == NULL)
+    goto done;
+  while (pos < end) {
+    want = end - pos < MAXBUF ? end - pos : MAXBUF;
+    deadline_touch(&req->origin_dl);
+    n = brio_readnb(&req->origin_rio, buf, want);
+    deadline_pause(&req->origin_dl); /* Not while the client is slow */
+    if (n <= 0)
+      break;
+    seg_feed(sf, req, &obj->meta, total, pos, buf, n);
+    if (write_slice(fd, pos, buf, n, first, last) < 0)
+      break;
+    pos += n;
+  }
+  req->stamps[T_LASTBYTE] = now_ns();
+  if (pos == end)
+    rc = 0;
+
+done:
+  close_origin(req, originfd);
+  arena_restore(req->arena, mark);
+  return rc;
+}
+
+/*
+ * new_segfill - allocate an empty segfill_t from the request's arena.
+ *     Returns NULL if it does not fit.
+ */
+segfill_t *new_segfill(request_t *req) {
+  segfill_t *sf = arena_alloc(req->arena, sizeof(segfill_t));
+
+  if (sf == NULL ||
+      (sf->key = arena_alloc(req->arena, strlen(req->key) + 32)) == NULL)
+    return NULL;
+  sf->valid = 0;
+  return sf;
+}
+
+/*
+ * seg_feed - account for n body bytes at object offset pos, caching
+ *     every segment that has been seen from its first to its last byte
+ */
+void seg_feed(segfill_t *sf, request_t *req, objmeta_t *meta, long total,
+              long pos, char *data, long n) {
+  long idx, off, seglen, m;
+
+  while (n > 0) {
+    idx = pos / SEGMENT_SIZE;
+    off = pos % SEGMENT_SIZE;
+    seglen = total - idx * SEGMENT_SIZE;
+    if (seglen > SEGMENT_SIZE)
+      seglen = SEGMENT_SIZE;
+    m = seglen - off < n ? seglen - off : n;
+
+    if (off == 0) {
+      sf->idx = idx;
+      sf->fill = 0;
+      sf->valid = 1;
+    }
+    if (sf->valid && sf->idx == idx && sf->fill == off) {
+      memcpy(sf->buf + off, data, m);
+      sf->fill += m;
+      if (sf->fill == seglen) {
+        segment_key(sf->key, req->key, idx);
+        cache_insert(sf->key, uri_hash(sf->key), meta, sf->buf, seglen,
+                     total);
+        sf->valid = 0;
+      }
+    }
+    pos += m;
+    data += m;
+    n -= m;
+  }
+}
+
+/*
+ * write_slice - write the part of the n bytes at object offset pos that
+ *     lies within [first, last]. Returns 0 on success, -1 on error.
+ */
+int write_slice(int fd, long pos, char *data, long n, long first, long last) {
+  long lo = pos > first ? pos : first;
+  long hi = pos + n - 1 < last ? pos + n - 1 : last;
+
+  if (lo > hi)
+    return 0;
+  return client_writen(fd, data + (lo - pos), hi - lo + 1) < 0 ? -1 : 0;
+}
+
+/*
+ * write_hdrs - write the response headers for an answer generated by
+ *     the proxy itself: a 200, a 206 for bytes first..last of total, a
+ *     416, or a cached error, with the body encoded as enc says, and
+ *     the Vary list of a variant, or "". Returns 0 on success, -1 on
+ *     error.
+ */
+int write_hdrs(int fd, int status, char *type, long first, long last,
+               long total, int enc, char *vary) {
+  char buf[HDR_SIZE];
+  int n = format_hdrs(buf, status, type, first, last, total, enc, vary);
+
+  return client_writen(fd, buf, n) == n ? 0 : -1;
+}
+
+/*
+ * format_hdrs - format the header write_hdrs() sends into buf, which
+ *     must hold HDR_SIZE bytes. Returns its length.
+ */
+int format_hdrs(char *buf, int status, char *type, long first, long last,
+                long total, int enc, char *vary) {
+  int n;
+
+  n = sprintf(buf, "HTTP/1.0 %d %s\r\n", status, reason_phrase(status));
+  n += sprintf(buf + n, "Connection: close\r\n");
+  if (status == 200 || status == 206 || status == 416)
+    n += sprintf(buf + n, "Accept-Ranges: bytes\r\n");
+  if (status == 206)
+    n += sprintf(buf + n, "Content-Range: bytes %ld-%ld/%ld\r\n", first, last,
+                 total);
+  else if (status == 416)
+    n += sprintf(buf + n, "Content-Range: bytes */%ld\r\n", total);
+  n += sprintf(buf + n, "Content-Length: %ld\r\n",
+               status == 416 ? 0 : last - first + 1);
+  if (enc == ENC_GZIP)
+    n += sprintf(buf + n, "Content-Encoding: gzip\r\n");
+  if (vary[0]) /* A variant, chosen by these request headers */
+    n += sprintf(buf + n, "Vary: %s%s\r\n", vary,
+                 enc != ENC_NONE && !strstr(vary, "accept-encoding")
+                     ? ",accept-encoding" : "");
+  else if (enc != ENC_NONE) /* What is sent depends on Accept-Encoding */
+    n += sprintf(buf + n, "Vary: Accept-Encoding\r\n");
+  n += sprintf(buf + n, "Content-Type: %.256s\r\n\r\n", type);
+  return n;
+}
+
+/*
+ * clienterror - returns an error message to the client
+ */
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg) {
+  char buf[HDR_SIZE], body[1024];
+  int n;
+
+  /* Build the HTTP response body */
+  n = snprintf(body, sizeof(body),
+               "<html><title>Proxy Error</title>"
+               "<body bgcolor=ffffff>\r\n"
+               "%s: %s\r\n"
+               "<p>%s: %.512s\r\n"
+               "<hr><em>The Proxy Web server</em>\r\n",
+               errnum, shortmsg, longmsg, cause);
+
+  /* Print the HTTP response */
+  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+  client_writen(fd, buf, strlen(buf));
+  sprintf(buf, "Content-type: text/html\r\n");
+  client_writen(fd, buf, strlen(buf));
+  sprintf(buf, "Content-length: %d\r\n\r\n", n);
+  client_writen(fd, buf, strlen(buf));
+  client_writen(fd, body, n);
+}
+
+/*
+ * client_writen - rio_writen() to the client, with the thread's client
+ *     deadline running for as long as the write takes and credited
+ *     with its size
+ */
+ssize_t client_writen(int fd, void *buf, size_t n) {
+  ssize_t rc;
+
+  deadline_expect(client_dl, n);
+  rc = rio_writen(fd, buf, n);
+  deadline_pause(client_dl);
+  return rc;
+}
+
+/*
+ * serve_stats - answer a GET of STATS_PATH with the proxy's counters,
+ *     cache occupancy, queue depths and per-phase latency quantiles, in
+ *     the Prometheus text exposition format
+ */
+void serve_stats(int fd) {
+  static const double quantiles[] = {0.5, 0.99, 0.999};
+  char hdr[HDR_SIZE];
+  page_t page;
+  long totals[NSTATS], reaped[NDL];
+  cache_stats_t cs;
+  hist_t *phases;
+  int i, j, queued, refreshes, inflight;
+  long bufs, bufs_used, arena_peak, arena_exhausted, restored, discarded;
+  disk_stats_t ds;
+  dedup_stats_t dd;
+  double limit;
+
+  stats_sum(totals);
+  deadline_counts(reaped);
+  origin_limits(&limit, &inflight);
+  bufpool_stats(&bufs, &bufs_used);
+  arena_stats(&arena_peak, &arena_exhausted);
+  snapshot_stats(&restored, &discarded);
+  disk_stats(&ds);
+  cache_stats(&cs);
+  dedup_stats(&dd);
+  sem_getvalue(&sbuf.items, &queued);
+  P(&refresh_mutex);
+  refreshes = refresh_len;
+  V(&refresh_mutex);
+  phases = Calloc(NPHASES, sizeof(hist_t));
+  timing_merge(phases);
+
+  page.buf = Malloc(STATS_SIZE);
+  page.size = STATS_SIZE;
+  page.len = 0;
+  put_metric(&page, "proxy_cache_entries", "gauge",
+             "Objects, index entries and segments cached.", cs.entries);
+  put_metric(&page, "proxy_cache_bytes", "gauge",
+             "Bytes of cached bodies.", cs.bytes);
+  put_metric(&page, "proxy_cache_capacity_bytes", "gauge",
+             "MAX_CACHE_SIZE.", MAX_CACHE_SIZE);
+  put_metric(&page, "proxy_cache_hits_total", "counter",
+             "Requests answered from the cache.", totals[ST_HITS]);
+  put_metric(&page, "proxy_cache_stale_hits_total", "counter",
+             "Cache hits served from a stale copy.",
+             totals[ST_STALE_HITS]);
+  put_metric(&page, "proxy_cache_fast_hits_total", "counter",
+             "Cache hits answered by the accepting thread.",
+             totals[ST_FAST_HITS]);
+  put_metric(&page, "proxy_cache_negative_hits_total", "counter",
+             "Cache hits served from a cached error.",
+             totals[ST_NEGATIVE_HITS]);
+  put_metric(&page, "proxy_cache_gzip_hits_total", "counter",
+             "Hits sent gzipped, as the body is cached.",
+             totals[ST_GZIP_HITS]);
+  put_metric(&page, "proxy_cache_gunzips_total", "counter",
+             "Hits inflated from a gzipped body for the client.",
+             totals[ST_GUNZIPS]);
+  put_metric(&page, "proxy_cache_variant_hits_total", "counter",
+             "Hits on the variant of a URI its Vary headers select.",
+             totals[ST_VARIANT_HITS]);
+  put_metric(&page, "proxy_cache_misses_total", "counter",
+             "Requests sent on to the origin.", totals[ST_MISSES]);
+  put_metric(&page, "proxy_cache_admission_skips_total", "counter",
+             "Misses not cached, first seen by the doorkeeper.",
+             totals[ST_DOOR_SKIPS]);
+  put_metric(&page, "proxy_cache_evictions_total", "counter",
+             "Objects evicted to make room.", cs.evictions);
+  put_metric(&page, "proxy_cache_lookups_total", "counter",
+             "Cache lookups, by all processes sharing the cache.",
+             cs.lookups);
+  put_metric(&page, "proxy_cache_lookup_hits_total", "counter",
+             "Cache lookups that found an object.", cs.found);
+  put_metric(&page, "proxy_dedup_bodies", "gauge",
+             "Distinct bodies held by this process's cache.", dd.bodies);
+  put_metric(&page, "proxy_dedup_refs", "gauge",
+             "Objects pointing at those bodies.", dd.refs);
+  put_metric(&page, "proxy_dedup_saved_bytes", "gauge",
+             "Bytes saved by sharing bodies between objects.",
+             dd.logical - dd.bytes);
+  put_metric(&page, "proxy_dedup_hits_total", "counter",
+             "Bodies found stored already under another object.",
+             dd.hits);
+  put_metric(&page, "proxy_disk_entries", "gauge",
+             "Objects in the disk tier.", ds.entries);
+  put_metric(&page, "proxy_disk_bytes", "gauge",
+             "Bytes of the disk tier's log they take up.", ds.bytes);
+  put_metric(&page, "proxy_disk_hits_total", "counter",
+             "Cache misses answered from the disk tier.",
+             totals[ST_DISK_HITS]);
+  put_metric(&page, "proxy_disk_demotions_total", "counter",
+             "Evicted objects written to the disk tier.", ds.demotions);
+  put_metric(&page, "proxy_disk_promotions_total", "counter",
+             "Disk tier hits copied back into the cache.",
+             ds.promotions);
+  put_metric(&page, "proxy_disk_lost_total", "counter",
+             "Disk tier reads overwritten while they ran.", ds.lost);
+  put_metric(&page, "proxy_snapshot_restored_total", "counter",
+             "Objects restored from the snapshot file.", restored);
+  put_metric(&page, "proxy_snapshot_discarded_total", "counter",
+             "Snapshot objects stale, damaged or already cached.",
+             discarded);
+  put_metric(&page, "proxy_requests_total", "counter",
+             "Proxied requests parsed.", totals[ST_REQUESTS]);
+  put_metric(&page, "proxy_connections_total", "counter",
+             "Client connections accepted.", totals[ST_ACCEPTED]);
+  put_metric(&page, "proxy_connections_active", "gauge",
+             "Client connections accepted and not yet closed.",
+             totals[ST_ACCEPTED] - totals[ST_CLOSED]);
+  put_metric(&page, "proxy_origin_connects_total", "counter",
+             "Connections opened to origin servers.",
+             totals[ST_ORIGIN_CONNECTS]);
+  put_metric(&page, "proxy_ip_rejects_total", "counter",
+             "Connections refused, client address at its limit.",
+             totals[ST_IP_REJECTS]);
+  put_metric(&page, "proxy_header_rejects_total", "counter",
+             "Requests refused, header too large.",
+             totals[ST_HEADER_REJECTS]);
+  put_metric(&page, "proxy_origin_cooldown_skips_total", "counter",
+             "Origin connects skipped while the origin was down.",
+             totals[ST_COOLDOWN_SKIPS]);
+  put_metric(&page, "proxy_shed_total", "counter",
+             "Requests answered 503, origin concurrency limit reached.",
+             totals[ST_SHED]);
+  put_metric(&page, "proxy_shed_stale_total", "counter",
+             "Revalidations shed and answered from the stale copy.",
+             totals[ST_SHED_STALE]);
+  put_metric(&page, "proxy_peer_fetches_total", "counter",
+             "Misses fetched from the peer that owns them.",
+             totals[ST_PEER_FETCHES]);
+  put_metric(&page, "proxy_peer_failures_total", "counter",
+             "Peer fetches that went to the origin instead.",
+             totals[ST_PEER_FAILURES]);
+  put_metric(&page, "proxy_origin_limit", "gauge",
+             "Origin requests allowed in flight over all origins.",
+             (long)limit);
+  put_metric(&page, "proxy_origin_inflight", "gauge",
+             "Origin requests in flight over all origins.", inflight);
+  put_metric(&page, "proxy_io_buffers", "gauge",
+             "Read buffers allocated to the pool.", bufs);
+  put_metric(&page, "proxy_io_buffers_in_use", "gauge",
+             "Read buffers holding unread data.", bufs_used);
+  put_metric(&page, "proxy_arena_peak_bytes", "gauge",
+             "Most arena memory any one request has used.", arena_peak);
+  put_metric(&page, "proxy_arena_exhausted_total", "counter",
+             "Allocations that did not fit in a request's arena.",
+             arena_exhausted);
+  put_metric(&page, "proxy_queue_depth", "gauge",
+             "Accepted connections waiting for a worker thread.",
+             queued);
+  put_metric(&page, "proxy_refresh_queue_depth", "gauge",
+             "Background refreshes waiting to run.", refreshes);
+
+  page_printf(&page,
+              "# HELP proxy_reaped_total Connections shut down because a "
+              "deadline passed.\n"
+              "# TYPE proxy_reaped_total counter\n");
+  for (i = 0; i < NDL; i++)
+    page_printf(&page, "proxy_reaped_total{reason=\"%s\"} %ld\n",
+                deadline_names[i], reaped[i]);
+
+  if (stack_audit) {
+    page_printf(&page,
+                "# HELP proxy_stack_high_water_bytes Most stack a request "
+                "has used, by code path.\n"
+                "# TYPE proxy_stack_high_water_bytes gauge\n");
+    for (i = 0; i < NROUTES; i++)
+      page_printf(&page,
+                  "proxy_stack_high_water_bytes{route=\"%s\"} %ld\n",
+                  route_names[i], stack_hw[i]);
+  }
+
+  page_printf(&page,
+              "# HELP proxy_phase_seconds Time spent in each phase of a "
+              "request.\n"
+              "# TYPE proxy_phase_seconds summary\n");
+  for (i = 0; i < NPHASES; i++) {
+    for (j = 0; j < 3; j++)
+      page_printf(&page,
+                  "proxy_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                  phase_names[i], quantiles[j],
+                  hist_quantile(&phases[i], quantiles[j]) / 1e9);
+    page_printf(&page, "proxy_phase_seconds_sum{phase=\"%s\"} %.9f\n",
+                phase_names[i], phases[i].sum / 1e9);
+    page_printf(&page, "proxy_phase_seconds_count{phase=\"%s\"} %lu\n",
+                phase_names[i], phases[i].count);
+  }
+  Free(phases);
+
+  sprintf(hdr,
+          "HTTP/1.0 200 OK\r\n"
+          "Connection: close\r\n"
+          "Cache-Control: no-store\r\n"
+          "Content-Length: %d\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n\r\n",
+          page.len);
+  if (client_writen(fd, hdr, strlen(hdr)) == (ssize_t)strlen(hdr))
+    client_writen(fd, page.buf, page.len);
+  Free(page.buf);
+}
+
+/*
+ * page_printf - append to the statistics page, growing its buffer when
+ *     what is added does not fit
+ */
+void page_printf(page_t *page, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(page->buf + page->len, page->size - page->len, fmt, ap);
+  va_end(ap);
+  if (n >= page->size - page->len) {
+    while (n >= page->size - page->len)
+      page->size *= 2;
+    page->buf = Realloc(page->buf, page->size);
+    va_start(ap, fmt);
+    vsnprintf(page->buf + page->len, page->size - page->len, fmt, ap);
+    va_end(ap);
+  }
+  page->len += n;
+}
+
+/*
+ * put_metric - append one metric with its HELP and TYPE lines to page
+ */
+void put_metric(page_t *page, char *name, char *type, char *help, long v) {
+  page_printf(page, "# HELP %s %s\n# TYPE %s %s\n%s %ld\n", name, help,
+              name, type, name, v);
+}
@@ -0,0 +1,207 @@
+/*
+ * restart.c - hand the listening socket and the cache over to a new
+ *     proxy process
+ *
+ * A proxy started with -H path listens on a Unix domain socket at path.
+ * A new proxy started with the same -H connects to it first, and the
+ * old one answers with its process id and, as SCM_RIGHTS ancillary
+ * data, two descriptors: its listening socket and the memfd behind its
+ * cache. The new proxy accepts from the same socket, so connections
+ * that arrive during the restart wait in its queue instead of being
+ * refused, and maps the same cache, so nothing cached is lost.
+ *
+ * Once the descriptors are sent, the old proxy stops accepting and lets
+ * the connections it has already accepted finish before it exits (see
+ * stop_accepting() in proxy.c). It removes path before it answers, so
+ * that the new proxy can listen there in turn, ready for the next
+ * restart. The connection between the two stays open until the old
+ * proxy is gone, however it goes; the new one then lets go of any
+ * cache entries the old one still held.
+ */
+#include <sys/un.h>
+#include "restart.h"
+#include "cache.h"
+
+/* What serve() needs */
+typedef struct {
+  int unixfd;          /* Listening on path */
+  char *path;
+  int fds[2];          /* Listening socket and memfd to hand over */
+  void (*stop)(void);  /* Stops this process accepting */
+} handoff_t;
+
+/* What watch() needs */
+typedef struct {
+  int fd;    /* Connection to the old proxy */
+  pid_t pid; /* Its process id */
+} peer_t;
+
+static peer_t *old; /* The proxy taken over from, if any */
+
+void *serve(void *vargp);
+void *watch(void *vargp);
+
+static int unix_socket(const char *path, struct sockaddr_un *addr) {
+  int fd;
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+    app_error("restart: socket path too long");
+  strcpy(addr->sun_path, path);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    unix_error("restart: socket error");
+  return fd;
+}
+
+/*
+ * restart_takeover - take over from a proxy listening on path, if there
+ *     is one. Returns 0 with its listening socket in *listenfd and its
+ *     cache's memfd in *cachefd, or -1 if there is nothing to take over.
+ */
+int restart_takeover(const char *path, int *listenfd, int *cachefd) {
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  peer_t *peer;
+  int fd, fds[2];
+
+  fd = unix_socket(path, &addr);
+  if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+    Close(fd);
+    return -1; /* Nobody there, or a stale socket */
+  }
+
+  peer = Malloc(sizeof(peer_t));
+  peer->fd = fd;
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &peer->pid;
+  iov.iov_len = sizeof(pid_t);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.buf;
+  msg.msg_controllen = sizeof(u.buf);
+  if (recvmsg(fd, &msg, 0) != sizeof(pid_t) ||
+      (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    app_error("restart: bad handoff from the old proxy");
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  *listenfd = fds[0];
+  *cachefd = fds[1];
+
+  /* Keep the connection, to hear when the old proxy is gone */
+  fprintf(stderr, "Took over from process %d\n", (int)peer->pid);
+  old = peer;
+  return 0;
+}
+
+/*
+ * watch - wait for the old proxy to close its end of the connection,
+ *     as it does on exit, then let go of what it held in the cache
+ */
+void *watch(void *vargp) {
+  peer_t *peer = vargp;
+  char c;
+
+  Pthread_detach(pthread_self());
+  while (read(peer->fd, &c, 1) != 0)
+    if (errno != EINTR)
+      break;
+  Close(peer->fd);
+  fprintf(stderr, "Process %d is gone, it held %d cache entries\n",
+          (int)peer->pid, cache_reap(peer->pid));
+  Free(peer);
+  return NULL;
+}
+
+/*
+ * restart_serve - listen on path for a new proxy to hand listenfd and
+ *     cachefd over to. Once they are sent, stop() is called, and this
+ *     process should finish what it has and exit. Call it once the cache
+ *     is attached, since it also starts watching the proxy taken over
+ *     from, if any, to clean up after it.
+ */
+void restart_serve(const char *path, int listenfd, int cachefd,
+                   void (*stop)(void)) {
+  handoff_t *h = Malloc(sizeof(handoff_t));
+  struct sockaddr_un addr;
+  pthread_t tid;
+
+  h->unixfd = unix_socket(path, &addr);
+  unlink(path);
+  if (bind(h->unixfd, (SA *)&addr, sizeof(addr)) < 0)
+    unix_error("restart: bind error");
+  if (listen(h->unixfd, 1) < 0)
+    unix_error("restart: listen error");
+  h->path = strdup(path);
+  h->fds[0] = listenfd;
+  h->fds[1] = cachefd;
+  h->stop = stop;
+  Pthread_create(&tid, NULL, serve, h);
+  if (old)
+    Pthread_create(&tid, NULL, watch, old);
+}
+
+/*
+ * serve - hand over to the first proxy that connects. If accepting it
+ *     fails for good, or sending it the descriptors fails, give up on
+ *     handing over, and keep serving.
+ */
+void *serve(void *vargp) {
+  handoff_t *h = vargp;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  pid_t pid = getpid();
+  int fd;
+
+  Pthread_detach(pthread_self());
+  while ((fd = accept(h->unixfd, NULL, NULL)) < 0)
+    if (errno != EINTR && errno != ECONNABORTED)
+      break;
+  if (fd < 0)
+    fprintf(stderr, "restart: accept error: %s; not handing over\n",
+            strerror(errno));
+  Close(h->unixfd);
+  unlink(h->path); /* Free for the new proxy to listen on */
+  if (fd < 0) {
+    free(h->path);
+    Free(h);
+    return NULL;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&u, 0, sizeof(u));
+  iov.iov_base = &pid;
+  iov.iov_len = sizeof(pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.buf;
+  msg.msg_controllen = sizeof(u.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(h->fds));
+  memcpy(CMSG_DATA(cmsg), h->fds, sizeof(h->fds));
+  if (sendmsg(fd, &msg, 0) != sizeof(pid)) {
+    fprintf(stderr, "restart: handoff failed: %s; not handing over\n",
+            strerror(errno));
+    Close(fd);
+    free(h->path);
+    Free(h);
+    return NULL;
+  }
+  fprintf(stderr, "Handed over to a new process, draining\n");
+  h->stop(); /* fd stays open until we exit */
+  return NULL;
+}
@@ -0,0 +1,14 @@
+/*
+ * restart.h - hand the listening socket and the cache over to a new
+ *     proxy process
+ */
+#ifndef __RESTART_H__
+#define __RESTART_H__
+
+#include "csapp.h"
+
+int restart_takeover(const char *path, int *listenfd, int *cachefd);
+void restart_serve(const char *path, int listenfd, int cachefd,
+                   void (*stop)(void));
+
+#endif /* __RESTART_H__ */
@@ -0,0 +1,643 @@
+/*
+ * shcache.c - the cache in a shared memory segment, for prefork mode
+ *     and hot restarts
+ *
+ * With -P, the proxy runs as several worker processes, and the cache
+ * lives in a memfd segment that the parent maps before it forks them,
+ * so that every worker finds what any of them has cached. With -H, a
+ * single proxy keeps its cache there too, and hands the memfd on to the
+ * proxy that replaces it (see restart.c), which maps the same segment.
+ * cache.c hands its calls on to this module while the segment is usable.
+ *
+ * Nothing in the segment holds a pointer. The hash chains, the LRU list,
+ * the chains of variants off their primary entries (see cache.c) and the
+ * allocator's free list link entries by their offset from the start of
+ * the segment, so the segment means the same wherever it is mapped.
+ * The bodies and strings are copied into the segment on insert and
+ * served from there; a lookup returns a small private cache_obj_t whose
+ * pointers are this process's view of the entry.
+ *
+ * Entries are allocated from a heap in the segment. Its blocks carry
+ * their size and whether they are in use at both ends (boundary tags),
+ * so that a freed block merges with free neighbours at once, and free
+ * blocks form a first-fit list. When no block is big enough, LRU
+ * entries are evicted until one is. An insert only allocates its block
+ * under the lock; the body is copied in after the lock is released, and
+ * the entry is indexed under the lock again.
+ *
+ * One process-shared mutex protects the segment. It is robust: if its
+ * holder dies, the next process to lock it is told so, checks that
+ * every structure still adds up, and otherwise marks the segment
+ * broken, after which every process goes back to a private cache.
+ *
+ * A process that dies while it holds entries would leak them, so each
+ * process records every entry it holds, including one it is still
+ * filling in, in its own table in the segment. The parent reaps a dead
+ * worker by dropping each entry in its table, and clears any background
+ * refresh the worker had claimed.
+ */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include "shcache.h"
+
+#define SHM_MAGIC 0x70786368 /* "pxch" */
+#define SHM_VERSION 3        /* Of the layout below; bump it on any change */
+#define NBUCKETS 1024
+#define ALIGN 16
+#define MIN_BLOCK 32 /* Tags and the free list links */
+#define ROUND(n) (((n) + ALIGN - 1) & ~(uint64_t)(ALIGN - 1))
+
+/* A cached object, in a heap block */
+typedef struct {
+  uint64_t hnext;      /* Next entry in the hash chain */
+  uint64_t hash;       /* uri_hash() of the key */
+  uint64_t prev, next; /* LRU list, most recent first */
+  uint64_t primary;    /* Of a variant, 0 for other entries */
+  uint64_t variants;   /* Of a primary entry, chained by vnext */
+  uint64_t vnext;
+  int32_t refcnt;      /* Holders, including the cache itself */
+  int32_t refreshing;  /* Pid of a background refresh under way, or 0 */
+  int32_t status;
+  int32_t swr;
+  int64_t expires;
+  uint64_t size;  /* Bytes of body */
+  uint64_t total; /* Length of the whole object */
+  uint64_t plain; /* Body length before gzip, 0 if kept as it came */
+  uint32_t keylen; /* String lengths, NULs included */
+  uint32_t typelen;
+  uint32_t etaglen;
+  uint32_t modlen;
+  char data[]; /* Body, then key, type, ETag and Last-Modified */
+} shent_t;
+
+/* The start of the segment */
+typedef struct {
+  uint32_t magic;        /* SHM_MAGIC */
+  uint32_t version;      /* SHM_VERSION */
+  uint32_t entsize;      /* sizeof(shent_t) */
+  pthread_mutex_t lock;  /* Protects the whole segment */
+  int broken;            /* Left inconsistent by a dead process */
+  uint64_t heap, end;    /* Offsets of the heap and of its end */
+  uint64_t free;         /* First free block */
+  uint64_t head, tail;   /* Most and least recently used entries */
+  uint64_t cache_size;   /* Sum of the cached body sizes */
+  long count;            /* Entries in the cache */
+  long evictions;        /* Entries evicted to make room */
+  long lookups, found;   /* Lookups, and those that found an entry */
+  struct {
+    pid_t pid;                  /* Process using the slot, or 0 */
+    uint64_t held[SHM_MAXHELD]; /* Entries it holds, 0 for none */
+  } procs[SHM_MAXPROCS];
+  uint64_t buckets[NBUCKETS];
+} shm_t;
+
+/* What shcache_lookup() hands out */
+typedef struct {
+  cache_obj_t obj; /* Pointing into the segment */
+  uint64_t off;    /* Of the entry */
+  int hold;        /* Slot in this process's table */
+} shobj_t;
+
+static shm_t *shm; /* The segment, NULL if there is none */
+static char *base; /* The same, for offset arithmetic */
+static int me = -1; /* This process's slot in shm->procs */
+static int shm_fd = -1; /* The memfd behind it */
+
+#define AT(off) ((uint64_t *)(base + (off)))
+#define ENT(off) ((shent_t *)(base + (off)))
+#define TAG(b) (*AT(b))
+#define FOOT(b) (*AT((b) + SIZE(TAG(b)) - 8))
+#define SIZE(t) ((t) & ~(uint64_t)(ALIGN - 1))
+#define USED(t) ((t)&1)
+#define FNEXT(b) (*AT((b) + 8)) /* Free list links of free block b */
+#define FPREV(b) (*AT((b) + 16))
+
+/*
+ * Heap blocks: a tag (size | used) at each end, and in between either
+ * an entry, at block + 8, or the free list links. The lock is held.
+ */
+
+static void set_tags(uint64_t b, uint64_t size, int used) {
+  *AT(b) = size | used;
+  *AT(b + size - 8) = size | used;
+}
+
+static void free_unlink(uint64_t b) {
+  if (FPREV(b))
+    FNEXT(FPREV(b)) = FNEXT(b);
+  else
+    shm->free = FNEXT(b);
+  if (FNEXT(b))
+    FPREV(FNEXT(b)) = FPREV(b);
+}
+
+static void free_push(uint64_t b) {
+  FPREV(b) = 0;
+  FNEXT(b) = shm->free;
+  if (shm->free)
+    FPREV(shm->free) = b;
+  shm->free = b;
+}
+
+/* Return the offset of n free bytes, or 0 if no block has room */
+static uint64_t heap_alloc(uint64_t n) {
+  uint64_t b, size, need = ROUND(n + 16);
+
+  for (b = shm->free; b; b = FNEXT(b))
+    if ((size = SIZE(TAG(b))) >= need)
+      break;
+  if (b == 0)
+    return 0;
+  if (size - need >= MIN_BLOCK) { /* Keep the front of the block free */
+    set_tags(b, size - need, 0);
+    b += size - need;
+  } else {
+    free_unlink(b);
+    need = size;
+  }
+  set_tags(b, need, 1);
+  return b + 8;
+}
+
+static void heap_free(uint64_t off) {
+  uint64_t b = off - 8, size = SIZE(TAG(b)), t;
+
+  if (b + size < shm->end && !USED(t = TAG(b + size))) {
+    free_unlink(b + size); /* Merge the next block */
+    size += SIZE(t);
+  }
+  if (b > shm->heap && !USED(t = *AT(b - 8))) {
+    b -= SIZE(t); /* Merge into the previous block */
+    free_unlink(b);
+    size += SIZE(t);
+  }
+  set_tags(b, size, 0);
+  free_push(b);
+}
+
+/* The index and the LRU list; the lock is held */
+
+static void lru_unlink(uint64_t e) {
+  shent_t *ent = ENT(e);
+
+  if (ent->prev)
+    ENT(ent->prev)->next = ent->next;
+  else
+    shm->head = ent->next;
+  if (ent->next)
+    ENT(ent->next)->prev = ent->prev;
+  else
+    shm->tail = ent->prev;
+  ent->prev = ent->next = 0;
+}
+
+static void lru_push(uint64_t e) {
+  ENT(e)->prev = 0;
+  ENT(e)->next = shm->head;
+  if (shm->head)
+    ENT(shm->head)->prev = e;
+  shm->head = e;
+  if (!shm->tail)
+    shm->tail = e;
+}
+
+static char *ent_key(shent_t *ent) {
+  return ent->data + ent->size;
+}
+
+static uint64_t find(const char *key, uint64_t hash) {
+  uint64_t e = shm->buckets[hash % NBUCKETS];
+
+  while (e && (ENT(e)->hash != hash || strcmp(ent_key(ENT(e)), key)))
+    e = ENT(e)->hnext;
+  return e;
+}
+
+/* Drop a reference, freeing the entry with the last one */
+static void put(uint64_t e) {
+  if (--ENT(e)->refcnt == 0)
+    heap_free(e);
+}
+
+/* Take e out of the index, and the variants of a primary entry with it */
+static void unindex(uint64_t e) {
+  uint64_t *pp = &shm->buckets[ENT(e)->hash % NBUCKETS];
+  shent_t *ent = ENT(e);
+
+  while (*pp != e)
+    pp = &ENT(*pp)->hnext;
+  *pp = ent->hnext;
+  if (ent->primary) {
+    for (pp = &ENT(ent->primary)->variants; *pp != e;
+         pp = &ENT(*pp)->vnext)
+      ;
+    *pp = ent->vnext;
+    ent->primary = ent->vnext = 0;
+  }
+  while (ent->variants)
+    unindex(ent->variants);
+  lru_unlink(e);
+  shm->cache_size -= ENT(e)->size;
+  shm->count--;
+  put(e);
+}
+
+/* Record that this process holds e; returns the slot, or -1 if full */
+static int hold(uint64_t e) {
+  int i;
+
+  for (i = 0; i < SHM_MAXHELD; i++)
+    if (shm->procs[me].held[i] == 0) {
+      shm->procs[me].held[i] = e;
+      return i;
+    }
+  return -1;
+}
+
+/* True if e is the offset of an entry in a block in use */
+static int valid(uint64_t e) {
+  return e >= shm->heap + 8 && e + sizeof(shent_t) <= shm->end &&
+         USED(*AT(e - 8));
+}
+
+/*
+ * consistent - check that the heap tags, the free list, the LRU list
+ *     and the hash chains all add up, after a process died holding the
+ *     lock
+ */
+static int consistent(void) {
+  uint64_t b, t, e, prev, bytes = 0;
+  long nfree = 0, n = 0;
+  int i;
+
+  for (b = shm->heap; b + MIN_BLOCK <= shm->end; b += SIZE(t)) {
+    t = TAG(b);
+    if (SIZE(t) < MIN_BLOCK || SIZE(t) > shm->end - b || FOOT(b) != t)
+      return 0;
+    nfree += !USED(t);
+  }
+  if (b != shm->end)
+    return 0;
+  for (b = shm->free, prev = 0; b; prev = b, b = FNEXT(b))
+    if (b < shm->heap || b >= shm->end || USED(TAG(b)) || FPREV(b) != prev ||
+        --nfree < 0)
+      return 0;
+  if (nfree != 0)
+    return 0;
+  for (e = shm->head, prev = 0; e; prev = e, e = ENT(e)->next) {
+    if (!valid(e) || ENT(e)->prev != prev || ++n > shm->count ||
+        (ENT(e)->primary && !valid(ENT(e)->primary)) ||
+        (ENT(e)->variants && !valid(ENT(e)->variants)) ||
+        (ENT(e)->vnext && !valid(ENT(e)->vnext)))
+      return 0;
+    bytes += ENT(e)->size;
+  }
+  if (n != shm->count || prev != shm->tail || bytes != shm->cache_size)
+    return 0;
+  for (i = 0, n = 0; i < NBUCKETS; i++)
+    for (e = shm->buckets[i]; e; e = ENT(e)->hnext)
+      if (!valid(e) || ++n > shm->count)
+        return 0;
+  return n == shm->count;
+}
+
+/* Take the lock, repairing it if its holder died */
+static void lock(void) {
+  int rc = pthread_mutex_lock(&shm->lock);
+
+  if (rc == EOWNERDEAD) {
+    if (!shm->broken && !consistent()) {
+      shm->broken = 1;
+      fprintf(stderr, "shcache: a process died in the middle of an update; "
+                      "going back to private caches\n");
+    }
+    pthread_mutex_consistent(&shm->lock);
+  } else if (rc != 0)
+    posix_error(rc, "shcache: pthread_mutex_lock error");
+}
+
+static void unlock(void) {
+  pthread_mutex_unlock(&shm->lock);
+}
+
+/*
+ * shcache_init - create the segment, or with fd >= 0, map the segment
+ *     another process created and passed on. A segment laid out by
+ *     another build of the proxy is let go of, and a new, empty one
+ *     created instead. Call it before forking the workers that are to
+ *     share it.
+ */
+void shcache_init(int fd) {
+  pthread_mutexattr_t attr;
+  uint64_t heap = ROUND(sizeof(shm_t)), size = heap + ROUND(SHM_HEAP_SIZE);
+  struct stat st;
+
+  if (fd >= 0) {
+    if (fstat(fd, &st) < 0)
+      unix_error("shcache: fstat error");
+    if ((uint64_t)st.st_size >= heap) {
+      shm = Mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (shm->magic == SHM_MAGIC && shm->version == SHM_VERSION &&
+          shm->entsize == sizeof(shent_t) && shm->heap == heap &&
+          shm->end == (uint64_t)st.st_size) {
+        base = (char *)shm;
+        shm_fd = fd;
+        return;
+      }
+      Munmap(shm, st.st_size);
+    }
+    fprintf(stderr, "shcache: the cache passed on is laid out differently; "
+                    "starting an empty one\n");
+    Close(fd);
+  }
+  if ((fd = syscall(SYS_memfd_create, "proxy-cache", 0)) < 0)
+    unix_error("shcache: memfd_create error");
+  if (ftruncate(fd, size) < 0)
+    unix_error("shcache: ftruncate error");
+  shm = Mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  base = (char *)shm;
+  shm_fd = fd;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&shm->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  shm->magic = SHM_MAGIC;
+  shm->version = SHM_VERSION;
+  shm->entsize = sizeof(shent_t);
+  shm->heap = heap;
+  shm->end = size;
+  set_tags(heap, size - heap, 0);
+  free_push(heap);
+}
+
+/*
+ * shcache_attach - take a slot in the segment for the calling process.
+ *     Returns 0, or -1 if all slots are taken, in which case the process
+ *     keeps a private cache.
+ */
+int shcache_attach(void) {
+  int i;
+
+  lock();
+  for (i = 0; i < SHM_MAXPROCS && me < 0; i++)
+    if (shm->procs[i].pid == 0) {
+      shm->procs[i].pid = getpid();
+      me = i;
+    }
+  unlock();
+  return me < 0 ? -1 : 0;
+}
+
+/*
+ * shcache_reap - let go of everything the dead process pid held.
+ *     Returns the number of entries it held.
+ */
+int shcache_reap(pid_t pid) {
+  int i, j, n = 0;
+  uint64_t e;
+
+  lock();
+  for (i = 0; i < SHM_MAXPROCS; i++) {
+    if (shm->procs[i].pid != pid)
+      continue;
+    for (j = 0; j < SHM_MAXHELD; j++)
+      if ((e = shm->procs[i].held[j]) != 0) {
+        shm->procs[i].held[j] = 0;
+        if (!shm->broken) {
+          if (ENT(e)->refreshing == pid)
+            ENT(e)->refreshing = 0;
+          put(e);
+        }
+        n++;
+      }
+    shm->procs[i].pid = 0;
+  }
+  unlock();
+  return n;
+}
+
+/* shcache_fd - return the memfd behind the segment, -1 if there is none */
+int shcache_fd(void) {
+  return shm_fd;
+}
+
+/* shcache_usable - true while this process may use the segment */
+int shcache_usable(void) {
+  return shm && me >= 0 && !shm->broken;
+}
+
+/*
+ * shcache_lookup - return a referenced object for key, or NULL on a miss.
+ *     The caller hands it back with cache_release().
+ */
+cache_obj_t *shcache_lookup(const char *key, uint64_t hash) {
+  shobj_t *so;
+  shent_t *ent;
+  uint64_t e;
+  int slot = -1;
+
+  lock();
+  shm->lookups++;
+  if (!shm->broken && (e = find(key, hash)) != 0 && (slot = hold(e)) >= 0) {
+    lru_unlink(e);
+    lru_push(e);
+    if (ENT(e)->primary) { /* Kept ahead of its variants */
+      lru_unlink(ENT(e)->primary);
+      lru_push(ENT(e)->primary);
+    }
+    ENT(e)->refcnt++;
+    shm->found++;
+  }
+  unlock();
+  if (slot < 0)
+    return NULL;
+
+  so = Malloc(sizeof(shobj_t));
+  ent = ENT(e);
+  so->off = e;
+  so->hold = slot;
+  so->obj.body = ent->size ? ent->data : NULL;
+  so->obj.store = NULL;
+  so->obj.key = ent_key(ent);
+  so->obj.hash = ent->hash;
+  so->obj.meta.status = ent->status;
+  so->obj.meta.type = so->obj.key + ent->keylen;
+  so->obj.meta.etag = so->obj.meta.type + ent->typelen;
+  so->obj.meta.lastmod = so->obj.meta.etag + ent->etaglen;
+  so->obj.meta.expires = ent->expires;
+  so->obj.meta.swr = ent->swr;
+  so->obj.meta.plain = ent->plain;
+  so->obj.size = ent->size;
+  so->obj.total = ent->total;
+  so->obj.refcnt = 1;
+  so->obj.refreshing = 0;
+  so->obj.shared = 1;
+  so->obj.hnext = so->obj.prev = so->obj.next = NULL;
+  so->obj.primary = so->obj.variants = so->obj.vnext = NULL;
+  return &so->obj;
+}
+
+/*
+ * shcache_insert - copy an object into the segment, replacing any older
+ *     copy under the same key and evicting LRU entries to make room. A
+ *     variant, with its primary entry under pkey, of hash phash, is
+ *     chained off that, or not cached if it is not there.
+ */
+void shcache_insert(const char *key, uint64_t hash, const objmeta_t *meta,
+                    const char *body, size_t size, size_t total,
+                    const char *pkey, uint64_t phash) {
+  size_t keylen = strlen(key) + 1, typelen = strlen(meta->type) + 1;
+  size_t etaglen = strlen(meta->etag) + 1;
+  size_t modlen = strlen(meta->lastmod) + 1;
+  uint64_t e = 0, old, primary;
+  shent_t *ent;
+  char *p;
+  int slot = -1;
+
+  if (size > MAX_OBJECT_SIZE)
+    return;
+
+  lock();
+  if (!shm->broken) {
+    while (shm->cache_size + size > MAX_CACHE_SIZE && shm->tail) {
+      unindex(shm->tail);
+      shm->evictions++;
+    }
+    while ((e = heap_alloc(sizeof(shent_t) + size + keylen + typelen +
+                           etaglen + modlen)) == 0 &&
+           shm->tail) {
+      unindex(shm->tail);
+      shm->evictions++;
+    }
+    if (e) { /* What reaping it would read, before it is held */
+      ent = ENT(e);
+      ent->hnext = ent->prev = ent->next = 0;
+      ent->primary = ent->variants = ent->vnext = 0;
+      ent->refcnt = 1;
+      ent->refreshing = 0;
+      if ((slot = hold(e)) < 0)
+        heap_free(e);
+    }
+  }
+  unlock();
+  if (slot < 0)
+    return;
+
+  /* Fill it in without the lock, held so that it is freed if we die */
+  ent = ENT(e);
+  ent->hash = hash;
+  ent->status = meta->status;
+  ent->swr = meta->swr;
+  ent->expires = meta->expires;
+  ent->size = size;
+  ent->total = total;
+  ent->plain = meta->plain;
+  ent->keylen = keylen;
+  ent->typelen = typelen;
+  ent->etaglen = etaglen;
+  ent->modlen = modlen;
+  p = ent->data;
+  memcpy(p, body, size);
+  memcpy(p += size, key, keylen);
+  memcpy(p += keylen, meta->type, typelen);
+  memcpy(p += typelen, meta->etag, etaglen);
+  memcpy(p + etaglen, meta->lastmod, modlen);
+
+  lock();
+  shm->procs[me].held[slot] = 0; /* The reference is now the cache's */
+  if (shm->broken) {
+    unlock();
+    return;
+  }
+  if ((old = find(key, hash)) != 0)
+    unindex(old);
+  while (shm->cache_size + size > MAX_CACHE_SIZE && shm->tail) {
+    unindex(shm->tail); /* Others got in while we were copying */
+    shm->evictions++;
+  }
+  ent->hnext = shm->buckets[hash % NBUCKETS];
+  shm->buckets[hash % NBUCKETS] = e;
+  lru_push(e);
+  shm->cache_size += size;
+  shm->count++;
+  if (pkey) {
+    primary = find(pkey, phash);
+    if (primary && ENT(primary)->total < ENT(primary)->size) {
+      ent->primary = primary;
+      ent->vnext = ENT(primary)->variants;
+      ENT(primary)->variants = e;
+      lru_unlink(primary);
+      lru_push(primary);
+    } else
+      unindex(e); /* Nothing would find it */
+  }
+  unlock();
+}
+
+/* shcache_remove - forget the entry cached under key, if any */
+void shcache_remove(const char *key, uint64_t hash) {
+  uint64_t e;
+
+  lock();
+  if (!shm->broken && (e = find(key, hash)) != 0)
+    unindex(e);
+  unlock();
+}
+
+/* shcache_refresh - mark a revalidated entry fresh until expires */
+void shcache_refresh(cache_obj_t *obj, time_t expires) {
+  lock();
+  if (!shm->broken)
+    ENT(((shobj_t *)obj)->off)->expires = expires;
+  unlock();
+}
+
+/*
+ * shcache_claim_refresh - return 1 if the caller may start refreshing
+ *     obj, 0 if a process is refreshing it already
+ */
+int shcache_claim_refresh(cache_obj_t *obj) {
+  shent_t *ent = ENT(((shobj_t *)obj)->off);
+  int claimed = 0;
+
+  lock();
+  if (!shm->broken && ent->refreshing == 0) {
+    ent->refreshing = getpid();
+    claimed = 1;
+  }
+  unlock();
+  return claimed;
+}
+
+void shcache_end_refresh(cache_obj_t *obj) {
+  lock();
+  if (!shm->broken)
+    ENT(((shobj_t *)obj)->off)->refreshing = 0;
+  unlock();
+}
+
+/* shcache_release - drop the reference behind a looked-up object */
+void shcache_release(cache_obj_t *obj) {
+  shobj_t *so = (shobj_t *)obj;
+
+  lock();
+  shm->procs[me].held[so->hold] = 0;
+  if (!shm->broken)
+    put(so->off);
+  unlock();
+  Free(so);
+}
+
+/* shcache_stats - take a consistent snapshot of the segment's occupancy */
+void shcache_stats(cache_stats_t *st) {
+  lock();
+  st->entries = shm->count;
+  st->bytes = shm->cache_size;
+  st->evictions = shm->evictions;
+  st->lookups = shm->lookups;
+  st->found = shm->found;
+  unlock();
+}
@@ -0,0 +1,34 @@
+/*
+ * shcache.h - the cache in a shared memory segment, for prefork mode
+ */
+#ifndef __SHCACHE_H__
+#define __SHCACHE_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Bytes for objects and their metadata; bodies alone are capped lower */
+#ifndef SHM_HEAP_SIZE
+#define SHM_HEAP_SIZE (4 * MAX_CACHE_SIZE)
+#endif
+
+#define SHM_MAXPROCS 64 /* Processes that may use the segment at once */
+#define SHM_MAXHELD 256 /* Entries each of them may hold at once */
+
+void shcache_init(int fd);
+int shcache_fd(void);
+int shcache_attach(void);
+int shcache_reap(pid_t pid);
+int shcache_usable(void);
+cache_obj_t *shcache_lookup(const char *key, uint64_t hash);
+void shcache_insert(const char *key, uint64_t hash, const objmeta_t *meta,
+                    const char *body, size_t size, size_t total,
+                    const char *pkey, uint64_t phash);
+void shcache_remove(const char *key, uint64_t hash);
+void shcache_refresh(cache_obj_t *obj, time_t expires);
+int shcache_claim_refresh(cache_obj_t *obj);
+void shcache_end_refresh(cache_obj_t *obj);
+void shcache_release(cache_obj_t *obj);
+void shcache_stats(cache_stats_t *st);
+
+#endif /* __SHCACHE_H__ */
@@ -0,0 +1,393 @@
+/*
+ * snapshot.c - save the cache to a file and warm it up again from one
+ *
+ * snapshot_write() writes every cached object, least recently used
+ * first, to a new file that then replaces the old one in a single
+ * rename(), so a crash halfway leaves the last good snapshot in place.
+ * The file is a header, the records, and an index:
+ *
+ *     snap_hdr_t   magic, counts, where the index is, and CRC-32s of
+ *                  itself and of the index
+ *     records      a snap_rec_t each, then the key, type, ETag and
+ *                  Last-Modified strings with their NULs, then the
+ *                  body, padded to 8 bytes; each has a CRC-32 of the
+ *                  rest of itself
+ *     index        an open-addressing hash table of nslots snap_slot_t,
+ *                  keyed by a hash of the key, giving each record's
+ *                  offset
+ *
+ * snapshot_init() maps the file and checks only the header and the
+ * index, which are small, so the proxy can start serving at once. A
+ * request that misses the cache looks its key up in the mapped index
+ * and restores that one record, if its checksum holds and it is still
+ * usable, in time to answer the request from it. Meanwhile a background
+ * thread goes through the records in file order and restores the rest,
+ * without evicting anything the proxy has cached since it started.
+ * Each record is claimed before it is restored, so it goes in at most
+ * once. When the thread is done with every record, it waits for any
+ * lookup still reading the mapping and unmaps the file.
+ */
+#include <sys/mman.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "snapshot.h"
+#include "uri.h"
+#include "vary.h"
+
+#define SNAP_MAGIC "PXSNAP02" /* Changes with the layout of the file */
+#define PAD(n) (((n) + 7) & ~(uint64_t)7)
+
+typedef struct {
+  char magic[8];
+  uint32_t count;     /* Records */
+  uint32_t nslots;    /* Index slots, a power of two */
+  uint64_t index_off; /* Offset of the index */
+  int64_t written;    /* When the snapshot was taken */
+  uint32_t index_crc; /* CRC-32 of the index */
+  uint32_t hdr_crc;   /* CRC-32 of the fields above */
+} snap_hdr_t;
+
+typedef struct {
+  uint32_t crc;     /* CRC-32 of the rest of the record */
+  uint32_t keylen;  /* String lengths, NULs included */
+  uint32_t typelen;
+  uint32_t etaglen;
+  uint32_t modlen;
+  int32_t status;
+  int32_t swr;
+  uint32_t plain; /* Body length before gzip, 0 if kept as it came */
+  int64_t expires;
+  uint64_t size;  /* Bytes of body */
+  uint64_t total; /* Length of the whole object */
+} snap_rec_t;
+
+typedef struct {
+  uint64_t off;  /* Offset of the record, 0 for an empty slot */
+  uint32_t hash; /* Of the record's key */
+  uint32_t rec;  /* Number of the record, in file order */
+} snap_slot_t;
+
+static uint32_t crc_table[256];
+
+/* The file being restored from, until the restorer is done with it */
+static char *map;
+static size_t maplen;
+static snap_hdr_t *hdr;
+static snap_slot_t *slots;
+static volatile char *claimed;   /* Per record: taken by a restore */
+static volatile int closed;      /* No more lookups in the mapping */
+static volatile long readers;    /* Lookups reading the mapping */
+static volatile long restored;   /* Records put back into the cache */
+static volatile long discarded;  /* Records stale, corrupt or unwanted */
+
+static sem_t write_mutex; /* One snapshot_write() at a time */
+
+void *restorer(void *vargp);
+
+static uint32_t crc32(uint32_t crc, const void *buf, size_t n) {
+  const unsigned char *p = buf;
+
+  crc = ~crc;
+  while (n--)
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t hash(const char *key) {
+  uint32_t h = 2166136261u; /* FNV-1a */
+
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+ * record - return the record at off if it lies wholly before the index
+ *     and its strings are terminated where they say, or NULL
+ */
+static snap_rec_t *record(uint64_t off) {
+  snap_rec_t *r = (snap_rec_t *)(map + off);
+  char *s;
+  uint64_t len;
+
+  if (off < sizeof(snap_hdr_t) || off % 8 ||
+      off + sizeof(snap_rec_t) > hdr->index_off)
+    return NULL;
+  len = (uint64_t)r->keylen + r->typelen + r->etaglen + r->modlen + r->size;
+  if (r->keylen == 0 || r->typelen == 0 || r->etaglen == 0 ||
+      r->modlen == 0 || len > hdr->index_off - off - sizeof(snap_rec_t))
+    return NULL;
+  s = (char *)(r + 1);
+  if (s[r->keylen - 1] || s[r->keylen + r->typelen - 1] ||
+      s[r->keylen + r->typelen + r->etaglen - 1] ||
+      s[r->keylen + r->typelen + r->etaglen + r->modlen - 1])
+    return NULL;
+  return r;
+}
+
+static uint64_t record_len(snap_rec_t *r) {
+  return PAD(sizeof(snap_rec_t) + r->keylen + r->typelen + r->etaglen +
+             r->modlen + r->size);
+}
+
+static int restore_key(const char *key, int evict);
+
+/*
+ * restore - restore record number rec, at off, unless another restore
+ *     has claimed it already. The primary entry of a variant is restored
+ *     first, if it is in the file too. Returns 1 if it went into the
+ *     cache.
+ */
+static int restore(uint32_t rec, uint64_t off, int evict) {
+  snap_rec_t *r;
+  objmeta_t meta;
+  char *key, *pkey;
+  size_t n;
+
+  if (rec >= hdr->count || !__sync_bool_compare_and_swap(&claimed[rec], 0, 1))
+    return 0;
+  if ((r = record(off)) == NULL ||
+      r->crc != crc32(0, (char *)r + 4, record_len(r) - 4) ||
+      time(NULL) >= r->expires + r->swr) {
+    __sync_fetch_and_add(&discarded, 1);
+    return 0;
+  }
+  key = (char *)(r + 1);
+  if ((n = vary_primary(key)) > 0) {
+    pkey = Malloc(n + 1);
+    memcpy(pkey, key, n);
+    pkey[n] = '\0';
+    restore_key(pkey, evict);
+    Free(pkey);
+  }
+  meta.status = r->status;
+  meta.type = key + r->keylen;
+  meta.etag = meta.type + r->typelen;
+  meta.lastmod = meta.etag + r->etaglen;
+  meta.expires = r->expires;
+  meta.swr = r->swr;
+  meta.plain = r->plain;
+  if (!cache_restore(key, uri_hash(key), &meta, meta.lastmod + r->modlen,
+                     r->size, r->total, evict)) {
+    __sync_fetch_and_add(&discarded, 1);
+    return 0;
+  }
+  __sync_fetch_and_add(&restored, 1);
+  return 1;
+}
+
+/*
+ * snapshot_init - start warming the cache up from the snapshot at path,
+ *     if there is a valid one. Call it before the cache is used.
+ */
+void snapshot_init(const char *path) {
+  struct stat st;
+  pthread_t tid;
+  uint32_t i, j, c;
+  int fd;
+
+  for (i = 0; i < 256; i++) {
+    for (c = i, j = 0; j < 8; j++)
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+  Sem_init(&write_mutex, 0, 1);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snap_hdr_t) ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+          MAP_FAILED) {
+    map = NULL;
+    close(fd);
+    return;
+  }
+  close(fd);
+  maplen = st.st_size;
+  hdr = (snap_hdr_t *)map;
+  slots = (snap_slot_t *)(map + hdr->index_off);
+  if (memcmp(hdr->magic, SNAP_MAGIC, 8)) {
+    fprintf(stderr, "snapshot: ignoring %s, it is not from this version\n",
+            path);
+    munmap(map, maplen);
+    map = NULL;
+    return;
+  }
+  if (hdr->hdr_crc != crc32(0, hdr, offsetof(snap_hdr_t, hdr_crc)) ||
+      hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) ||
+      hdr->index_off > maplen ||
+      (maplen - hdr->index_off) / sizeof(snap_slot_t) < hdr->nslots ||
+      hdr->index_crc !=
+          crc32(0, slots, (size_t)hdr->nslots * sizeof(snap_slot_t))) {
+    fprintf(stderr, "snapshot: ignoring %s, it is damaged\n", path);
+    munmap(map, maplen);
+    map = NULL;
+    return;
+  }
+  claimed = Calloc(hdr->count + 1, 1);
+  Pthread_create(&tid, NULL, restorer, NULL);
+}
+
+/*
+ * snapshot_restore - restore key from the snapshot, if it is there and
+ *     has not been restored already. Returns 1 if it is now cached.
+ */
+int snapshot_restore(const char *key) {
+  int rc = 0;
+
+  if (closed || map == NULL)
+    return 0;
+  __sync_fetch_and_add(&readers, 1);
+  if (!closed)
+    rc = restore_key(key, 1);
+  __sync_fetch_and_sub(&readers, 1);
+  return rc;
+}
+
+/*
+ * restore_key - restore the record for key, if the file has one. The
+ *     caller keeps the file mapped. Returns 1 if it went into the cache.
+ */
+static int restore_key(const char *key, int evict) {
+  uint32_t h = hash(key), i, mask = hdr->nslots - 1;
+  snap_rec_t *r;
+
+  for (i = h & mask; slots[i].off; i = (i + 1) & mask)
+    if (slots[i].hash == h && (r = record(slots[i].off)) != NULL &&
+        !strcmp((char *)(r + 1), key))
+      return restore(slots[i].rec, slots[i].off, evict);
+  return 0;
+}
+
+/*
+ * restorer - restore every record no lookup has asked for yet, in file
+ *     order, then let go of the file
+ */
+void *restorer(void *vargp) {
+  uint64_t off = sizeof(snap_hdr_t);
+  snap_rec_t *r;
+  uint32_t rec;
+
+  Pthread_detach(pthread_self());
+  for (rec = 0; rec < hdr->count && (r = record(off)) != NULL; rec++) {
+    restore(rec, off, 0);
+    off += record_len(r);
+  }
+  closed = 1;
+  while (readers > 0)
+    usleep(1000);
+  munmap(map, maplen);
+  map = NULL;
+  return NULL;
+}
+
+/*
+ * snapshot_write - save the cache to path. Returns the number of objects
+ *     written, or -1 on error, in which case any earlier snapshot at path
+ *     is left as it was.
+ */
+int snapshot_write(const char *path) {
+  static const char zeros[8];
+  char tmp[MAXLINE];
+  cache_obj_t **objs, *obj;
+  snap_hdr_t h;
+  snap_rec_t r;
+  snap_slot_t *index = NULL;
+  uint64_t off = sizeof(snap_hdr_t), len;
+  uint32_t i, j, mask, nslots = 1;
+  time_t now = time(NULL);
+  int n, written = 0, ok;
+  FILE *fp;
+
+  P(&write_mutex);
+  objs = cache_hold_all(&n);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    fprintf(stderr, "snapshot: could not create %s: %s\n", tmp,
+            strerror(errno));
+    written = -1;
+    goto done;
+  }
+  while (nslots < 2 * (uint32_t)n + 1)
+    nslots <<= 1;
+  mask = nslots - 1;
+  index = Calloc(nslots, sizeof(snap_slot_t));
+  memset(&h, 0, sizeof(h));
+  ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+
+  for (i = 0; i < (uint32_t)n && ok; i++) {
+    obj = objs[i];
+    if (!CACHE_USABLE(obj, now))
+      continue; /* Of no use to a restart */
+    memset(&r, 0, sizeof(r));
+    r.keylen = strlen(obj->key) + 1;
+    r.typelen = strlen(obj->meta.type) + 1;
+    r.etaglen = strlen(obj->meta.etag) + 1;
+    r.modlen = strlen(obj->meta.lastmod) + 1;
+    r.status = obj->meta.status;
+    r.swr = obj->meta.swr;
+    r.expires = obj->meta.expires;
+    r.size = obj->size;
+    r.total = obj->total;
+    r.plain = obj->meta.plain;
+    len = sizeof(r) + r.keylen + r.typelen + r.etaglen + r.modlen + r.size;
+    r.crc = crc32(0, (char *)&r + 4, sizeof(r) - 4);
+    r.crc = crc32(r.crc, obj->key, r.keylen);
+    r.crc = crc32(r.crc, obj->meta.type, r.typelen);
+    r.crc = crc32(r.crc, obj->meta.etag, r.etaglen);
+    r.crc = crc32(r.crc, obj->meta.lastmod, r.modlen);
+    r.crc = crc32(r.crc, obj->body, r.size);
+    r.crc = crc32(r.crc, zeros, PAD(len) - len);
+    ok = fwrite(&r, sizeof(r), 1, fp) == 1 &&
+         fwrite(obj->key, r.keylen, 1, fp) == 1 &&
+         fwrite(obj->meta.type, r.typelen, 1, fp) == 1 &&
+         fwrite(obj->meta.etag, r.etaglen, 1, fp) == 1 &&
+         fwrite(obj->meta.lastmod, r.modlen, 1, fp) == 1 &&
+         (r.size == 0 || fwrite(obj->body, r.size, 1, fp) == 1) &&
+         (PAD(len) == len || fwrite(zeros, PAD(len) - len, 1, fp) == 1);
+
+    for (j = hash(obj->key) & mask; index[j].off; j = (j + 1) & mask)
+      ;
+    index[j].off = off;
+    index[j].hash = hash(obj->key);
+    index[j].rec = written++;
+    off += PAD(len);
+  }
+
+  memcpy(h.magic, SNAP_MAGIC, 8);
+  h.count = written;
+  h.nslots = nslots;
+  h.index_off = off;
+  h.written = now;
+  h.index_crc = crc32(0, index, (size_t)nslots * sizeof(snap_slot_t));
+  h.hdr_crc = crc32(0, &h, offsetof(snap_hdr_t, hdr_crc));
+  ok = ok && fwrite(index, sizeof(snap_slot_t), nslots, fp) == nslots &&
+       fseek(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, fp) == 1 &&
+       fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0) {
+    fprintf(stderr, "snapshot: could not write %s: %s\n", path,
+            strerror(errno));
+    unlink(tmp);
+    written = -1;
+  }
+
+done:
+  for (i = 0; i < (uint32_t)n; i++)
+    cache_release(objs[i]);
+  Free(objs);
+  if (index)
+    Free(index);
+  V(&write_mutex);
+  return written;
+}
+
+/*
+ * snapshot_stats - store the number of records restored so far, and of
+ *     those that were stale, damaged or already cached
+ */
+void snapshot_stats(long *r, long *d) {
+  *r = restored;
+  *d = discarded;
+}
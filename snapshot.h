@@ -0,0 +1,15 @@
+/*
+ * snapshot.h - save the cache to a file and warm it up again from one
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+void snapshot_init(const char *path);
+int snapshot_write(const char *path);
+int snapshot_restore(const char *key);
+void snapshot_stats(long *restored, long *discarded);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,69 @@
+/*
+ * stackuse.c - measure how deep a thread's stack has reached
+ *
+ * stack_paint() fills the unused part of the calling thread's stack,
+ * from its lowest address up to a little below the caller's frame,
+ * with a known pattern. stack_used() finds the lowest word that no
+ * longer holds the pattern, which is as deep as the stack has reached
+ * since, and paints what was used again for the next measurement.
+ * Depths are counted from the top of the thread's stack block, so they
+ * include the thread's start-up frames and its TLS, everything that
+ * counts against the stack size it was created with.
+ *
+ * A function that declares an array and never writes to the bottom of
+ * it goes unnoticed, so the result is a lower bound, if a close one.
+ * Only the top STACK_AUDIT_SPAN bytes of a larger stack are painted.
+ * Painting touches every page of that span, and finding the low point
+ * reads the unused part of it, so this is for audits, not for serving
+ * at full speed.
+ */
+#define _GNU_SOURCE /* For pthread_getattr_np(); csapp.h would clash with it */
+#include <stddef.h>
+#include <pthread.h>
+#include "stackuse.h"
+
+#define PATTERN 0xa5a5a5a5a5a5a5a5UL
+#define MARGIN 1024 /* Left alone below the frame doing the painting */
+
+static __thread unsigned long *lo; /* Lowest word painted */
+static __thread char *hi;          /* Top of the stack block */
+
+/* Paint from p up to MARGIN below frame */
+static void paint(unsigned long *p, char *frame) {
+  while ((char *)(p + 1) <= frame - MARGIN)
+    *p++ = PATTERN;
+}
+
+/* stack_paint - start measuring the calling thread's stack */
+void __attribute__((noinline)) stack_paint(void) {
+  pthread_attr_t attr;
+  void *addr;
+  size_t size;
+
+  if (pthread_getattr_np(pthread_self(), &attr) != 0)
+    return;
+  pthread_attr_getstack(&attr, &addr, &size);
+  pthread_attr_destroy(&attr);
+  hi = (char *)addr + size;
+  if (size > STACK_AUDIT_SPAN)
+    addr = hi - STACK_AUDIT_SPAN;
+  lo = (unsigned long *)(((unsigned long)addr + 7) & ~7UL);
+  paint(lo, __builtin_frame_address(0));
+}
+
+/*
+ * stack_used - return the most bytes of stack the calling thread has
+ *     used since the last call, or since stack_paint(), and start over.
+ *     Returns 0 if the stack was never painted.
+ */
+long __attribute__((noinline)) stack_used(void) {
+  unsigned long *p;
+  char *frame = __builtin_frame_address(0);
+
+  if (lo == NULL)
+    return 0;
+  for (p = lo; (char *)p < frame - MARGIN && *p == PATTERN; p++)
+    ;
+  paint(p, frame);
+  return hi - (char *)p;
+}
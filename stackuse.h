@@ -0,0 +1,15 @@
+/*
+ * stackuse.h - measure how deep a thread's stack has reached
+ */
+#ifndef __STACKUSE_H__
+#define __STACKUSE_H__
+
+/* Deepest part of a stack that is painted and checked */
+#ifndef STACK_AUDIT_SPAN
+#define STACK_AUDIT_SPAN (1024 * 1024)
+#endif
+
+void stack_paint(void);
+long stack_used(void);
+
+#endif /* __STACKUSE_H__ */
@@ -0,0 +1,69 @@
+/*
+ * stats.c - per-thread event counters for the proxy
+ *
+ * Each thread counts into its own cache-line aligned block, so counting
+ * an event is a plain increment that never bounces a line between
+ * cores. The blocks are linked on a global list when a thread counts
+ * its first event, and summed only when someone asks for the totals.
+ * A sum taken while threads are counting may miss their latest events,
+ * but every counter it reads is a whole, aligned word.
+ */
+#include "stats.h"
+
+#define LINE 64
+
+typedef struct stat_set {
+  long v[NSTATS];
+  struct stat_set *next;
+} stat_set_t;
+
+const char *stat_names[NSTATS] = {
+    "accepted",       "closed",          "requests",       "hits",
+    "stale_hits",     "negative_hits",   "fast_hits",      "disk_hits",
+    "gzip_hits",      "gunzips",         "variant_hits",   "misses",
+    "door_skips",     "origin_connects", "cooldown_skips", "ip_rejects",
+    "header_rejects", "shed",            "shed_stale",     "peer_fetches",
+    "peer_failures",  "lookups",         "lookup_hits",
+};
+
+static __thread stat_set_t *mine; /* This thread's counters */
+static stat_set_t *sets;          /* All threads' counters */
+static sem_t mutex;               /* Protects the list, not the counts */
+
+void stats_init(void) {
+  Sem_init(&mutex, 0, 1);
+}
+
+/* stats_inc - count one event of kind stat for the calling thread */
+void stats_inc(int stat) {
+  int rc;
+
+  if (!mine) {
+    /* Round up to whole lines so no two threads share one */
+    if ((rc = posix_memalign((void **)&mine, LINE,
+                             (sizeof(stat_set_t) + LINE - 1) / LINE * LINE)))
+      posix_error(rc, "posix_memalign error");
+    memset(mine, 0, sizeof(stat_set_t));
+    P(&mutex);
+    mine->next = sets;
+    sets = mine;
+    V(&mutex);
+  }
+  mine->v[stat]++;
+}
+
+/*
+ * stats_sum - store every counter, summed over all threads, in
+ *     totals[NSTATS]
+ */
+void stats_sum(long *totals) {
+  stat_set_t *set;
+  int i;
+
+  memset(totals, 0, NSTATS * sizeof(long));
+  P(&mutex);
+  for (set = sets; set; set = set->next)
+    for (i = 0; i < NSTATS; i++)
+      totals[i] += ((volatile long *)set->v)[i];
+  V(&mutex);
+}
@@ -0,0 +1,41 @@
+/*
+ * stats.h - per-thread event counters for the proxy
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+enum {
+  ST_ACCEPTED,        /* Client connections accepted */
+  ST_CLOSED,          /* Client connections finished */
+  ST_REQUESTS,        /* Requests parsed */
+  ST_HITS,            /* Requests answered from the cache */
+  ST_STALE_HITS,      /* ... of which with a stale copy */
+  ST_NEGATIVE_HITS,   /* ... of which with a cached error */
+  ST_FAST_HITS,       /* ... of which on the accepting thread */
+  ST_DISK_HITS,       /* ... of which from the disk tier */
+  ST_GZIP_HITS,       /* ... of which sent gzipped as cached */
+  ST_GUNZIPS,         /* ... of which inflated from a gzipped copy */
+  ST_VARIANT_HITS,    /* ... of which on a variant of a varying URI */
+  ST_MISSES,          /* Requests sent on to the origin */
+  ST_DOOR_SKIPS,      /* ... of which not cached, first seen */
+  ST_ORIGIN_CONNECTS, /* Connections opened to origin servers */
+  ST_COOLDOWN_SKIPS,  /* Connects skipped, origin marked down */
+  ST_IP_REJECTS,      /* Connections refused, client at its limit */
+  ST_HEADER_REJECTS,  /* Requests refused, header too large */
+  ST_SHED,            /* Requests refused, origin limit reached */
+  ST_SHED_STALE,      /* Revalidations shed, stale copy served */
+  ST_PEER_FETCHES,    /* Misses fetched from the peer that owns them */
+  ST_PEER_FAILURES,   /* ... that went to the origin instead */
+  ST_LOOKUPS,         /* Cache lookups, hits or not */
+  ST_LOOKUP_HITS,     /* ... of which found an object */
+  NSTATS
+};
+
+void stats_init(void);
+void stats_inc(int stat);
+void stats_sum(long *totals);
+extern const char *stat_names[NSTATS];
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,331 @@
+/*
+ * synth.c - Synthetic origin server for benchmarking the proxy
+ *
+ * Answers every GET with a generated body, shaped by a response spec.
+ * The command line sets the default spec, and any request can override
+ * it for itself in its query string:
+ *
+ *     size=N      body length in bytes
+ *     ttfb=MS     delay before the response header is sent
+ *     rate=BPS    throttle the body to BPS bytes per second
+ *     chunked=0|1 chunked transfer coding instead of Content-Length
+ *     reset=P     with probability P, reset the connection halfway
+ *                 through the body
+ *     status=N    response status code
+ *     maxage=N    send Cache-Control: max-age=N
+ *     vary=0|1    send Vary: Accept-Encoding, and gzip the body for
+ *                 clients that accept gzip
+ *
+ * e.g. GET /big?size=1000000&rate=100000. Byte i of a body is
+ * 'a' + i % 26, so a client can check what it got. A gzipped body is
+ * those bytes compressed, and is sent whole with a Content-Length:
+ * chunked, rate and reset do not apply to it.
+ *
+ * With -C n, at most n requests are served at a time, from the start
+ * of the TTFB delay to the end of the body, and the others wait their
+ * turn, so that latency grows with load as it does on an origin that
+ * has run out of capacity.
+ *
+ * With -k, connections from clients that ask for keep-alive (HTTP/1.1
+ * without "Connection: close", or HTTP/1.0 with "Connection:
+ * keep-alive") are kept open for further requests. Each connection is
+ * served by its own thread. Random resets draw from a generator seeded
+ * with -S and the connection's sequence number, so a run is
+ * reproducible for a given order of connections.
+ */
+#include "csapp.h"
+#include "gzip.h"
+
+#define SLICE_MS 10 /* Granularity of throttled writes */
+
+typedef struct {
+  long size;    /* Body length */
+  int ttfb;     /* ms before the header */
+  long rate;    /* Body bytes/s, 0 for unthrottled */
+  int chunked;  /* Chunked instead of Content-Length */
+  double reset; /* Probability of a reset halfway through the body */
+  int status;   /* Status code */
+  int maxage;   /* Cache-Control max-age, -1 for none */
+  int vary;     /* Vary on Accept-Encoding, and gzip if accepted */
+} spec_t;
+
+typedef struct {
+  int fd;
+  unsigned short xsubi[3]; /* erand48() state */
+} conn_t;
+
+static spec_t defaults = {1024, 0, 0, 0, 0, 200, -1, 0};
+static int keepalive;       /* -k: honour keep-alive requests */
+static unsigned seed;       /* -S: seed for random resets */
+static unsigned long nconn; /* Connections accepted so far */
+static int capacity;        /* -C: requests served at once, 0: any */
+static sem_t service;       /* Free places when capacity is set */
+
+void *serve_conn(void *vargp);
+int serve_request(conn_t *c, rio_t *rp);
+void parse_query(char *uri, spec_t *sp);
+int send_body(int fd, spec_t *sp, int reset);
+long gzip_body(spec_t *sp, char **packed);
+void pace(int64_t start, long sent, long rate);
+int64_t now_ns(void);
+void hard_reset(int fd);
+
+int main(int argc, char **argv) {
+  int listenfd, c;
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+  conn_t *conn;
+  pthread_t tid;
+
+  while ((c = getopt(argc, argv, "s:t:r:ce:m:kS:C:")) != -1) {
+    switch (c) {
+    case 's': /* Default body size */
+      defaults.size = atol(optarg);
+      break;
+    case 't': /* Default TTFB delay in ms */
+      defaults.ttfb = atoi(optarg);
+      break;
+    case 'r': /* Default throttle in bytes/s */
+      defaults.rate = atol(optarg);
+      break;
+    case 'c': /* Chunked by default */
+      defaults.chunked = 1;
+      break;
+    case 'e': /* Default reset probability */
+      defaults.reset = atof(optarg);
+      break;
+    case 'm': /* Default max-age */
+      defaults.maxage = atoi(optarg);
+      break;
+    case 'k': /* Allow keep-alive */
+      keepalive = 1;
+      break;
+    case 'S': /* Random seed */
+      seed = atoi(optarg);
+      break;
+    case 'C': /* Requests served at once */
+      capacity = atoi(optarg);
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr,
+            "usage: %s [-s size] [-t ttfb_ms] [-r bytes/s] [-c] [-e reset_p] "
+            "[-m maxage] [-k] [-S seed] [-C capacity] <port>\n",
+            argv[0]);
+    exit(1);
+  }
+
+  Signal(SIGPIPE, SIG_IGN);
+  if (capacity > 0)
+    Sem_init(&service, 0, capacity);
+  listenfd = Open_listenfd(argv[optind]);
+  while (1) {
+    clientlen = sizeof(clientaddr);
+    conn = Malloc(sizeof(conn_t));
+    if ((conn->fd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+      Free(conn);
+      continue;
+    }
+    conn->xsubi[0] = seed;
+    conn->xsubi[1] = nconn;
+    conn->xsubi[2] = nconn++ >> 16;
+    Pthread_create(&tid, NULL, serve_conn, conn);
+  }
+}
+
+void *serve_conn(void *vargp) {
+  conn_t *c = vargp;
+  rio_t rio;
+
+  Pthread_detach(pthread_self());
+  rio_readinitb(&rio, c->fd);
+  while (serve_request(c, &rio) > 0)
+    ;
+  close(c->fd);
+  Free(c);
+  return NULL;
+}
+
+/*
+ * serve_request - read one request and answer it. Returns 1 if the
+ *     connection may carry another request, 0 or -1 if it is done.
+ */
+int serve_request(conn_t *c, rio_t *rp) {
+  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  char hdr[MAXBUF], *p, *packed = NULL;
+  int n, keep, reset, gzip_ok = 0;
+  long plen = 0;
+  spec_t spec = defaults;
+
+  if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+    return 0;
+  if (sscanf(buf, "%s %s %s", method, uri, version) != 3)
+    return -1;
+  keep = keepalive && !strcmp(version, "HTTP/1.1");
+  while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n")) {
+    if (!strncasecmp(buf, "Connection:", 11) && keepalive) {
+      for (p = buf + 11; *p; p++)
+        *p = tolower(*p);
+      if (strstr(buf + 11, "close"))
+        keep = 0;
+      else if (strstr(buf + 11, "keep-alive"))
+        keep = 1;
+    }
+    if (!strncasecmp(buf, "Accept-Encoding:", 16))
+      gzip_ok = gzip_accepted(buf);
+  }
+  if (n <= 0)
+    return -1;
+  parse_query(uri, &spec);
+  if (spec.vary && gzip_ok)
+    plen = gzip_body(&spec, &packed);
+
+  if (capacity > 0)
+    P(&service);
+  if (spec.ttfb > 0)
+    usleep(spec.ttfb * 1000);
+  n = sprintf(hdr, "HTTP/1.1 %d Synthetic\r\n", spec.status);
+  n += sprintf(hdr + n, "Server: synth\r\n");
+  n += sprintf(hdr + n, "Content-Type: application/octet-stream\r\n");
+  if (packed)
+    n += sprintf(hdr + n, "Content-Encoding: gzip\r\n"
+                          "Content-Length: %ld\r\n", plen);
+  else if (spec.chunked)
+    n += sprintf(hdr + n, "Transfer-Encoding: chunked\r\n");
+  else
+    n += sprintf(hdr + n, "Content-Length: %ld\r\n", spec.size);
+  if (spec.vary)
+    n += sprintf(hdr + n, "Vary: Accept-Encoding\r\n");
+  if (spec.maxage >= 0)
+    n += sprintf(hdr + n, "Cache-Control: max-age=%d\r\n", spec.maxage);
+  n += sprintf(hdr + n, "Connection: %s\r\n\r\n",
+               keep ? "keep-alive" : "close");
+  reset = spec.reset > 0 && erand48(c->xsubi) < spec.reset;
+  if (rio_writen(c->fd, hdr, n) != n)
+    keep = -1;
+  else if (packed ? rio_writen(c->fd, packed, plen) != plen
+                  : send_body(c->fd, &spec, reset) < 0)
+    keep = -1;
+  if (capacity > 0)
+    V(&service);
+  Free(packed);
+  return keep;
+}
+
+/* parse_query - override fields of sp from uri's query string */
+void parse_query(char *uri, spec_t *sp) {
+  char *q, *kv, *save, *val;
+
+  if ((q = strchr(uri, '?')) == NULL)
+    return;
+  for (kv = strtok_r(q + 1, "&", &save); kv; kv = strtok_r(NULL, "&", &save)) {
+    if ((val = strchr(kv, '=')) == NULL)
+      continue;
+    *val++ = '\0';
+    if (!strcmp(kv, "size"))
+      sp->size = atol(val);
+    else if (!strcmp(kv, "ttfb"))
+      sp->ttfb = atoi(val);
+    else if (!strcmp(kv, "rate"))
+      sp->rate = atol(val);
+    else if (!strcmp(kv, "chunked"))
+      sp->chunked = atoi(val);
+    else if (!strcmp(kv, "reset"))
+      sp->reset = atof(val);
+    else if (!strcmp(kv, "status"))
+      sp->status = atoi(val);
+    else if (!strcmp(kv, "maxage"))
+      sp->maxage = atoi(val);
+    else if (!strcmp(kv, "vary"))
+      sp->vary = atoi(val);
+  }
+}
+
+/*
+ * send_body - write sp->size generated bytes, framed as sp says and
+ *     paced to sp->rate. If reset is set, the connection is reset once
+ *     half of the body is out. Returns 0 on success, -1 otherwise.
+ */
+int send_body(int fd, spec_t *sp, int reset) {
+  char buf[MAXBUF + 16];
+  long sent = 0, piece, cut = reset ? sp->size / 2 : -1;
+  int64_t start = now_ns();
+  int i, n, off;
+
+  piece = MAXBUF;
+  if (sp->rate > 0 && sp->rate * SLICE_MS / 1000 < piece)
+    piece = sp->rate * SLICE_MS / 1000 > 0 ? sp->rate * SLICE_MS / 1000 : 1;
+
+  while (sent < sp->size) {
+    n = sp->size - sent < piece ? sp->size - sent : piece;
+    if (cut >= 0 && sent + n > cut)
+      n = cut - sent;
+    if (cut >= 0 && n == 0) {
+      hard_reset(fd);
+      return -1;
+    }
+    off = sp->chunked ? sprintf(buf, "%x\r\n", n) : 0;
+    for (i = 0; i < n; i++)
+      buf[off + i] = 'a' + (sent + i) % 26;
+    off += n;
+    if (sp->chunked)
+      off += sprintf(buf + off, "\r\n");
+    if (rio_writen(fd, buf, off) != off)
+      return -1;
+    sent += n;
+    if (sp->rate > 0)
+      pace(start, sent, sp->rate);
+  }
+  if (cut >= 0) {
+    hard_reset(fd);
+    return -1;
+  }
+  if (sp->chunked && rio_writen(fd, "0\r\n\r\n", 5) != 5)
+    return -1;
+  return 0;
+}
+
+/*
+ * gzip_body - gzip the sp->size bytes of the body into a buffer that
+ *     the caller frees, and point *packed at it. Returns its length.
+ */
+long gzip_body(spec_t *sp, char **packed) {
+  char *body = Malloc(sp->size + 1);
+  long i, n, room = sp->size + sp->size / 1000 + 1024;
+
+  for (i = 0; i < sp->size; i++)
+    body[i] = 'a' + i % 26;
+  *packed = Malloc(room);
+  if ((n = gzip_pack(body, sp->size, *packed, room)) < 0)
+    app_error("gzip_body: gzip_pack failed");
+  Free(body);
+  return n;
+}
+
+/* pace - sleep until sent bytes are due at rate bytes/s since start */
+void pace(int64_t start, long sent, long rate) {
+  int64_t due = start + (int64_t)((double)sent / rate * 1e9), now = now_ns();
+
+  if (due > now)
+    usleep((due - now) / 1000);
+}
+
+int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * hard_reset - abort the connection with a RST instead of a FIN. The
+ *     caller still closes fd.
+ */
+void hard_reset(int fd) {
+  struct linger lg = {1, 0};
+
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
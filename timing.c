@@ -0,0 +1,74 @@
+/*
+ * timing.c - per-phase latency accounting for proxied requests
+ *
+ * Every thread that finishes requests records their phase durations
+ * into its own set of histograms, so the request path never touches a
+ * cache line that another thread writes. The sets are linked on a
+ * global list when a thread records its first request, and merged only
+ * when someone asks for a report.
+ */
+#include "timing.h"
+
+typedef struct phase_set {
+  hist_t phases[NPHASES];
+  struct phase_set *next;
+} phase_set_t;
+
+const char *phase_names[NPHASES] = {
+    "parse", "dns", "connect", "send", "ttfb", "transfer", "client", "total",
+};
+
+static __thread phase_set_t *mine; /* This thread's histograms */
+static phase_set_t *sets;          /* All threads' histograms */
+static sem_t mutex;                /* Protects the list, not the sets */
+
+void timing_init(void) {
+  Sem_init(&mutex, 0, 1);
+}
+
+int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * timing_record - account for a finished request's stamps in the
+ *     calling thread's histograms
+ */
+void timing_record(stamps_t s) {
+  int i, prev;
+
+  if (!mine) {
+    mine = Calloc(1, sizeof(phase_set_t));
+    P(&mutex);
+    mine->next = sets;
+    sets = mine;
+    V(&mutex);
+  }
+  if (!s[T_ACCEPT] || !s[T_DONE])
+    return;
+
+  for (prev = T_ACCEPT, i = T_ACCEPT + 1; i < NSTAMPS; i++) {
+    if (!s[i] || s[i] < s[prev])
+      continue;
+    hist_record(&mine->phases[i - 1], s[i] - s[prev]);
+    prev = i;
+  }
+  hist_record(&mine->phases[PH_TOTAL], s[T_DONE] - s[T_ACCEPT]);
+}
+
+/*
+ * timing_merge - add every thread's histograms into phases[NPHASES]
+ */
+void timing_merge(hist_t *phases) {
+  phase_set_t *set;
+  int i;
+
+  P(&mutex);
+  for (set = sets; set; set = set->next)
+    for (i = 0; i < NPHASES; i++)
+      hist_merge(&phases[i], &set->phases[i]);
+  V(&mutex);
+}
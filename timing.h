@@ -0,0 +1,51 @@
+/*
+ * timing.h - per-phase latency accounting for proxied requests
+ */
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include "csapp.h"
+#include "hist.h"
+
+/* Points in the life of a request, stamped in CLOCK_MONOTONIC ns */
+enum {
+  T_ACCEPT,    /* Connection accepted */
+  T_PARSED,    /* Request line and headers parsed */
+  T_RESOLVED,  /* Origin name resolved */
+  T_CONNECTED, /* Origin connection established */
+  T_SENT,      /* Request written to the origin */
+  T_FIRSTBYTE, /* Origin response header received */
+  T_LASTBYTE,  /* Origin response body received */
+  T_DONE,      /* Response written to the client */
+  NSTAMPS
+};
+
+/*
+ * Phase i is the time from the previous stamp that was set to stamp
+ * i + 1, so a cache hit, which skips the origin stamps, charges its
+ * whole write to the client phase. PH_TOTAL runs from accept to done.
+ */
+enum {
+  PH_PARSE,    /* Queueing for a worker and reading the request */
+  PH_DNS,      /* getaddrinfo() */
+  PH_CONNECT,  /* connect() */
+  PH_SEND,     /* Writing the request to the origin */
+  PH_TTFB,     /* Waiting for the origin's response header */
+  PH_TRANSFER, /* Receiving the response body */
+  PH_CLIENT,   /* Finishing the write to the client */
+  PH_TOTAL,
+  NPHASES
+};
+
+typedef int64_t stamps_t[NSTAMPS];
+
+/* Set stamp i unless an earlier event already did */
+#define STAMP(s, i) ((s)[i] ? (void)0 : (void)((s)[i] = now_ns()))
+
+void timing_init(void);
+int64_t now_ns(void);
+void timing_record(stamps_t s);
+void timing_merge(hist_t *phases);
+extern const char *phase_names[NPHASES];
+
+#endif /* __TIMING_H__ */
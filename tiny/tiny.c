@@ -5,13 +5,42 @@
  *
  * Updated 11/2019 droh
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
+ *
+ * Static content honors "Range: bytes=..." requests. A single range is
+ * answered with a 206 and a Content-Range header, several ranges with
+ * a multipart/byteranges body.
+ *
+ * Static responses carry an ETag and a Last-Modified header derived from
+ * the file's stat() mtime and size, and conditional requests whose
+ * If-None-Match or If-Modified-Since still match get a 304.
  */
+#define _XOPEN_SOURCE 700 /* strptime() */
+#define _DEFAULT_SOURCE   /* timegm(), and what csapp.h relies on */
 #include "csapp.h"
 
+#define MAXRANGES 16                  /* More ranges than this get a 200 */
+#define BOUNDARY "TINY_BYTERANGE_SEP" /* multipart/byteranges separator */
+
+/* Request headers that tiny acts upon, "" when absent */
+typedef struct {
+  char range[MAXLINE];             /* Range */
+  char if_none_match[MAXLINE];     /* If-None-Match */
+  char if_modified_since[MAXLINE]; /* If-Modified-Since */
+} reqhdrs_t;
+
+/* One resolved byte range, inclusive on both ends */
+typedef struct {
+  long first;
+  long last;
+} byterange_t;
+
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void read_requesthdrs(rio_t *rp, reqhdrs_t *hdrs);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, struct stat *sbuf, reqhdrs_t *hdrs);
+int parse_range(char *range, long filesize, byterange_t *ranges);
+void make_validators(struct stat *sbuf, char *etag, char *lastmod);
+int not_modified(reqhdrs_t *hdrs, struct stat *sbuf, char *etag);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
@@ -41,3 +70,435 @@ int main(int argc, char **argv) {
     Close(connfd);  // line:netp:tiny:close
   }
 }
+/* $end tinymain */
+
+/*
+ * doit - handle one HTTP request/response transaction
+ */
+/* $begin doit */
+void doit(int fd) {
+  int is_static;
+  struct stat sbuf;
+  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  char filename[MAXLINE], cgiargs[MAXLINE];
+  reqhdrs_t hdrs;
+  rio_t rio;
+
+  /* Read request line and headers */
+  Rio_readinitb(&rio, fd);
+  if (!Rio_readlineb(&rio, buf, MAXLINE))  // line:netp:doit:readrequest
+    return;
+  printf("%s", buf);
+  if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
+    clienterror(fd, buf, "400", "Bad Request",
+                "Tiny could not parse the request line");
+    return;
+  }
+  if (strcasecmp(method, "GET")) {  // line:netp:doit:beginrequesterr
+    clienterror(fd, method, "501", "Not Implemented",
+                "Tiny does not implement this method");
+    return;
+  }  // line:netp:doit:endrequesterr
+  read_requesthdrs(&rio, &hdrs);  // line:netp:doit:readrequesthdrs
+
+  /* Parse URI from GET request */
+  is_static = parse_uri(uri, filename, cgiargs);  // line:netp:doit:staticcheck
+  if (stat(filename, &sbuf) < 0) {  // line:netp:doit:beginnotfound
+    clienterror(fd, filename, "404", "Not found",
+                "Tiny couldn't find this file");
+    return;
+  }  // line:netp:doit:endnotfound
+
+  if (is_static) { /* Serve static content */
+    if (!(S_ISREG(sbuf.st_mode)) ||
+        !(S_IRUSR & sbuf.st_mode)) {  // line:netp:doit:readable
+      clienterror(fd, filename, "403", "Forbidden",
+                  "Tiny couldn't read the file");
+      return;
+    }
+    serve_static(fd, filename, &sbuf, &hdrs);  // line:netp:doit:servestatic
+  } else {                     /* Serve dynamic content */
+    if (!(S_ISREG(sbuf.st_mode)) ||
+        !(S_IXUSR & sbuf.st_mode)) {  // line:netp:doit:executable
+      clienterror(fd, filename, "403", "Forbidden",
+                  "Tiny couldn't run the CGI program");
+      return;
+    }
+    serve_dynamic(fd, filename, cgiargs);  // line:netp:doit:servedynamic
+  }
+}
+/* $end doit */
+
+/*
+ * read_requesthdrs - read HTTP request headers, remembering the ones
+ *     that change how the response is built
+ */
+/* $begin read_requesthdrs */
+void read_requesthdrs(rio_t *rp, reqhdrs_t *hdrs) {
+  char buf[MAXLINE], *p, *dst;
+
+  hdrs->range[0] = '\0';
+  hdrs->if_none_match[0] = '\0';
+  hdrs->if_modified_since[0] = '\0';
+  while (Rio_readlineb(rp, buf, MAXLINE) > 0) {
+    if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+      break;
+    printf("%s", buf);
+    if (!strncasecmp(buf, "Range:", 6))
+      dst = hdrs->range;
+    else if (!strncasecmp(buf, "If-None-Match:", 14))
+      dst = hdrs->if_none_match;
+    else if (!strncasecmp(buf, "If-Modified-Since:", 18))
+      dst = hdrs->if_modified_since;
+    else
+      continue;
+    for (p = strchr(buf, ':') + 1; *p == ' ' || *p == '\t'; p++)
+      ;
+    strcpy(dst, p);
+    dst[strcspn(dst, "\r\n")] = '\0';
+  }
+}
+/* $end read_requesthdrs */
+
+/*
+ * parse_uri - parse URI into filename and CGI args
+ *             return 0 if dynamic content, 1 if static
+ */
+/* $begin parse_uri */
+int parse_uri(char *uri, char *filename, char *cgiargs) {
+  char *ptr;
+
+  if (!strstr(uri, "cgi-bin")) { /* Static content */ // line:netp:parseuri:isstatic
+    strcpy(cgiargs, "");                             // line:netp:parseuri:clearcgi
+    strcpy(filename, ".");    // line:netp:parseuri:beginconvert1
+    strcat(filename, uri);    // line:netp:parseuri:endconvert1
+    if (uri[strlen(uri) - 1] == '/')  // line:netp:parseuri:slashcheck
+      strcat(filename, "home.html");  // line:netp:parseuri:appenddefault
+    return 1;
+  } else { /* Dynamic content */ // line:netp:parseuri:isdynamic
+    ptr = index(uri, '?');       // line:netp:parseuri:beginextract
+    if (ptr) {
+      strcpy(cgiargs, ptr + 1);
+      *ptr = '\0';
+    } else
+      strcpy(cgiargs, "");  // line:netp:parseuri:endextract
+    strcpy(filename, ".");  // line:netp:parseuri:beginconvert2
+    strcat(filename, uri);  // line:netp:parseuri:endconvert2
+    return 0;
+  }
+}
+/* $end parse_uri */
+
+/*
+ * serve_static - copy a file (or the requested byte ranges of it)
+ *     back to the client
+ */
+/* $begin serve_static */
+void serve_static(int fd, char *filename, struct stat *sbuf, reqhdrs_t *hdrs) {
+  int srcfd, i, nranges, filesize = sbuf->st_size;
+  char *srcp, filetype[64], buf[MAXBUF], etag[64], lastmod[64];
+  byterange_t ranges[MAXRANGES];
+  long total;
+
+  make_validators(sbuf, etag, lastmod);
+  if (not_modified(hdrs, sbuf, etag)) { /* Client's copy is current */
+    sprintf(buf, "HTTP/1.0 304 Not Modified\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Server: Tiny Web Server\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Connection: close\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "ETag: %s\r\n", etag);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Last-Modified: %s\r\n\r\n", lastmod);
+    Rio_writen(fd, buf, strlen(buf));
+    return;
+  }
+
+  nranges = parse_range(hdrs->range, filesize, ranges);
+  if (nranges < 0) { /* Syntactically fine, but nothing satisfiable */
+    sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Server: Tiny Web Server\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Connection: close\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-Range: bytes */%d\r\n", filesize);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-length: 0\r\n\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    return;
+  }
+
+  /* Map the file before committing to a response */
+  get_filetype(filename, filetype);  // line:netp:servestatic:getfiletype
+  srcfd = Open(filename, O_RDONLY, 0);  // line:netp:servestatic:open
+  srcp = filesize ? Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0)
+                  : NULL;  // line:netp:servestatic:mmap
+  Close(srcfd);            // line:netp:servestatic:close
+
+  /* Send response headers to client */
+  if (nranges == 0) { /* Whole file */
+    sprintf(buf, "HTTP/1.0 200 OK\r\n");  // line:netp:servestatic:beginserve
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Server: Tiny Web Server\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Connection: close\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Accept-Ranges: bytes\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "ETag: %s\r\n", etag);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Last-Modified: %s\r\n", lastmod);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-length: %d\r\n", filesize);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
+    Rio_writen(fd, buf, strlen(buf));  // line:netp:servestatic:endserve
+    if (filesize)
+      Rio_writen(fd, srcp, filesize);  // line:netp:servestatic:write
+  } else if (nranges == 1) { /* One range: 206 with Content-Range */
+    sprintf(buf, "HTTP/1.0 206 Partial Content\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Server: Tiny Web Server\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Connection: close\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Accept-Ranges: bytes\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "ETag: %s\r\n", etag);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Last-Modified: %s\r\n", lastmod);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-Range: bytes %ld-%ld/%d\r\n", ranges[0].first,
+            ranges[0].last, filesize);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-length: %ld\r\n",
+            ranges[0].last - ranges[0].first + 1);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
+    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, srcp + ranges[0].first,
+               ranges[0].last - ranges[0].first + 1);
+  } else { /* Several ranges: multipart/byteranges */
+    /* Size the body up front so the client gets a Content-length */
+    total = strlen("\r\n--" BOUNDARY "--\r\n");
+    for (i = 0; i < nranges; i++) {
+      total += sprintf(buf,
+                       "\r\n--" BOUNDARY
+                       "\r\nContent-type: %s\r\n"
+                       "Content-Range: bytes %ld-%ld/%d\r\n\r\n",
+                       filetype, ranges[i].first, ranges[i].last, filesize);
+      total += ranges[i].last - ranges[i].first + 1;
+    }
+
+    sprintf(buf, "HTTP/1.0 206 Partial Content\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Server: Tiny Web Server\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Connection: close\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Accept-Ranges: bytes\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "ETag: %s\r\n", etag);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Last-Modified: %s\r\n", lastmod);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-length: %ld\r\n", total);
+    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "Content-type: multipart/byteranges; boundary=%s\r\n\r\n",
+            BOUNDARY);
+    Rio_writen(fd, buf, strlen(buf));
+    for (i = 0; i < nranges; i++) {
+      sprintf(buf,
+              "\r\n--" BOUNDARY
+              "\r\nContent-type: %s\r\n"
+              "Content-Range: bytes %ld-%ld/%d\r\n\r\n",
+              filetype, ranges[i].first, ranges[i].last, filesize);
+      Rio_writen(fd, buf, strlen(buf));
+      Rio_writen(fd, srcp + ranges[i].first,
+                 ranges[i].last - ranges[i].first + 1);
+    }
+    sprintf(buf, "\r\n--" BOUNDARY "--\r\n");
+    Rio_writen(fd, buf, strlen(buf));
+  }
+  if (filesize)
+    Munmap(srcp, filesize);  // line:netp:servestatic:munmap
+}
+
+/*
+ * parse_range - resolve a "bytes=a-b, c-, -n" Range value against a file
+ *     of filesize bytes. Returns the number of satisfiable ranges stored
+ *     in ranges[], 0 if the whole file should be sent (no header, a
+ *     header we do not understand, or too many ranges), and -1 if the
+ *     header is valid but none of its ranges overlap the file.
+ */
+int parse_range(char *range, long filesize, byterange_t *ranges) {
+  char *p, *end;
+  long first, last;
+  int n = 0, seen = 0;
+
+  if (strncasecmp(range, "bytes=", 6))
+    return 0;
+
+  for (p = range + 6; *p;) {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      p++;
+    if (!*p)
+      break;
+    if (*p == '-') { /* Suffix range: the last N bytes */
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < 0)
+        return 0;
+      first = filesize - last;
+      if (first < 0)
+        first = 0;
+      last = filesize - 1;
+      if (filesize == 0)
+        first = 1; /* Zero-length suffix is never satisfiable */
+    } else {
+      first = strtol(p, &end, 10);
+      if (end == p || *end != '-' || first < 0)
+        return 0;
+      p = end + 1;
+      if (*p >= '0' && *p <= '9') {
+        last = strtol(p, &end, 10);
+        if (last < first)
+          return 0;
+      } else {
+        last = filesize - 1;
+        end = p;
+      }
+      if (last > filesize - 1)
+        last = filesize - 1;
+    }
+    p = end;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p && *p != ',')
+      return 0;
+
+    seen++;
+    if (first > last) /* Starts beyond end of file */
+      continue;
+    if (n == MAXRANGES)
+      return 0;
+    ranges[n].first = first;
+    ranges[n].last = last;
+    n++;
+  }
+  if (!seen)
+    return 0;
+  return n ? n : -1;
+}
+
+/*
+ * make_validators - build the ETag and Last-Modified values for a file.
+ *     The ETag changes whenever the file's mtime or size does.
+ */
+void make_validators(struct stat *sbuf, char *etag, char *lastmod) {
+  struct tm tm;
+
+  sprintf(etag, "\"%lx-%lx\"", (long)sbuf->st_mtime, (long)sbuf->st_size);
+  gmtime_r(&sbuf->st_mtime, &tm);
+  strftime(lastmod, 64, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * not_modified - return 1 if the request's validators show that the
+ *     client already holds the current version of the file. As in RFC
+ *     7232, If-Modified-Since is only consulted without If-None-Match.
+ */
+int not_modified(reqhdrs_t *hdrs, struct stat *sbuf, char *etag) {
+  char *p;
+  size_t len = strlen(etag);
+  struct tm tm;
+
+  if (hdrs->if_none_match[0]) {
+    if (!strcmp(hdrs->if_none_match, "*"))
+      return 1;
+    for (p = hdrs->if_none_match; (p = strstr(p, etag)) != NULL; p += len)
+      if ((p == hdrs->if_none_match || p[-1] == ' ' || p[-1] == ',' ||
+           p[-1] == '/') &&
+          (p[len] == '\0' || p[len] == ',' || p[len] == ' '))
+        return 1; /* Weak comparison: W/"..." matches too */
+    return 0;
+  }
+  if (hdrs->if_modified_since[0]) {
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(hdrs->if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+      return sbuf->st_mtime <= timegm(&tm);
+  }
+  return 0;
+}
+/* $end serve_static */
+
+/*
+ * get_filetype - derive file type from file name
+ */
+void get_filetype(char *filename, char *filetype) {
+  if (strstr(filename, ".html"))
+    strcpy(filetype, "text/html");
+  else if (strstr(filename, ".gif"))
+    strcpy(filetype, "image/gif");
+  else if (strstr(filename, ".png"))
+    strcpy(filetype, "image/png");
+  else if (strstr(filename, ".jpg"))
+    strcpy(filetype, "image/jpeg");
+  else
+    strcpy(filetype, "text/plain");
+}
+
+/*
+ * serve_dynamic - run a CGI program on behalf of the client
+ */
+/* $begin serve_dynamic */
+void serve_dynamic(int fd, char *filename, char *cgiargs) {
+  char buf[MAXLINE], *emptylist[] = {NULL};
+
+  /* Return first part of HTTP response */
+  sprintf(buf, "HTTP/1.0 200 OK\r\n");
+  Rio_writen(fd, buf, strlen(buf));
+  sprintf(buf, "Server: Tiny Web Server\r\n");
+  Rio_writen(fd, buf, strlen(buf));
+
+  if (Fork() == 0) { /* Child */ // line:netp:servedynamic:fork
+    /* Real server would set all CGI vars here */
+    setenv("QUERY_STRING", cgiargs, 1);  // line:netp:servedynamic:setenv
+    Dup2(fd, STDOUT_FILENO); /* Redirect stdout to client */ // line:netp:servedynamic:dup2
+    Execve(filename, emptylist, environ); /* Run CGI program */ // line:netp:servedynamic:execve
+  }
+  Wait(NULL); /* Parent waits for and reaps child */ // line:netp:servedynamic:wait
+}
+/* $end serve_dynamic */
+
+/*
+ * clienterror - returns an error message to the client
+ */
+/* $begin clienterror */
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg) {
+  char buf[MAXLINE];
+
+  /* Print the HTTP response headers */
+  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+  Rio_writen(fd, buf, strlen(buf));
+  sprintf(buf, "Content-type: text/html\r\n\r\n");
+  Rio_writen(fd, buf, strlen(buf));
+
+  /* Print the HTTP response body */
+  sprintf(buf, "<html><title>Tiny Error</title>");
+  Rio_writen(fd, buf, strlen(buf));
+  sprintf(buf,
+          "<body bgcolor="
+          "ffffff"
+          ">\r\n");
+  Rio_writen(fd, buf, strlen(buf));
+  sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
+  Rio_writen(fd, buf, strlen(buf));
+  sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
+  Rio_writen(fd, buf, strlen(buf));
+  sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
+  Rio_writen(fd, buf, strlen(buf));
+}
+/* $end clienterror */
@@ -0,0 +1,101 @@
+/*
+ * uri.c - canonical cache keys and their hash
+ *
+ * Clients spell the same resource in different ways: "HTTP://Example.
+ * COM:80/%7euser" and "http://example.com/~user" are one URI (RFC 3986,
+ * section 6.2.2), and "/~user" with "Host: example.com" is another
+ * spelling still. Used as they come, each spelling is a cache key of
+ * its own and misses on its own. uri_normalize() turns an absolute
+ * http:// URI into the one spelling the cache keys on:
+ *
+ *   - the scheme and host in lower case,
+ *   - no port if it is the default, 80, or empty,
+ *   - "/" for an empty path,
+ *   - percent-encoded unreserved characters (letters, digits, "-",
+ *     ".", "_" and "~") decoded, and the hex digits of all other
+ *     escapes in upper case,
+ *   - no fragment. Clients should never send one, and a "#" in a key
+ *     would clash with the keys of segments (see cache.h).
+ *
+ * Every module that indexes objects by key (the cache, its shared and
+ * disk tiers, the peer ring and the doorkeeper) does so by uri_hash()
+ * of the key, which a request computes once and passes along.
+ */
+#include <ctype.h>
+#include "uri.h"
+
+static int hexval(int c) {
+  return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+static int unreserved(int c) {
+  return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/*
+ * uri_normalize - write the canonical form of the absolute http:// URI
+ *     src to dst, which must have room for strlen(src) + 2 bytes.
+ *     Returns 0 on success, -1 if src is not such a URI.
+ */
+int uri_normalize(char *dst, const char *src) {
+  const char *s = src + 7;
+  char *d = dst + 7, *host = d, *colon = NULL, *p;
+  int c;
+
+  if (strncasecmp(src, "http://", 7))
+    return -1;
+  memcpy(dst, "http://", 7);
+
+  /* Host, and port unless it is the default */
+  while (*s && *s != '/' && *s != '?' && *s != '#')
+    *d++ = tolower((unsigned char)*s++);
+  for (p = host; p < d; p++)
+    if (*p == ':')
+      colon = p;
+  if (colon == host)
+    return -1; /* A port with no host */
+  if (colon && (d - colon == 1 || (d - colon == 3 && !memcmp(colon, ":80", 3))))
+    d = colon;
+  if (d == host)
+    return -1;
+
+  /* Path and query */
+  if (*s != '/')
+    *d++ = '/';
+  while (*s && *s != '#') {
+    if (s[0] == '%' && isxdigit((unsigned char)s[1]) &&
+        isxdigit((unsigned char)s[2])) {
+      c = hexval((unsigned char)s[1]) * 16 + hexval((unsigned char)s[2]);
+      if (unreserved(c))
+        *d++ = c;
+      else {
+        *d++ = '%';
+        *d++ = toupper((unsigned char)s[1]);
+        *d++ = toupper((unsigned char)s[2]);
+      }
+      s += 3;
+    } else
+      *d++ = *s++;
+  }
+  *d = '\0';
+  return 0;
+}
+
+/*
+ * uri_hash - hash a cache key: FNV-1a, with a final mix so that keys
+ *     that differ only at the end land far apart
+ */
+uint64_t uri_hash(const char *key) {
+  uint64_t h = 14695981039346656037ull;
+
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 1099511628211ull;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
@@ -0,0 +1,13 @@
+/*
+ * uri.h - canonical cache keys and their hash
+ */
+#ifndef __URI_H__
+#define __URI_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+int uri_normalize(char *dst, const char *src);
+uint64_t uri_hash(const char *key);
+
+#endif /* __URI_H__ */
@@ -0,0 +1,135 @@
+/*
+ * vary.c - cache keys of the variants of a response that varies
+ *
+ * A response with a Vary header is only good for requests that send
+ * the same values of the headers it names; one that varies on
+ * Accept-Encoding, say, may be gzipped for one client and not for the
+ * next. Such a response is cached in two parts. The primary entry,
+ * under the URI's own key, holds just the Vary list: the header names,
+ * lower-cased and comma-separated, as vary_list() makes it. The
+ * response itself is cached as a variant, under the primary's key with
+ * "#v" and the 64-bit vary_select() hash of the request's values of
+ * those headers added, so a request looks up the primary, then the
+ * variant its own headers select.
+ *
+ * The values are compared as the origin would read them: whitespace
+ * around commas and at either end does not count, and runs of it
+ * count as one space. A header the request lacks selects differently
+ * from one it sends empty. A response that varies on "*" can never be
+ * reused, and is not cached.
+ */
+#include <ctype.h>
+#include "vary.h"
+
+/* Add the byte c to the FNV-1a hash h */
+static inline uint64_t mix(uint64_t h, int c) {
+  h ^= (unsigned char)c;
+  return h * 1099511628211ull;
+}
+
+static inline int space(int c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Add the header value from p to end to h, with its whitespace evened out */
+static uint64_t mix_value(uint64_t h, const char *p, const char *end) {
+  int pending = 0;
+
+  for (; p < end && space(*p); p++)
+    ;
+  for (; p < end; p++) {
+    if (space(*p))
+      pending = 1;
+    else if (*p == ',') {
+      h = mix(h, ',');
+      pending = 0;
+      while (p + 1 < end && space(p[1]))
+        p++;
+    } else {
+      if (pending)
+        h = mix(h, ' ');
+      pending = 0;
+      h = mix(h, *p);
+    }
+  }
+  return h;
+}
+
+/*
+ * vary_list - add the header names in the Vary header value to list,
+ *     which holds VARY_MAX + 1 bytes and starts out empty. Returns 0 on
+ *     success, -1 if the value is "*" or the list would grow too long.
+ */
+int vary_list(char *list, const char *value) {
+  size_t n = strlen(list), len, i;
+  const char *p;
+
+  for (p = value;; p += len) {
+    p += strspn(p, " \t,");
+    if ((len = strcspn(p, " \t,\r\n")) == 0)
+      break;
+    if (len == 1 && *p == '*')
+      return -1;
+    if (n + (n > 0) + len > VARY_MAX)
+      return -1;
+    if (n > 0)
+      list[n++] = ',';
+    for (i = 0; i < len; i++)
+      list[n++] = tolower((unsigned char)p[i]);
+  }
+  list[n] = '\0';
+  return 0;
+}
+
+/*
+ * vary_select - hash the values that the request header lines in hdrs
+ *     give the headers in list, which select one variant. The lines
+ *     end at a NUL or a blank line.
+ */
+uint64_t vary_select(const char *list, const char *hdrs) {
+  uint64_t h = 14695981039346656037ull;
+  const char *name, *line, *eol;
+  size_t len, i;
+
+  for (name = list; *name; name += len + (name[len] == ',')) {
+    len = strcspn(name, ",");
+    for (i = 0; i < len; i++)
+      h = mix(h, name[i]);
+    for (line = hdrs; *line && *line != '\r' && *line != '\n';
+         line = *eol ? eol + 1 : eol) {
+      eol = line + strcspn(line, "\n");
+      if (strncasecmp(line, name, len) || line[len] != ':')
+        continue;
+      h = mix_value(mix(h, ':'), line + len + 1, eol);
+    }
+    h = mix(h, '\n');
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * vary_primary - return the length of the key of the primary entry of
+ *     the variant cached under key, or 0 if key is not a variant's key
+ */
+size_t vary_primary(const char *key) {
+  size_t len = strlen(key), n = len - (VARY_KEYLEN - 1);
+
+  if (len <= VARY_KEYLEN - 1 || key[n] != '#' || key[n + 1] != 'v' ||
+      strspn(key + n + 2, "0123456789abcdef") != VARY_KEYLEN - 3)
+    return 0;
+  return n;
+}
+
+/*
+ * vary_key - build the key under which the variant sel of the object
+ *     whose primary entry is under key is cached. buf must have room
+ *     for strlen(key) + VARY_KEYLEN bytes.
+ */
+void vary_key(char *buf, const char *key, uint64_t sel) {
+  sprintf(buf, "%s#v%016llx", key, (unsigned long long)sel);
+}
@@ -0,0 +1,23 @@
+/*
+ * vary.h - cache keys of the variants of a response that varies
+ */
+#ifndef __VARY_H__
+#define __VARY_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* Longest Vary list, in bytes, that a response is cached under */
+#ifndef VARY_MAX
+#define VARY_MAX 128
+#endif
+
+/* Bytes a variant key adds to the key of its primary entry, with NUL */
+#define VARY_KEYLEN 19
+
+int vary_list(char *list, const char *value);
+uint64_t vary_select(const char *list, const char *hdrs);
+void vary_key(char *buf, const char *key, uint64_t sel);
+size_t vary_primary(const char *key);
+
+#endif /* __VARY_H__ */
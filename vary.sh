@@ -0,0 +1,158 @@
+#!/bin/bash
+#
+# vary.sh - Checks how the proxy caches responses that vary on
+#     Accept-Encoding. Starts synth, whose vary=1 objects are gzipped
+#     for clients that accept gzip, and a proxy on loopback, once with a
+#     private cache and once with a cache shared by -P workers. For
+#     each, it fetches one object with and without gzip, and checks
+#     that both answers echo the origin's Vary header and carry the
+#     body each client asked for; that both come again from the cache;
+#     and, once the cache has been filled with other objects until the
+#     object's primary entry is evicted, that both are fetched again
+#     and are still each the right variant.
+#
+#     usage: ./vary.sh
+#
+#     Exits with 1 if a check fails.
+#
+
+OBJECT="/vary?size=30000&maxage=600&vary=1"
+FILL=30 # Objects of about 50 KB to fill the cache with
+TMP=vary.tmp
+
+#
+# wait_for_port - Spins until something accepts connections on the TCP
+#     port passed as an argument. Gives up after 5 seconds.
+#
+function wait_for_port {
+    for i in `seq 50`
+    do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2> /dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing is listening on port $1"
+    exit 1
+}
+
+#
+# lookup_misses - Prints how many lookups of the cache found nothing, over
+#     all the processes sharing it
+#
+function lookup_misses {
+    curl --silent http://localhost:${proxy_port}/__proxy/stats | awk '
+        /^proxy_cache_lookups_total/ { n += $2 }
+        /^proxy_cache_lookup_hits_total/ { n -= $2 }
+        END { print n }'
+}
+
+#
+# fetch - Fetches the object through the proxy, asking for gzip if the
+#     first argument is gzip, and checks the answer, and that the cache
+#     had it if the second argument is hit, or missed it if it is miss.
+#     Prints what was wrong, if anything.
+#
+function fetch {
+    before=`lookup_misses`
+    if [ "$1" == "gzip" ]
+    then
+        curl --silent --dump-header ${TMP}.hdr --output ${TMP}.body \
+            --header "Accept-Encoding: gzip" --proxy localhost:${proxy_port} \
+            "http://localhost:${synth_port}${OBJECT}"
+        got=`gunzip --stdout ${TMP}.body 2> /dev/null | md5sum`
+    else
+        curl --silent --dump-header ${TMP}.hdr --output ${TMP}.body \
+            --proxy localhost:${proxy_port} \
+            "http://localhost:${synth_port}${OBJECT}"
+        got=`md5sum < ${TMP}.body`
+    fi
+    after=`lookup_misses`
+    if [ ${after} -eq ${before} ]
+    then
+        result=hit
+    else
+        result=miss
+    fi
+    echo "$1: ${result}"
+    if [ "$2" != "${result}" ]
+    then
+        echo "FAIL: expected a $2"
+        failed=1
+    fi
+    if ! grep -qi "^Vary: *Accept-Encoding" ${TMP}.hdr
+    then
+        echo "FAIL: the $1 answer does not echo Vary"
+        failed=1
+    fi
+    if grep -qi "^Content-Encoding: *gzip" ${TMP}.hdr
+    then
+        encoding=gzip
+    else
+        encoding=identity
+    fi
+    if [ "$1" != "${encoding}" ]
+    then
+        echo "FAIL: asked for $1, and was sent ${encoding}"
+        failed=1
+    elif [ "${got}" != "${want}" ]
+    then
+        echo "FAIL: the $1 answer has the wrong body"
+        failed=1
+    fi
+}
+
+function cleanup {
+    kill ${synth_pid} ${proxy_pid} 2> /dev/null
+    wait 2> /dev/null
+    rm -f ${TMP}.hdr ${TMP}.body
+}
+trap cleanup EXIT
+
+if [ ! -x ./proxy -o ! -x ./synth ]
+then
+    echo "Error: build proxy and synth first (make)"
+    exit 1
+fi
+
+synth_port=`./free-port.sh`
+./synth ${synth_port} &> /dev/null &
+synth_pid=$!
+wait_for_port ${synth_port}
+want=`curl --silent "http://localhost:${synth_port}${OBJECT}" | md5sum`
+failed=0
+
+for procs in 1 2
+do
+    echo "== ${procs} process(es)"
+    proxy_port=`./free-port.sh`
+    if [ ${procs} -eq 1 ]
+    then
+        ./proxy ${proxy_port} &> /dev/null &
+    else
+        ./proxy -P ${procs} ${proxy_port} &> /dev/null &
+    fi
+    proxy_pid=$!
+    wait_for_port ${proxy_port}
+
+    fetch gzip miss
+    fetch identity miss
+    fetch gzip hit
+    fetch identity hit
+
+    for i in `seq ${FILL}`
+    do
+        curl --silent --output /dev/null --proxy localhost:${proxy_port} \
+            "http://localhost:${synth_port}/fill/$i?size=$((50000 + i))&maxage=600"
+    done
+    evictions=`curl --silent http://localhost:${proxy_port}/__proxy/stats \
+        | awk '/^proxy_cache_evictions_total/ { print $2 }'`
+    echo "filled with ${FILL} objects: ${evictions} evictions"
+    fetch gzip miss
+    fetch identity miss
+    fetch gzip hit
+    fetch identity hit
+
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+done
+[ ${failed} -eq 0 ] && echo "PASS"
+exit ${failed}